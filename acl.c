@@ -0,0 +1,394 @@
+/*
+ * Copyright (C) 2002-2006 Josh A. Beam
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * the access list that decides which clients may connect (-T, --deny
+ * and --acl). rules allow or deny a prefix of IPv4 or IPv6 addresses,
+ * and the longest prefix that matches a client's address decides;
+ * with nothing matching, the client is turned away. loopback
+ * addresses are allowed unless a rule says otherwise, and denying a
+ * prefix wins over allowing the same one. allow rules read from a
+ * file can carry limits (see limit.c), which apply to the clients
+ * that rule decides for.
+ *
+ * each family has a trie of PRT_ACL_STRIDE bits per level, with rules
+ * whose length isn't a multiple of the stride spread over every slot
+ * they cover. looking an address up takes at most one step per level
+ * (8 for IPv4, 32 for IPv6) however many rules there are.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "prtunnel.h"
+
+#define PRT_ACL_STRIDE 4
+#define PRT_ACL_SLOTS (1 << PRT_ACL_STRIDE)
+
+/* what a slot says about the addresses under it */
+#define PRT_ACL_NONE 0
+#define PRT_ACL_ALLOW 1
+#define PRT_ACL_DENY 2
+
+/* longest address or host name given in a rule */
+#define PRT_ACL_RULE_MAX 256
+
+extern int resolve_host_all(const char *hostname, int family, struct prt_address *addresses, unsigned int max);
+extern char *get_address_string(const unsigned char *addr, unsigned char is_ipv6_address, char *addrstr);
+
+/* limit functions */
+extern struct prt_limit *prt_limit_new(unsigned int max_tunnels, unsigned int conn_rate, unsigned long up, unsigned long down);
+
+struct prt_acl_node {
+	unsigned char verdict[PRT_ACL_SLOTS];
+	unsigned char length[PRT_ACL_SLOTS]; /* bits of the slot the verdict's rule covers */
+	struct prt_limit *limit[PRT_ACL_SLOTS]; /* that rule's limits, if any */
+	struct prt_acl_node *child[PRT_ACL_SLOTS];
+};
+
+static struct prt_acl_node *acl_v4 = NULL;
+static struct prt_acl_node *acl_v6 = NULL;
+static unsigned int acl_rules = 0;
+
+/* returns the slot address's bits at the given level of a trie fall in */
+static unsigned int
+acl_slot(const unsigned char *address, unsigned int level)
+{
+	unsigned int bit = level * PRT_ACL_STRIDE;
+
+	return (address[bit / 8] >> (8 - PRT_ACL_STRIDE - bit % 8)) & (PRT_ACL_SLOTS - 1);
+}
+
+/*
+ * has the first bits bits of address get verdict (and limit) in the
+ * trie at *root, unless a longer prefix already says otherwise; given
+ * the same prefix, denying wins. returns 0 on success or -1 on error.
+ */
+static int
+acl_insert(struct prt_acl_node **root, const unsigned char *address,
+           unsigned int bits, unsigned char verdict, struct prt_limit *limit)
+{
+	struct prt_acl_node *node;
+	unsigned int levels, rest, first, count, i, slot;
+
+	levels = bits / PRT_ACL_STRIDE;
+	rest = bits % PRT_ACL_STRIDE;
+	if(rest == 0 && levels > 0) {
+		levels--;
+		rest = PRT_ACL_STRIDE;
+	}
+
+	if(!*root) {
+		*root = calloc(1, sizeof(struct prt_acl_node));
+		if(!*root)
+			return -1;
+	}
+	node = *root;
+	for(i = 0; i < levels; i++) {
+		slot = acl_slot(address, i);
+		if(!node->child[slot]) {
+			node->child[slot] = calloc(1, sizeof(struct prt_acl_node));
+			if(!node->child[slot])
+				return -1;
+		}
+		node = node->child[slot];
+	}
+
+	/* a /0 at the root covers every slot */
+	count = 1 << (PRT_ACL_STRIDE - rest);
+	first = rest ? (acl_slot(address, levels) & ~(count - 1)) : 0;
+	for(slot = first; slot < first + count; slot++) {
+		if(node->verdict[slot] == PRT_ACL_NONE || node->length[slot] < rest ||
+		   (node->length[slot] == rest && verdict == PRT_ACL_DENY)) {
+			node->verdict[slot] = verdict;
+			node->length[slot] = rest;
+			node->limit[slot] = limit;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * returns the verdict of the longest prefix of address in the trie at
+ * root, and sets *limit to its limits
+ */
+static unsigned char
+acl_lookup(const struct prt_acl_node *node, const unsigned char *address,
+           unsigned int bits, struct prt_limit **limit)
+{
+	unsigned char verdict = PRT_ACL_NONE;
+	unsigned int i, slot;
+
+	*limit = NULL;
+	for(i = 0; node && i < bits / PRT_ACL_STRIDE; i++) {
+		slot = acl_slot(address, i);
+		if(node->verdict[slot] != PRT_ACL_NONE) {
+			verdict = node->verdict[slot];
+			*limit = node->limit[slot];
+		}
+		node = node->child[slot];
+	}
+
+	return verdict;
+}
+
+/*
+ * adds a rule giving verdict and limit (which may be NULL) to s, an
+ * address or host name optionally followed by /bits; a host name with
+ * several addresses gets a rule for each. quiet keeps the rule from
+ * being announced. returns 0 on success or -1 on error.
+ */
+static int
+acl_add(const char *s, unsigned char verdict, struct prt_limit *limit, int quiet)
+{
+	char host[PRT_ACL_RULE_MAX], *slash, *end;
+	struct prt_address addresses[PRT_ADDRESSES_MAX];
+	char addrstr[ADDRESS_STRING_MAX];
+	unsigned int max;
+	long bits = -1;
+	int i, n;
+
+	if(strlen(s) >= sizeof(host)) {
+		fprintf(stderr, "Error: Address %s is too long\n", s);
+		return -1;
+	}
+	strcpy(host, s);
+
+	slash = strchr(host, '/');
+	if(slash) {
+		*slash = '\0';
+		bits = strtol(slash + 1, &end, 10);
+		if(slash[1] == '\0' || *end != '\0' || bits < 0 || bits > 128) {
+			fprintf(stderr, "Error: Bad bitcheck number (%s) for address %s\n", slash + 1, host);
+			return -1;
+		}
+	}
+
+	n = resolve_host_all(host, AF_UNSPEC, addresses, PRT_ADDRESSES_MAX);
+	if(n == -1) {
+		fprintf(stderr, "Error: Unable to resolve hostname %s for trusted addresses\n", host);
+		return -1;
+	}
+
+	for(i = 0; i < n; i++) {
+		max = (addresses[i].family == AF_INET) ? 32 : 128;
+		if(bits > (long)max) {
+			fprintf(stderr, "Error: Bad bitcheck number (%ld) for address %s; must be 0 to %u\n", bits, host, max);
+			return -1;
+		}
+		if(acl_insert((addresses[i].family == AF_INET) ? &acl_v4 : &acl_v6,
+		              addresses[i].address, (bits == -1) ? max : (unsigned int)bits,
+		              verdict, limit) == -1) {
+			fprintf(stderr, "acl_add(): Memory allocation failed\n");
+			return -1;
+		}
+		acl_rules++;
+
+		if(quiet)
+			continue;
+		fprintf(stderr, "Added %s address %s", (verdict == PRT_ACL_ALLOW) ? "trusted" : "denied", get_address_string(addresses[i].address, addresses[i].family == AF_INET6, addrstr));
+		if(bits > -1)
+			fprintf(stderr, ", comparing only the first %ld bits", bits);
+		fprintf(stderr, "\n");
+	}
+
+	return 0;
+}
+
+/* allows clients from s (see acl_add()) */
+void
+add_trusted_address(char *s)
+{
+	if(s)
+		acl_add(s, PRT_ACL_ALLOW, NULL, 0);
+}
+
+/* turns clients from s away (see acl_add()); returns 0 on success or -1 on error */
+int
+add_denied_address(char *s)
+{
+	return acl_add(s, PRT_ACL_DENY, NULL, 0);
+}
+
+/*
+ * reads limits from the words left on the line strtok() is working
+ * through, as name=value (see load_trusted_addresses()), and sets
+ * *limit to a set of them, or NULL if there weren't any. returns 0
+ * on success or -1 on error.
+ */
+static int
+acl_read_limits(const char *filename, unsigned int lineno, struct prt_limit **limit)
+{
+	unsigned long tunnels = 0, conns = 0, up = 0, down = 0, value, *which;
+	char *word, *equals, *end;
+	int any = 0;
+
+	*limit = NULL;
+	while((word = strtok(NULL, " \t\r\n"))) {
+		equals = strchr(word, '=');
+		if(!equals) {
+			fprintf(stderr, "Error: %s line %u: expected name=value, not %s\n", filename, lineno, word);
+			return -1;
+		}
+		*equals = '\0';
+		value = strtoul(equals + 1, &end, 10);
+		if(equals[1] == '\0' || *end != '\0') {
+			fprintf(stderr, "Error: %s line %u: bad number %s for %s\n", filename, lineno, equals + 1, word);
+			return -1;
+		}
+
+		if(strcmp(word, "tunnels") == 0) {
+			which = &tunnels;
+		} else if(strcmp(word, "conns") == 0) {
+			which = &conns;
+		} else if(strcmp(word, "rate") == 0) {
+			up = value;
+			which = &down; /* and up */
+		} else if(strcmp(word, "up") == 0) {
+			which = &up;
+		} else if(strcmp(word, "down") == 0) {
+			which = &down;
+		} else {
+			fprintf(stderr, "Error: %s line %u: unknown limit %s\n", filename, lineno, word);
+			return -1;
+		}
+		*which = value;
+		any = 1;
+	}
+
+	if(any) {
+		*limit = prt_limit_new(tunnels, conns, up, down);
+		if(!*limit)
+			return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * reads rules from filename, one to a line: "allow" or "deny" followed
+ * by an address, or just an address to allow it. an allow rule can go
+ * on with limits for the clients it matches: tunnels=<count> open at
+ * once, conns=<count> new tunnels a second, and up=<bytes> a second
+ * from them, down=<bytes> to them, or rate=<bytes> each way. blank
+ * lines and anything after a '#' are ignored. returns 0 on success or
+ * -1 on error.
+ */
+int
+load_trusted_addresses(char *filename)
+{
+	FILE *fp;
+	char line[PRT_ACL_RULE_MAX + 256], *word, *address, *p;
+	unsigned int lineno = 0, before = acl_rules;
+	unsigned char verdict;
+	struct prt_limit *limit;
+
+	fp = fopen(filename, "r");
+	if(!fp) {
+		fprintf(stderr, "Error: Unable to open access list %s\n", filename);
+		return -1;
+	}
+
+	while(fgets(line, sizeof(line), fp)) {
+		lineno++;
+		p = strchr(line, '#');
+		if(p)
+			*p = '\0';
+
+		word = strtok(line, " \t\r\n");
+		if(!word)
+			continue;
+		if(strcmp(word, "allow") == 0) {
+			verdict = PRT_ACL_ALLOW;
+			address = strtok(NULL, " \t\r\n");
+		} else if(strcmp(word, "deny") == 0) {
+			verdict = PRT_ACL_DENY;
+			address = strtok(NULL, " \t\r\n");
+		} else {
+			verdict = PRT_ACL_ALLOW;
+			address = word;
+		}
+		if(!address) {
+			fprintf(stderr, "Error: %s line %u: %s what?\n", filename, lineno, word);
+			fclose(fp);
+			return -1;
+		}
+		if(acl_read_limits(filename, lineno, &limit) == -1) {
+			fclose(fp);
+			return -1;
+		}
+		if(limit && verdict == PRT_ACL_DENY) {
+			fprintf(stderr, "Error: %s line %u: denied clients can't have limits\n", filename, lineno);
+			free(limit);
+			fclose(fp);
+			return -1;
+		}
+
+		if(acl_add(address, verdict, limit, 1) == -1) {
+			fprintf(stderr, "Error: %s line %u: bad rule\n", filename, lineno);
+			fclose(fp);
+			return -1;
+		}
+	}
+	fclose(fp);
+
+	fprintf(stderr, "Loaded %u access list rules from %s\n", acl_rules - before, filename);
+	return 0;
+}
+
+/*
+ * returns 1 if clients from address, of the given family, are allowed
+ * to connect, and sets *limit to the limits they're under (NULL if
+ * none); otherwise returns 0. IPv4 clients of an IPv6 socket are
+ * checked against the IPv4 rules. loopback isn't in the tries, so any
+ * rule covering it (even --deny ::/0) decides ahead of the default.
+ */
+int
+is_trusted_address(int family, const unsigned char *address,
+                   struct prt_limit **limit)
+{
+	static const unsigned char v4_mapped[12] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff };
+	static const unsigned char loopback_v4[4] = { 127, 0, 0, 1 };
+	static const unsigned char loopback_v6[16] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1 };
+	unsigned char verdict;
+
+	if(family == AF_INET6 && memcmp(address, v4_mapped, sizeof(v4_mapped)) == 0) {
+		family = AF_INET;
+		address += 12;
+	}
+
+	if(family == AF_INET6) {
+		verdict = acl_lookup(acl_v6, address, 128, limit);
+		if(verdict == PRT_ACL_NONE && memcmp(address, loopback_v6, sizeof(loopback_v6)) == 0)
+			verdict = PRT_ACL_ALLOW;
+	} else {
+		verdict = acl_lookup(acl_v4, address, 32, limit);
+		if(verdict == PRT_ACL_NONE && memcmp(address, loopback_v4, sizeof(loopback_v4)) == 0)
+			verdict = PRT_ACL_ALLOW;
+	}
+
+	return verdict == PRT_ACL_ALLOW;
+}
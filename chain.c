@@ -0,0 +1,198 @@
+/*
+ * Copyright (C) 2002-2006 Josh A. Beam
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * chains of proxy servers. the proxy server a tunnel is set up through
+ * (given with -H) can be followed by more of them (given with --chain):
+ * the first is asked to connect to the second, whose handshake then
+ * runs over that tunnel, and so on, until the last is asked to connect
+ * to the remote host. each hop's handshake is left until the one
+ * before it is done, since a proxy needn't pass anything on before
+ * its tunnel is up, so a chain takes a round trip for each hop (and
+ * no more, as SOCKS5 handshakes are pipelined as usual).
+ *
+ * protocol modules find out which hop they're talking to, and what to
+ * ask it for, with prt_chain_handshake().
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include "prtunnel.h"
+
+/* protocol functions */
+extern int http_start_hop(struct prt_context *context);
+extern int http_negotiate(struct prt_context *context);
+extern int socks5_start_hop(struct prt_context *context);
+extern int socks5_negotiate(struct prt_context *context);
+
+/* upstream functions */
+extern int prt_upstream_init(struct prt_upstream *up, const char *spec, unsigned short port);
+
+static struct prt_hop hops[PRT_HOPS_MAX];
+static unsigned int num_hops = 0;
+
+/*
+ * adds a hop given as type://[username:password@]host[:port], where
+ * type is http or socks5. returns 0 on success or -1 on error.
+ */
+static int
+prt_chain_add(char *spec)
+{
+	struct prt_hop *hop;
+	unsigned short port;
+	char *p, *at, *colon;
+
+	if(num_hops == PRT_HOPS_MAX) {
+		fprintf(stderr, "Error: Too many proxy servers in chain (at most %u)\n", PRT_HOPS_MAX);
+		return -1;
+	}
+	hop = &hops[num_hops];
+
+	if(strncmp(spec, "http://", 7) == 0) {
+		hop->type = PRT_HTTP;
+		port = 8080;
+		p = spec + 7;
+	} else if(strncmp(spec, "socks5://", 9) == 0) {
+		hop->type = PRT_SOCKS5;
+		port = 1080;
+		p = spec + 9;
+	} else {
+		fprintf(stderr, "Error: Chained proxy server `%s' should start with http:// or socks5://\n", spec);
+		return -1;
+	}
+
+	hop->username = NULL;
+	hop->password = NULL;
+	at = strrchr(p, '@');
+	if(at) {
+		*at = '\0';
+		colon = strchr(p, ':');
+		if(!colon) {
+			fprintf(stderr, "Error: Chained proxy server `%s' needs a password after its username\n", spec);
+			return -1;
+		}
+		*colon = '\0';
+		hop->username = p;
+		hop->password = colon + 1;
+		p = at + 1;
+	}
+
+	if(prt_upstream_init(&hop->server, p, port) == -1)
+		return -1;
+	num_hops++;
+
+	return 0;
+}
+
+/*
+ * adds the hops in list, which are separated by commas. list is kept
+ * (and changed), so it mustn't go away. returns 0 on success or -1 on
+ * error.
+ */
+int
+set_proxy_chain(char *list)
+{
+	char *spec, *next;
+
+	for(spec = list; spec; spec = next) {
+		next = strchr(spec, ',');
+		if(next)
+			*next++ = '\0';
+		if(prt_chain_add(spec) == -1)
+			return -1;
+	}
+
+	return 0;
+}
+
+/* returns the number of hops after the first proxy server */
+unsigned int
+prt_chain_length()
+{
+	return num_hops;
+}
+
+/*
+ * fills in hs with the proxy server context's tunnel is being set up
+ * through at the moment, and where that server has to connect to
+ */
+void
+prt_chain_handshake(struct prt_context *context, struct prt_handshake *hs)
+{
+	if(context->hop == 0) {
+		hs->server = context->upstream;
+		hs->username = context->username;
+		hs->password = context->password;
+	} else {
+		hs->server = &hops[context->hop - 1].server;
+		hs->username = hops[context->hop - 1].username;
+		hs->password = hops[context->hop - 1].password;
+	}
+
+	if(context->hop < num_hops) {
+		hs->host = hops[context->hop].server.host;
+		hs->port = hops[context->hop].server.port;
+	} else {
+		hs->host = context->remotehost;
+		hs->port = context->remoteport;
+	}
+}
+
+/*
+ * moves the setting up of context's tunnel along, through as many hops
+ * as it can without blocking; this takes the place of context's
+ * negotiate function, and returns the same
+ */
+int
+prt_chain_negotiate(struct prt_context *context)
+{
+	struct prt_hop *hop;
+	int events;
+
+	for(;;) {
+		if(context->hop == 0)
+			events = context->negotiate(context);
+		else if(hops[context->hop - 1].type == PRT_SOCKS5)
+			events = socks5_negotiate(context);
+		else
+			events = http_negotiate(context);
+		if(events != 0 || context->hop == num_hops)
+			return events;
+
+		/* on to the next hop, over the same socket */
+		free(context->data);
+		context->data = NULL;
+		hop = &hops[context->hop++];
+		if(hop->type == PRT_SOCKS5) {
+			if(socks5_start_hop(context) == -1)
+				return -1;
+		} else {
+			if(http_start_hop(context) == -1)
+				return -1;
+		}
+	}
+}
@@ -25,41 +25,169 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
 #include <sys/types.h>
+#ifndef _WIN32
+#	include <fcntl.h>
+#endif /* _WIN32 */
 #include "prtunnel.h"
 
-/* read one byte from fd and return it */
+/*
+ * resolve hostname to at most max addresses of the given family
+ * (AF_INET, AF_INET6, or AF_UNSPEC for both) and store them in
+ * addresses. when both families come back they're interleaved,
+ * starting with whichever the resolver put first, so that a caller
+ * trying them in order alternates between the two (RFC 8305 section
+ * 4). returns the number of addresses stored, or -1 on error. unlike
+ * gethostbyname, this can be called from several threads at once.
+ */
 int
-read_byte(int fd)
+resolve_host_all(const char *hostname, int family, struct prt_address *addresses, unsigned int max)
 {
-	unsigned char c;
+#ifdef _WIN32
+	struct hostent *host;
+	unsigned int n;
+
+	if(family != AF_INET && family != AF_UNSPEC)
+		return -1;
+
+	host = gethostbyname(hostname);
+	if(!host)
+		return -1;
+
+	for(n = 0; n < max && host->h_addr_list[n]; n++) {
+		addresses[n].family = AF_INET;
+		memcpy(addresses[n].address, host->h_addr_list[n], 4);
+	}
+	return (n > 0) ? (int)n : -1;
+#else
+	struct addrinfo hints, *res, *ai;
+	struct prt_address found[2][PRT_ADDRESSES_MAX];
+	unsigned int count[2], taken[2], n;
+	int first, which;
+
+#ifndef IPV6
+	if(family == AF_UNSPEC)
+		family = AF_INET;
+#endif /* IPV6 */
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = family;
+	hints.ai_socktype = SOCK_STREAM;
+	if(getaddrinfo(hostname, NULL, &hints, &res) != 0)
+		return -1;
+
+	/* sort the results by family, dropping duplicates and anything else */
+	count[0] = count[1] = 0;
+	first = -1;
+	for(ai = res; ai; ai = ai->ai_next) {
+		struct prt_address a;
 
-	if(recv(fd, &c, 1, 0) != -1)
-		return c;
+		memset(&a, 0, sizeof(a));
+		a.family = ai->ai_family;
+#ifdef IPV6
+		if(ai->ai_family == AF_INET6)
+			memcpy(a.address, &((struct sockaddr_in6 *)ai->ai_addr)->sin6_addr, 16);
+		else
+#endif /* IPV6 */
+		if(ai->ai_family == AF_INET)
+			memcpy(a.address, &((struct sockaddr_in *)ai->ai_addr)->sin_addr, 4);
+		else
+			continue;
 
-	return -1;
+		which = (a.family == AF_INET) ? 0 : 1;
+		for(n = 0; n < count[which]; n++) {
+			if(memcmp(&found[which][n], &a, sizeof(a)) == 0)
+				break;
+		}
+		if(n < count[which] || count[which] == PRT_ADDRESSES_MAX)
+			continue;
+		found[which][count[which]++] = a;
+		if(first == -1)
+			first = which;
+	}
+	freeaddrinfo(res);
+	if(first == -1)
+		return -1;
+
+	/* alternate between the families, starting with the preferred one */
+	taken[0] = taken[1] = 0;
+	which = first;
+	for(n = 0; n < max && taken[0] + taken[1] < count[0] + count[1]; n++) {
+		if(taken[which] == count[which])
+			which = !which;
+		addresses[n] = found[which][taken[which]++];
+		which = !which;
+	}
+	return (int)n;
+#endif /* _WIN32 */
 }
 
 /*
- * connect to address:port; this function is used by the
- * protocol-specific connect_to functions to connect to
- * the proxy server
+ * resolve hostname to an address of the given family (AF_INET or
+ * AF_INET6) and store it in address, which must have room for 4 or
+ * 16 bytes respectively. returns 0 on success or -1 on error.
  */
 int
-establish_connection(unsigned char address[4], unsigned short port)
+resolve_host(const char *hostname, int family, unsigned char *address)
+{
+	struct prt_address a;
+
+	if(resolve_host_all(hostname, family, &a, 1) == -1)
+		return -1;
+
+	memcpy(address, a.address, (a.family == AF_INET) ? 4 : 16);
+	return 0;
+}
+
+/* puts fd in non-blocking mode; returns 0 on success or -1 on error */
+int
+set_nonblocking(int fd)
+{
+#ifdef _WIN32
+	unsigned long on = 1;
+
+	return (ioctlsocket(fd, FIONBIO, &on) == 0) ? 0 : -1;
+#else
+	int fl;
+
+	fl = fcntl(fd, F_GETFL);
+	if(fl == -1)
+		return -1;
+	return fcntl(fd, F_SETFL, fl | O_NONBLOCK);
+#endif /* _WIN32 */
+}
+
+/* returns nonzero if the last socket operation failed only because it would block */
+static int
+in_progress()
+{
+#ifdef _WIN32
+	return (WSAGetLastError() == WSAEWOULDBLOCK);
+#else
+	return (errno == EINPROGRESS || errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR);
+#endif /* _WIN32 */
+}
+
+/*
+ * start a non-blocking connection to sa, returning the socket;
+ * the connection may still be in progress (see connection_status())
+ */
+static int
+start_connection(int family, struct sockaddr *sa, unsigned int len)
 {
 	int fd;
-	struct sockaddr_in sin;
 
-	fd = socket(AF_INET, SOCK_STREAM, 0);
+	fd = socket(family, SOCK_STREAM, 0);
 	if(fd == -1)
 		return -1;
 
-	sin.sin_family = AF_INET;
-	sin.sin_port = htons(port);
-	memcpy(&sin.sin_addr, address, 4);
+	if(set_nonblocking(fd) == -1) {
+		close(fd);
+		return -1;
+	}
 
-	if(connect(fd, (struct sockaddr *)&sin, sizeof(sin)) == -1) {
+	if(connect(fd, sa, len) == -1 && !in_progress()) {
 		close(fd);
 		return -1;
 	}
@@ -67,27 +195,83 @@ establish_connection(unsigned char address[4], unsigned short port)
 	return fd;
 }
 
+/*
+ * connect to address:port; this function is used by the
+ * protocol-specific connect_to functions to connect to
+ * the proxy server. the socket is non-blocking, and the
+ * connection may still be in progress when it returns.
+ */
+int
+establish_connection(unsigned char address[4], unsigned short port)
+{
+	struct sockaddr_in sin;
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(port);
+	memcpy(&sin.sin_addr, address, 4);
+
+	return start_connection(AF_INET, (struct sockaddr *)&sin, sizeof(sin));
+}
+
 /* ipv6 version of above */
 #ifdef IPV6
 int
 establish_connection6(unsigned char address[16], unsigned short port)
 {
-	int fd;
 	struct sockaddr_in6 sin;
 
-	fd = socket(AF_INET6, SOCK_STREAM, 0);
-	if(fd == -1)
-		return -1;
-
+	memset(&sin, 0, sizeof(sin));
 	sin.sin6_family = AF_INET6;
 	sin.sin6_port = htons(port);
 	memcpy(&sin.sin6_addr, address, 16);
 
-	if(connect(fd, (struct sockaddr *)&sin, sizeof(sin)) == -1) {
-		close(fd);
+	return start_connection(AF_INET6, (struct sockaddr *)&sin, sizeof(sin));
+}
+#endif /* IPV6 */
+
+/*
+ * checks on a connection started by establish_connection(). returns
+ * 1 if it's established, 0 if it's still in progress, or -1 if it
+ * failed.
+ */
+int
+connection_status(int fd)
+{
+	int err = 0;
+	unsigned int len = sizeof(err);
+	struct sockaddr_storage ss;
+
+	if(getsockopt(fd, SOL_SOCKET, SO_ERROR, (void *)&err, &len) == -1)
+		return -1;
+	if(err) {
+		errno = err;
 		return -1;
 	}
 
-	return fd;
+	len = sizeof(ss);
+	if(getpeername(fd, (struct sockaddr *)&ss, &len) == -1)
+		return (errno == ENOTCONN) ? 0 : -1;
+
+	return 1;
+}
+
+/*
+ * sends the part of buf that hasn't been sent yet; *sent is the
+ * number of bytes already sent. returns 1 once all len bytes have
+ * been sent, 0 if the socket would block, or -1 on error.
+ */
+int
+send_pending(int fd, char *buf, unsigned int len, unsigned int *sent)
+{
+	int n;
+
+	while(*sent < len) {
+		n = send(fd, buf + *sent, len - *sent, MSG_DONTWAIT);
+		if(n == -1)
+			return in_progress() ? 0 : -1;
+		*sent += n;
+	}
+
+	return 1;
 }
-#endif /* IPV6 */
@@ -29,38 +29,50 @@
 #include <sys/types.h>
 #include "prtunnel.h"
 
-extern char *proxyhost;
-extern unsigned short proxyport;
+extern int establish_connection(unsigned char *, unsigned short);
+#ifdef IPV6
+extern int establish_connection6(unsigned char *, unsigned short);
+#endif /* IPV6 */
+extern int connection_status(int);
 
-extern int establish_connection(char *, unsigned short);
+/*
+ * the remote host is connected to directly, over whichever address
+ * family answers first when both are available
+ */
+static char *
+direct_get_server(struct prt_context *context, int *family)
+{
+#ifdef IPV6
+	*family = AF_UNSPEC;
+#else
+	*family = AF_INET;
+#endif /* IPV6 */
+	return context->remotehost;
+}
 
-/* connect to hostname:port directly */
+/* start connecting to the remote host directly */
 static int
-direct_connect_to(struct prt_context *context,
-                  char *hostname, unsigned short port,
-                  char *username, char *password, int server_timeout)
+direct_connect_to(struct prt_context *context, int family, unsigned char *address)
 {
-	int fd;
-	struct hostent *host;
-
-	host = gethostbyname(hostname);
-	if(!host)
-		return -1;
-
-	fd = establish_connection(host->h_addr, port);
-	if(fd == -1)
-		return -1;
-
-	/* set remote server socket timeout if necessary */
-	if(server_timeout) {
-		struct timeval timeout_val;
+#ifdef IPV6
+	if(family == AF_INET6)
+		return establish_connection6(address, context->remoteport);
+#endif /* IPV6 */
+	return establish_connection(address, context->remoteport);
+}
 
-		timeout_val.tv_sec = server_timeout;
-		timeout_val.tv_usec = 0;
-		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, (void *)&timeout_val, sizeof(timeout_val));
+/* there's nothing to negotiate; just wait for the connection */
+static int
+direct_negotiate(struct prt_context *context)
+{
+	switch(connection_status(context->remotefd)) {
+		case 1:
+			return 0;
+		case 0:
+			return PRT_EVENT_WRITE;
+		default:
+			return -1;
 	}
-
-	return fd;
 }
 
 static void
@@ -75,31 +87,33 @@ direct_disconnect(struct prt_context *context)
 static int
 direct_local_read(struct prt_context *context, char *buf, int size)
 {
-	return recv(context->localfd, buf, size, 0);
+	return recv(context->localfd, buf, size, MSG_DONTWAIT);
 }
 
 static int
 direct_remote_read(struct prt_context *context, char *buf, int size)
 {
-	return recv(context->remotefd, buf, size, 0);
+	return recv(context->remotefd, buf, size, MSG_DONTWAIT);
 }
 
 static int
 direct_local_send(struct prt_context *context, char *buf, int size)
 {
-	return send(context->localfd, buf, size, 0);
+	return send(context->localfd, buf, size, MSG_DONTWAIT);
 }
 
 static int
 direct_remote_send(struct prt_context *context, char *buf, int size)
 {
-	return send(context->remotefd, buf, size, 0);
+	return send(context->remotefd, buf, size, MSG_DONTWAIT);
 }
 
 void
 direct_set_context(struct prt_context *context)
 {
+	context->get_server = direct_get_server;
 	context->connect = direct_connect_to;
+	context->negotiate = direct_negotiate;
 	context->disconnect = direct_disconnect;
 	context->local_read = direct_local_read;
 	context->local_send = direct_local_send;
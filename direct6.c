@@ -31,38 +31,42 @@
 #include <unistd.h>
 #include "prtunnel.h"
 
-extern char *proxyhost;
-extern unsigned short proxyport;
+extern int establish_connection6(unsigned char *, unsigned short);
+extern int connection_status(int);
 
-extern int establish_connection6(char *, unsigned short);
+/* the remote host is connected to directly */
+static char *
+direct6_get_server(struct prt_context *context, int *family)
+{
+	*family = AF_INET6;
+	return context->remotehost;
+}
 
-/* connect to hostname:port directly */
+/*
+ * start connecting to the remote host directly; -6 only goes over
+ * IPv6, so any other address is skipped
+ */
 static int
-direct6_connect_to(struct prt_context *context,
-                   char *hostname, unsigned short port,
-                   char *username, char *password, int server_timeout)
+direct6_connect_to(struct prt_context *context, int family, unsigned char *address)
 {
-	int fd;
-	struct hostent *host;
-
-	host = gethostbyname2(hostname, AF_INET6);
-	if(!host)
+	if(family != AF_INET6)
 		return -1;
 
-	fd = establish_connection6(host->h_addr, port);
-	if(fd == -1)
-		return -1;
-
-	/* set remote server socket timeout if necessary */
-	if(server_timeout) {
-		struct timeval timeout_val;
+	return establish_connection6(address, context->remoteport);
+}
 
-		timeout_val.tv_sec = server_timeout;
-		timeout_val.tv_usec = 0;
-		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, (void *)&timeout_val, sizeof(timeout_val));
+/* there's nothing to negotiate; just wait for the connection */
+static int
+direct6_negotiate(struct prt_context *context)
+{
+	switch(connection_status(context->remotefd)) {
+		case 1:
+			return 0;
+		case 0:
+			return PRT_EVENT_WRITE;
+		default:
+			return -1;
 	}
-
-	return fd;
 }
 
 static void
@@ -77,31 +81,33 @@ direct6_disconnect(struct prt_context *context)
 static int
 direct6_local_read(struct prt_context *context, char *buf, int size)
 {
-	return recv(context->localfd, buf, size, 0);
+	return recv(context->localfd, buf, size, MSG_DONTWAIT);
 }
 
 static int
 direct6_remote_read(struct prt_context *context, char *buf, int size)
 {
-	return recv(context->remotefd, buf, size, 0);
+	return recv(context->remotefd, buf, size, MSG_DONTWAIT);
 }
 
 static int
 direct6_local_send(struct prt_context *context, char *buf, int size)
 {
-	return send(context->localfd, buf, size, 0);
+	return send(context->localfd, buf, size, MSG_DONTWAIT);
 }
 
 static int
 direct6_remote_send(struct prt_context *context, char *buf, int size)
 {
-	return send(context->remotefd, buf, size, 0);
+	return send(context->remotefd, buf, size, MSG_DONTWAIT);
 }
 
 void
 direct6_set_context(struct prt_context *context)
 {
+	context->get_server = direct6_get_server;
 	context->connect = direct6_connect_to;
+	context->negotiate = direct6_negotiate;
 	context->disconnect = direct6_disconnect;
 	context->local_read = direct6_local_read;
 	context->local_send = direct6_local_send;
@@ -0,0 +1,1401 @@
+/*
+ * Copyright (C) 2002-2006 Josh A. Beam
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * event notification for the connection loop. on linux we use an
+ * edge-triggered epoll set, so the cost of a wakeup depends only on
+ * the number of sockets that are actually ready; everywhere else (or
+ * if epoll_create fails) we fall back to select().
+ *
+ * if compiled with IO_URING, an io_uring can be used instead of epoll
+ * (see prt_event_set_backend()). a listening socket gets a multishot
+ * accept, so connections arrive already accepted, and other sockets
+ * are watched with poll requests while their tunnels are being set
+ * up. once a tunnel is relaying, relay.c hands both of its sockets to
+ * the set (see prt_event_recv() and prt_event_send()): data arrives
+ * from multishot receives in buffers registered with the kernel, and
+ * the set reports finished operations instead of readiness. requests
+ * are queued in the submission ring and handed to the kernel by the
+ * same system call that waits for completions, so a busy loop makes
+ * one system call per batch.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include "prtunnel.h"
+
+#ifdef __linux__
+#	define HAVE_EPOLL
+#	include <sys/epoll.h>
+#	ifdef IO_URING
+#		define HAVE_IO_URING
+#		include <errno.h>
+#		include <sys/mman.h>
+#		include <sys/syscall.h>
+#		include <linux/io_uring.h>
+#	endif /* IO_URING */
+#endif /* __linux__ */
+
+#ifndef NFDBITS
+#define NFDBITS (sizeof(fd_set) * 8)
+#endif
+
+/* backends */
+#define PRT_EVENT_SELECT   0
+#define PRT_EVENT_EPOLL    1
+#define PRT_EVENT_IO_URING 2
+
+#ifdef HAVE_EPOLL
+static int backend = PRT_EVENT_EPOLL;
+#else
+static int backend = PRT_EVENT_SELECT;
+#endif /* HAVE_EPOLL */
+
+#ifdef HAVE_IO_URING
+/* what a request was, kept in the top byte of its user_data */
+#define URING_POLL   0
+#define URING_ACCEPT 1
+#define URING_RECV   2
+#define URING_SEND   3
+#define URING_PROBE  4
+
+/* requests that keep an eye on an fd for the caller */
+#define URING_WATCHING ((1 << URING_POLL) | (1 << URING_ACCEPT))
+
+/* user_data of requests whose completions we don't care about */
+#define URING_IGNORE (~(__u64)0)
+
+/* buffers registered with the kernel for receives to fill */
+#define URING_BUFFERS      256 /* must be a power of two */
+#define URING_BUFFER_SIZE  8192
+#define URING_BUFFER_GROUP 0
+
+/* part of a buffer that the caller has asked us to keep for it */
+struct uring_held {
+	int next; /* buffer held after this one, or -1 */
+	unsigned int start;
+	unsigned int end;
+};
+
+/* what's going on with an fd, besides being watched */
+struct uring_fd {
+	unsigned int gen; /* bumped whenever the fd leaves the set */
+	int busy; /* (1 << request type) for each request in flight */
+	int recv; /* set while the caller wants data from the fd */
+	int held; /* oldest buffer held for the fd, or -1 */
+	int held_last;
+	void *owner; /* see prt_event_send() */
+};
+
+/* a send still in flight for an fd that has left the set */
+struct uring_orphan {
+	__u64 user_data;
+	void *owner;
+};
+#endif /* HAVE_IO_URING */
+
+struct prt_event_set;
+
+struct prt_event_ops {
+	int (*add)(struct prt_event_set *set, int fd, int events);
+	int (*modify)(struct prt_event_set *set, int fd, int events);
+	int (*remove)(struct prt_event_set *set, int fd);
+	int (*wait)(struct prt_event_set *set, struct prt_event *events, int max, int timeout);
+	void (*free)(struct prt_event_set *set);
+};
+
+struct prt_event_set {
+	struct prt_event_ops *ops;
+
+	/* epoll */
+	int epfd;
+#ifdef HAVE_EPOLL
+	struct epoll_event *epoll_events;
+	int num_epoll_events;
+#endif /* HAVE_EPOLL */
+
+#ifdef HAVE_IO_URING
+	int ringfd;
+	void *ring; /* submission and completion rings share one mapping */
+	unsigned int ring_size;
+	struct io_uring_sqe *sqes;
+	unsigned int sqes_size;
+	unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned int sq_entries;
+	unsigned int sq_local_tail; /* tail as seen by us, not yet published */
+	unsigned int sq_pending; /* entries the kernel hasn't been given */
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+	unsigned int *gens; /* indexed by fd; bumped whenever its poll is replaced */
+	struct uring_fd *ufds; /* indexed by fd */
+	int *rearm; /* fds that may need requests started again */
+	int num_rearm;
+	int rearm_size;
+	int *starved; /* fds whose receives ran out of buffers */
+	int num_starved;
+	int starved_size;
+	struct io_uring_buf_ring *buf_ring;
+	unsigned short buf_tail;
+	char *buffers; /* URING_BUFFERS of URING_BUFFER_SIZE bytes */
+	struct uring_held held[URING_BUFFERS];
+	int reported[URING_BUFFERS]; /* buffers handed to the caller by the last wait */
+	int num_reported;
+	char unclaimed[URING_BUFFERS]; /* set until the caller releases or holds one */
+	struct uring_orphan *orphans;
+	int num_orphans;
+	int orphans_size;
+#endif /* HAVE_IO_URING */
+
+	/* select (and io_uring) */
+	int *masks; /* indexed by fd */
+	int num_masks;
+	int largest;
+	fd_set *readfds;
+	fd_set *writefds;
+	unsigned int fds_size;
+};
+
+#ifdef _WIN32
+static void
+bzero(void *p, unsigned int size)
+{
+	unsigned int i;
+
+	for(i = 0; i < size; i++)
+		((unsigned char *)p)[i] = 0;
+}
+#endif /* _WIN32 */
+
+#ifdef HAVE_EPOLL
+static unsigned int
+epoll_mask(int events)
+{
+	unsigned int mask = EPOLLET;
+
+	/* listening sockets are only ever told apart by io_uring */
+	if(events & PRT_EVENT_ACCEPT)
+		events |= PRT_EVENT_READ | PRT_EVENT_LEVEL;
+
+	if(events & PRT_EVENT_LEVEL)
+		mask = 0;
+	if(events & PRT_EVENT_READ)
+		mask |= EPOLLIN | EPOLLRDHUP;
+	if(events & PRT_EVENT_WRITE)
+		mask |= EPOLLOUT;
+
+	return mask;
+}
+
+static int
+epoll_add(struct prt_event_set *set, int fd, int events)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = epoll_mask(events);
+	ev.data.fd = fd;
+
+	return epoll_ctl(set->epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+static int
+epoll_modify(struct prt_event_set *set, int fd, int events)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = epoll_mask(events);
+	ev.data.fd = fd;
+
+	return epoll_ctl(set->epfd, EPOLL_CTL_MOD, fd, &ev);
+}
+
+static int
+epoll_remove(struct prt_event_set *set, int fd)
+{
+	struct epoll_event ev; /* ignored, but required before 2.6.9 */
+
+	return epoll_ctl(set->epfd, EPOLL_CTL_DEL, fd, &ev);
+}
+
+static int
+epoll_wait_events(struct prt_event_set *set, struct prt_event *events,
+                  int max, int timeout)
+{
+	int i, n;
+
+	if(max > set->num_epoll_events) {
+		struct epoll_event *tmp;
+
+		tmp = realloc(set->epoll_events, sizeof(struct epoll_event) * max);
+		if(!tmp) {
+			fprintf(stderr, "epoll_wait_events(): Memory allocation failed\n");
+			return -1;
+		}
+		set->epoll_events = tmp;
+		set->num_epoll_events = max;
+	}
+
+	n = epoll_wait(set->epfd, set->epoll_events, max, timeout);
+	for(i = 0; i < n; i++) {
+		unsigned int e = set->epoll_events[i].events;
+
+		events[i].fd = set->epoll_events[i].data.fd;
+		events[i].events = 0;
+		if(e & (EPOLLIN | EPOLLRDHUP))
+			events[i].events |= PRT_EVENT_READ;
+		if(e & EPOLLOUT)
+			events[i].events |= PRT_EVENT_WRITE;
+		if(e & (EPOLLERR | EPOLLHUP))
+			events[i].events |= PRT_EVENT_ERROR;
+	}
+
+	return n;
+}
+
+static void
+epoll_free(struct prt_event_set *set)
+{
+	close(set->epfd);
+	if(set->epoll_events)
+		free(set->epoll_events);
+}
+
+static struct prt_event_ops epoll_ops = {
+	epoll_add,
+	epoll_modify,
+	epoll_remove,
+	epoll_wait_events,
+	epoll_free
+};
+#endif /* HAVE_EPOLL */
+
+
+/*
+ * makes sure set->masks (and, for io_uring, the other tables indexed
+ * by fd) can be indexed by fd. returns 0 on success or -1 on error.
+ */
+static int
+fd_table_reserve(struct prt_event_set *set, int fd)
+{
+	int i, size;
+	int *tmp;
+
+	if(fd < 0)
+		return -1;
+	if(fd < set->num_masks)
+		return 0;
+
+	size = set->num_masks ? set->num_masks : 64;
+	while(size <= fd)
+		size *= 2;
+
+#ifdef HAVE_IO_URING
+	if(set->ringfd != -1) {
+		unsigned int *gens;
+		struct uring_fd *ufds;
+
+		gens = realloc(set->gens, sizeof(unsigned int) * size);
+		if(!gens) {
+			fprintf(stderr, "fd_table_reserve(): Memory allocation failed\n");
+			return -1;
+		}
+		for(i = set->num_masks; i < size; i++)
+			gens[i] = 0;
+		set->gens = gens;
+
+		ufds = realloc(set->ufds, sizeof(struct uring_fd) * size);
+		if(!ufds) {
+			fprintf(stderr, "fd_table_reserve(): Memory allocation failed\n");
+			return -1;
+		}
+		for(i = set->num_masks; i < size; i++) {
+			ufds[i].gen = 0;
+			ufds[i].busy = 0;
+			ufds[i].recv = 0;
+			ufds[i].held = -1;
+			ufds[i].held_last = -1;
+			ufds[i].owner = NULL;
+		}
+		set->ufds = ufds;
+	}
+#endif /* HAVE_IO_URING */
+
+	tmp = realloc(set->masks, sizeof(int) * size);
+	if(!tmp) {
+		fprintf(stderr, "fd_table_reserve(): Memory allocation failed\n");
+		return -1;
+	}
+	for(i = set->num_masks; i < size; i++)
+		tmp[i] = 0;
+	set->masks = tmp;
+	set->num_masks = size;
+
+	return 0;
+}
+
+static int
+select_modify(struct prt_event_set *set, int fd, int events)
+{
+	if(fd_table_reserve(set, fd) == -1)
+		return -1;
+
+	if(events & PRT_EVENT_ACCEPT)
+		events |= PRT_EVENT_READ;
+
+	/* the level bit means nothing here; select is always level-triggered */
+	set->masks[fd] = events & (PRT_EVENT_READ | PRT_EVENT_WRITE);
+	if(set->masks[fd] && fd > set->largest)
+		set->largest = fd;
+
+	return 0;
+}
+
+static int
+select_add(struct prt_event_set *set, int fd, int events)
+{
+	return select_modify(set, fd, events);
+}
+
+static int
+select_remove(struct prt_event_set *set, int fd)
+{
+	if(fd < 0 || fd >= set->num_masks)
+		return -1;
+
+	set->masks[fd] = 0;
+	while(set->largest >= 0 && set->masks[set->largest] == 0)
+		set->largest--;
+
+	return 0;
+}
+
+static int
+select_wait(struct prt_event_set *set, struct prt_event *events,
+            int max, int timeout)
+{
+	int i, n, tmp;
+	unsigned int size;
+	struct timeval tv;
+
+	/* allocate memory for fd_sets */
+	size = ((set->largest + NFDBITS) / NFDBITS) * sizeof(fd_set);
+	if(size != set->fds_size) {
+		if(set->readfds)
+			free(set->readfds);
+		if(set->writefds)
+			free(set->writefds);
+		set->readfds = malloc(size);
+		set->writefds = malloc(size);
+		if(!set->readfds || !set->writefds) {
+			fprintf(stderr, "Error: Memory allocation failed\n");
+			set->fds_size = 0;
+			return -1;
+		}
+		set->fds_size = size;
+	}
+
+	bzero(set->readfds, size);
+	bzero(set->writefds, size);
+	for(i = 0; i <= set->largest; i++) {
+		if(set->masks[i] & PRT_EVENT_READ)
+			FD_SET(i, set->readfds);
+		if(set->masks[i] & PRT_EVENT_WRITE)
+			FD_SET(i, set->writefds);
+	}
+
+	if(timeout >= 0) {
+		tv.tv_sec = timeout / 1000;
+		tv.tv_usec = (timeout % 1000) * 1000;
+	}
+	tmp = select(set->largest + 1, set->readfds, set->writefds, NULL, (timeout >= 0) ? &tv : NULL);
+	if(tmp <= 0)
+		return tmp;
+
+	n = 0;
+	for(i = 0; i <= set->largest && n < max; i++) {
+		int e = 0;
+
+		if((set->masks[i] & PRT_EVENT_READ) && FD_ISSET(i, set->readfds))
+			e |= PRT_EVENT_READ;
+		if((set->masks[i] & PRT_EVENT_WRITE) && FD_ISSET(i, set->writefds))
+			e |= PRT_EVENT_WRITE;
+		if(e) {
+			events[n].fd = i;
+			events[n].events = e;
+			n++;
+		}
+	}
+
+	return n;
+}
+
+static void
+select_free(struct prt_event_set *set)
+{
+	if(set->masks)
+		free(set->masks);
+	if(set->readfds)
+		free(set->readfds);
+	if(set->writefds)
+		free(set->writefds);
+}
+
+static struct prt_event_ops select_ops = {
+	select_add,
+	select_modify,
+	select_remove,
+	select_wait,
+	select_free
+};
+
+
+#ifdef HAVE_IO_URING
+static __u64
+uring_user_data(int type, unsigned int gen, int fd)
+{
+	return ((__u64)type << 56) | ((__u64)(gen & 0xffffff) << 32) | (unsigned int)fd;
+}
+
+static int
+uring_enter(struct prt_event_set *set, unsigned int to_submit,
+            unsigned int min_complete, unsigned int flags, void *arg)
+{
+	return syscall(__NR_io_uring_enter, set->ringfd, to_submit, min_complete,
+	               flags, arg, arg ? sizeof(struct io_uring_getevents_arg) : 0);
+}
+
+/* hands queued requests to the kernel without waiting for anything */
+static int
+uring_submit(struct prt_event_set *set)
+{
+	int n;
+
+	__atomic_store_n(set->sq_tail, set->sq_local_tail, __ATOMIC_RELEASE);
+	while(set->sq_pending) {
+		n = uring_enter(set, set->sq_pending, 0, 0, NULL);
+		if(n == -1) {
+			if(errno == EINTR)
+				continue;
+			return -1;
+		}
+		set->sq_pending -= n;
+	}
+
+	return 0;
+}
+
+/* returns a cleared submission queue entry, or NULL on error */
+static struct io_uring_sqe *
+uring_get_sqe(struct prt_event_set *set)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int index;
+
+	if(set->sq_local_tail - __atomic_load_n(set->sq_head, __ATOMIC_ACQUIRE) >= set->sq_entries) {
+		if(uring_submit(set) == -1)
+			return NULL;
+	}
+
+	index = set->sq_local_tail & *set->sq_mask;
+	sqe = &set->sqes[index];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	set->sq_array[index] = index;
+	set->sq_local_tail++;
+	set->sq_pending++;
+
+	return sqe;
+}
+
+/* adds fd to one of the lists of fds to look at again */
+static int
+uring_list_add(int **list, int *num, int *size, int fd)
+{
+	if(*num == *size) {
+		int newsize = *size ? *size * 2 : 64;
+		int *tmp;
+
+		tmp = realloc(*list, sizeof(int) * newsize);
+		if(!tmp) {
+			fprintf(stderr, "uring_list_add(): Memory allocation failed\n");
+			return -1;
+		}
+		*list = tmp;
+		*size = newsize;
+	}
+	(*list)[(*num)++] = fd;
+
+	return 0;
+}
+
+/* queues the cancellation of the request with the given user_data */
+static int
+uring_cancel(struct prt_event_set *set, __u64 user_data)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_get_sqe(set);
+	if(!sqe)
+		return -1;
+
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = user_data;
+	sqe->user_data = URING_IGNORE;
+
+	return 0;
+}
+
+/* gives a buffer back to the kernel to receive into */
+static void
+uring_buffer_return(struct prt_event_set *set, unsigned int buffer)
+{
+	struct io_uring_buf *buf;
+	int i;
+
+	buf = &set->buf_ring->bufs[set->buf_tail & (URING_BUFFERS - 1)];
+	buf->addr = (__u64)(unsigned long)(set->buffers + buffer * URING_BUFFER_SIZE);
+	buf->len = URING_BUFFER_SIZE;
+	buf->bid = buffer;
+	set->buf_tail++;
+	__atomic_store_n(&set->buf_ring->tail, set->buf_tail, __ATOMIC_RELEASE);
+
+	/* receives that stopped for want of buffers can go again */
+	for(i = 0; i < set->num_starved; i++)
+		uring_list_add(&set->rearm, &set->num_rearm, &set->rearm_size, set->starved[i]);
+	set->num_starved = 0;
+}
+
+/*
+ * queues whatever requests fd needs that aren't already in flight:
+ * a multishot accept for a listening socket, a poll request for
+ * anything else being watched, and a multishot receive if the caller
+ * wants its data. level-triggered polls are one-shot and get re-armed
+ * by the next wait, after the caller has had a chance to handle them.
+ */
+static int
+uring_start(struct prt_event_set *set, int fd)
+{
+	struct uring_fd *ufd = &set->ufds[fd];
+	struct io_uring_sqe *sqe;
+
+	if(set->masks[fd] && !(ufd->busy & URING_WATCHING)) {
+		sqe = uring_get_sqe(set);
+		if(!sqe)
+			return -1;
+
+		sqe->fd = fd;
+		if(set->masks[fd] & PRT_EVENT_ACCEPT) {
+			sqe->opcode = IORING_OP_ACCEPT;
+			sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+			sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+			sqe->user_data = uring_user_data(URING_ACCEPT, set->gens[fd], fd);
+			ufd->busy |= 1 << URING_ACCEPT;
+		} else {
+			sqe->opcode = IORING_OP_POLL_ADD;
+			sqe->poll32_events = epoll_mask(set->masks[fd]) & ~EPOLLET;
+			if(!(set->masks[fd] & PRT_EVENT_LEVEL))
+				sqe->len = IORING_POLL_ADD_MULTI;
+			sqe->user_data = uring_user_data(URING_POLL, set->gens[fd], fd);
+			ufd->busy |= 1 << URING_POLL;
+		}
+	}
+
+	if(ufd->recv && !(ufd->busy & (1 << URING_RECV))) {
+		sqe = uring_get_sqe(set);
+		if(!sqe)
+			return -1;
+
+		sqe->opcode = IORING_OP_RECV;
+		sqe->fd = fd;
+		sqe->ioprio = IORING_RECV_MULTISHOT;
+		sqe->flags = IOSQE_BUFFER_SELECT;
+		sqe->buf_group = URING_BUFFER_GROUP;
+		sqe->user_data = uring_user_data(URING_RECV, ufd->gen, fd);
+		ufd->busy |= 1 << URING_RECV;
+	}
+
+	return 0;
+}
+
+/* queues the cancellation of fd's accept or poll request, if it has one */
+static int
+uring_unwatch(struct prt_event_set *set, int fd)
+{
+	struct uring_fd *ufd = &set->ufds[fd];
+	int type = (ufd->busy & (1 << URING_ACCEPT)) ? URING_ACCEPT : URING_POLL;
+
+	if(!(ufd->busy & URING_WATCHING))
+		return 0;
+	if(uring_cancel(set, uring_user_data(type, set->gens[fd], fd)) == -1)
+		return -1;
+
+	/* anything still on its way from the old request is now stale */
+	set->gens[fd]++;
+	ufd->busy &= ~URING_WATCHING;
+
+	return 0;
+}
+
+static int
+uring_add(struct prt_event_set *set, int fd, int events)
+{
+	if(fd_table_reserve(set, fd) == -1)
+		return -1;
+
+	set->masks[fd] = events;
+	return uring_start(set, fd);
+}
+
+static int
+uring_modify(struct prt_event_set *set, int fd, int events)
+{
+	if(fd < 0 || fd >= set->num_masks || !set->masks[fd])
+		return -1;
+	if(events == set->masks[fd])
+		return 0;
+
+	if(uring_unwatch(set, fd) == -1)
+		return -1;
+	set->masks[fd] = events;
+	return uring_start(set, fd);
+}
+
+/*
+ * stops everything the set is doing with fd: its poll, its receive
+ * and any buffers held for it go, and a send in flight is left to
+ * finish on its own, with its owner freed once it has.
+ */
+static int
+uring_remove(struct prt_event_set *set, int fd)
+{
+	struct uring_fd *ufd;
+
+	if(fd < 0 || fd >= set->num_masks)
+		return -1;
+	ufd = &set->ufds[fd];
+	if(!set->masks[fd] && !ufd->busy && !ufd->recv && ufd->held == -1)
+		return -1;
+
+	set->masks[fd] = 0;
+	if(uring_unwatch(set, fd) == -1)
+		return -1;
+
+	if(ufd->busy & (1 << URING_RECV))
+		uring_cancel(set, uring_user_data(URING_RECV, ufd->gen, fd));
+	if(ufd->busy & (1 << URING_SEND)) {
+		if(set->num_orphans == set->orphans_size) {
+			int size = set->orphans_size ? set->orphans_size * 2 : 16;
+			struct uring_orphan *tmp;
+
+			tmp = realloc(set->orphans, sizeof(struct uring_orphan) * size);
+			if(!tmp) {
+				fprintf(stderr, "uring_remove(): Memory allocation failed\n");
+				return -1;
+			}
+			set->orphans = tmp;
+			set->orphans_size = size;
+		}
+		set->orphans[set->num_orphans].user_data = uring_user_data(URING_SEND, ufd->gen, fd);
+		set->orphans[set->num_orphans].owner = ufd->owner;
+		set->num_orphans++;
+	}
+	while(ufd->held != -1) {
+		int next = set->held[ufd->held].next;
+
+		uring_buffer_return(set, ufd->held);
+		ufd->held = next;
+	}
+
+	ufd->gen++;
+	ufd->busy = 0;
+	ufd->recv = 0;
+	ufd->owner = NULL;
+
+	return 0;
+}
+
+/* called for the completion of a request made for an fd no longer in the set */
+static void
+uring_stale(struct prt_event_set *set, struct io_uring_cqe *cqe)
+{
+	int i, type = (int)(cqe->user_data >> 56);
+
+	if(cqe->flags & IORING_CQE_F_BUFFER)
+		uring_buffer_return(set, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+	if(type == URING_ACCEPT && cqe->res >= 0)
+		close(cqe->res); /* accepted after we stopped listening */
+	if(type != URING_SEND)
+		return;
+
+	for(i = 0; i < set->num_orphans; i++) {
+		if(set->orphans[i].user_data == cqe->user_data) {
+			free(set->orphans[i].owner);
+			set->orphans[i] = set->orphans[--set->num_orphans];
+			break;
+		}
+	}
+}
+
+static int
+uring_wait(struct prt_event_set *set, struct prt_event *events,
+           int max, int timeout)
+{
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	unsigned int head, tail;
+	int i, n;
+
+	/*
+	 * buffers the caller didn't want (their fds may have been closed
+	 * after the last wait) go back, and the requests that finished
+	 * then are re-armed
+	 */
+	for(i = 0; i < set->num_reported; i++) {
+		if(set->unclaimed[set->reported[i]]) {
+			set->unclaimed[set->reported[i]] = 0;
+			uring_buffer_return(set, set->reported[i]);
+		}
+	}
+	set->num_reported = 0;
+	for(i = 0; i < set->num_rearm; i++) {
+		if(uring_start(set, set->rearm[i]) == -1)
+			return -1;
+	}
+	set->num_rearm = 0;
+
+	__atomic_store_n(set->sq_tail, set->sq_local_tail, __ATOMIC_RELEASE);
+
+	if(__atomic_load_n(set->cq_tail, __ATOMIC_ACQUIRE) != *set->cq_head) {
+		/* there are completions already; don't wait for more */
+		if(uring_submit(set) == -1)
+			return -1;
+	} else {
+		memset(&arg, 0, sizeof(arg));
+		if(timeout >= 0) {
+			ts.tv_sec = timeout / 1000;
+			ts.tv_nsec = (timeout % 1000) * 1000000;
+			arg.ts = (__u64)(unsigned long)&ts;
+		}
+
+		n = uring_enter(set, set->sq_pending, 1,
+		                IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg);
+		if(n == -1) {
+			if(errno == ETIME)
+				return 0;
+			if(errno != EBUSY)
+				return -1;
+			n = 0; /* completions need reaping before more can be submitted */
+		}
+		set->sq_pending -= n;
+	}
+
+	n = 0;
+	head = *set->cq_head;
+	tail = __atomic_load_n(set->cq_tail, __ATOMIC_ACQUIRE);
+	for(; head != tail && n < max; head++) {
+		struct io_uring_cqe *cqe = &set->cqes[head & *set->cq_mask];
+		int type = (int)(cqe->user_data >> 56);
+		int fd = (int)(cqe->user_data & 0xffffffff);
+		unsigned int gen = (unsigned int)(cqe->user_data >> 32) & 0xffffff;
+		int more = (cqe->flags & IORING_CQE_F_MORE) != 0;
+		struct uring_fd *ufd;
+		int e = 0;
+
+		if(cqe->user_data == URING_IGNORE)
+			continue;
+		if(fd < 0 || fd >= set->num_masks ||
+		   gen != (((type == URING_POLL || type == URING_ACCEPT) ? set->gens[fd] : set->ufds[fd].gen) & 0xffffff)) {
+			uring_stale(set, cqe);
+			continue;
+		}
+		ufd = &set->ufds[fd];
+
+		/* requests that end are started again by the next wait if still wanted */
+		if(!more) {
+			ufd->busy &= ~(1 << type);
+			if(type != URING_SEND && cqe->res != -ENOBUFS)
+				uring_list_add(&set->rearm, &set->num_rearm, &set->rearm_size, fd);
+		}
+
+		switch(type) {
+			case URING_POLL:
+				if(cqe->res < 0) {
+					e = PRT_EVENT_ERROR;
+				} else {
+					if(cqe->res & (EPOLLIN | EPOLLRDHUP))
+						e |= PRT_EVENT_READ;
+					if(cqe->res & EPOLLOUT)
+						e |= PRT_EVENT_WRITE;
+					if(cqe->res & (EPOLLERR | EPOLLHUP))
+						e |= PRT_EVENT_ERROR;
+				}
+				break;
+			case URING_ACCEPT:
+				e = PRT_EVENT_ACCEPT;
+				break;
+			case URING_RECV:
+				if(cqe->res == -ENOBUFS) {
+					/* started again once a buffer comes back */
+					if(ufd->recv)
+						uring_list_add(&set->starved, &set->num_starved, &set->starved_size, fd);
+				} else if(cqe->res != -ECANCELED) { /* see prt_event_hold() */
+					if(cqe->res <= 0)
+						ufd->recv = 0;
+					if(cqe->flags & IORING_CQE_F_BUFFER) {
+						int buffer = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+						set->unclaimed[buffer] = 1;
+						set->reported[set->num_reported++] = buffer;
+					}
+					e = PRT_EVENT_RECEIVED;
+				}
+				break;
+			case URING_SEND:
+				ufd->owner = NULL;
+				e = PRT_EVENT_SENT;
+				break;
+		}
+
+		if(e) {
+			events[n].fd = fd;
+			events[n].events = e;
+			events[n].result = cqe->res;
+			events[n].buffer = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+			n++;
+		}
+	}
+	__atomic_store_n(set->cq_head, head, __ATOMIC_RELEASE);
+
+	return n;
+}
+
+static void
+uring_free(struct prt_event_set *set)
+{
+	int i;
+
+	if(set->sqes != MAP_FAILED)
+		munmap(set->sqes, set->sqes_size);
+	if(set->ring != MAP_FAILED)
+		munmap(set->ring, set->ring_size);
+	if(set->buf_ring != MAP_FAILED)
+		munmap(set->buf_ring, sizeof(struct io_uring_buf) * URING_BUFFERS);
+	close(set->ringfd);
+	if(set->buffers)
+		free(set->buffers);
+	if(set->gens)
+		free(set->gens);
+	if(set->ufds)
+		free(set->ufds);
+	if(set->rearm)
+		free(set->rearm);
+	if(set->starved)
+		free(set->starved);
+	for(i = 0; i < set->num_orphans; i++)
+		free(set->orphans[i].owner);
+	if(set->orphans)
+		free(set->orphans);
+	if(set->masks)
+		free(set->masks);
+}
+
+static struct prt_event_ops uring_ops = {
+	uring_add,
+	uring_modify,
+	uring_remove,
+	uring_wait,
+	uring_free
+};
+
+/*
+ * makes sure multishot receives into our buffers work, by receiving
+ * a byte from a socket pair. returns 0 if they do, or -1 if not.
+ */
+static int
+uring_probe(struct prt_event_set *set)
+{
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	struct io_uring_sqe *sqe;
+	unsigned int head;
+	int sv[2], i, n, works = 0, done = 0, closed = 0;
+
+	if(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1)
+		return -1;
+
+	sqe = uring_get_sqe(set);
+	if(!sqe) {
+		close(sv[0]);
+		close(sv[1]);
+		return -1;
+	}
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = sv[0];
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BUFFER_GROUP;
+	sqe->user_data = uring_user_data(URING_PROBE, 0, sv[0]);
+	__atomic_store_n(set->sq_tail, set->sq_local_tail, __ATOMIC_RELEASE);
+
+	/* the receive ends when it sees the other side close */
+	if(write(sv[1], "", 1) == 1) {
+		close(sv[1]);
+		closed = 1;
+	}
+
+	memset(&arg, 0, sizeof(arg));
+	ts.tv_sec = 1;
+	ts.tv_nsec = 0;
+	arg.ts = (__u64)(unsigned long)&ts;
+
+	for(i = 0; i < 4 && !done; i++) {
+		n = uring_enter(set, set->sq_pending, 1,
+		                IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg);
+		if(n == -1) {
+			if(errno == EINTR)
+				continue;
+			break;
+		}
+		set->sq_pending -= n;
+
+		head = *set->cq_head;
+		for(; head != __atomic_load_n(set->cq_tail, __ATOMIC_ACQUIRE); head++) {
+			struct io_uring_cqe *cqe = &set->cqes[head & *set->cq_mask];
+
+			if(cqe->res == 1 && (cqe->flags & IORING_CQE_F_BUFFER) &&
+			   (cqe->flags & IORING_CQE_F_MORE))
+				works = 1;
+			if(cqe->flags & IORING_CQE_F_BUFFER)
+				uring_buffer_return(set, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+			if(!(cqe->flags & IORING_CQE_F_MORE))
+				done = 1;
+		}
+		__atomic_store_n(set->cq_head, head, __ATOMIC_RELEASE);
+	}
+
+	close(sv[0]);
+	if(!closed)
+		close(sv[1]);
+
+	return (works && done) ? 0 : -1;
+}
+
+/*
+ * sets up an io_uring for set. returns 0 on success, or -1 if
+ * the kernel can't give us one that does what we need.
+ */
+static int
+uring_init(struct prt_event_set *set)
+{
+	struct io_uring_params p;
+	struct io_uring_buf_reg reg;
+	char *sq, *cq;
+	int i, error;
+
+	set->ring = MAP_FAILED;
+	set->sqes = MAP_FAILED;
+	set->buf_ring = MAP_FAILED;
+	set->buffers = NULL;
+	set->gens = NULL;
+	set->ufds = NULL;
+	set->rearm = NULL;
+	set->num_rearm = 0;
+	set->rearm_size = 0;
+	set->starved = NULL;
+	set->num_starved = 0;
+	set->starved_size = 0;
+	set->orphans = NULL;
+	set->num_orphans = 0;
+	set->orphans_size = 0;
+
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP;
+	p.cq_entries = 4096; /* multishot requests can complete many times each */
+	set->ringfd = syscall(__NR_io_uring_setup, 256, &p);
+	if(set->ringfd == -1)
+		return -1;
+
+	if(!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_EXT_ARG) ||
+	   !(p.features & IORING_FEAT_NODROP)) {
+		errno = EOPNOTSUPP;
+		goto fail;
+	}
+
+	set->ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	if(p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe) > set->ring_size)
+		set->ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	set->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	set->ring = mmap(NULL, set->ring_size, PROT_READ | PROT_WRITE,
+	                 MAP_SHARED | MAP_POPULATE, set->ringfd, IORING_OFF_SQ_RING);
+	if(set->ring == MAP_FAILED)
+		goto fail;
+	set->sqes = mmap(NULL, set->sqes_size, PROT_READ | PROT_WRITE,
+	                 MAP_SHARED | MAP_POPULATE, set->ringfd, IORING_OFF_SQES);
+	if(set->sqes == MAP_FAILED)
+		goto fail;
+
+	sq = cq = set->ring;
+	set->sq_head = (unsigned int *)(sq + p.sq_off.head);
+	set->sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+	set->sq_mask = (unsigned int *)(sq + p.sq_off.ring_mask);
+	set->sq_array = (unsigned int *)(sq + p.sq_off.array);
+	set->sq_entries = p.sq_entries;
+	set->sq_local_tail = *set->sq_tail;
+	set->sq_pending = 0;
+
+	set->cq_head = (unsigned int *)(cq + p.cq_off.head);
+	set->cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+	set->cq_mask = (unsigned int *)(cq + p.cq_off.ring_mask);
+	set->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+	/* the buffers receives pick from */
+	set->buf_ring = mmap(NULL, sizeof(struct io_uring_buf) * URING_BUFFERS,
+	                     PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(set->buf_ring == MAP_FAILED)
+		goto fail;
+	set->buffers = malloc(URING_BUFFERS * URING_BUFFER_SIZE);
+	if(!set->buffers) {
+		fprintf(stderr, "uring_init(): Memory allocation failed\n");
+		errno = ENOMEM;
+		goto fail;
+	}
+
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (__u64)(unsigned long)set->buf_ring;
+	reg.ring_entries = URING_BUFFERS;
+	reg.bgid = URING_BUFFER_GROUP;
+	if(syscall(__NR_io_uring_register, set->ringfd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1)
+		goto fail;
+
+	set->buf_tail = 0;
+	for(i = 0; i < URING_BUFFERS; i++) {
+		set->unclaimed[i] = 0;
+		uring_buffer_return(set, i);
+	}
+	set->num_reported = 0;
+
+	if(uring_probe(set) == -1) {
+		errno = EOPNOTSUPP;
+		goto fail;
+	}
+
+	return 0;
+
+fail:
+	error = errno;
+	uring_free(set);
+	set->ringfd = -1;
+	set->masks = NULL;
+	errno = error;
+	return -1;
+}
+#endif /* HAVE_IO_URING */
+
+struct prt_event_set *
+prt_event_set_new()
+{
+	struct prt_event_set *set;
+
+	set = malloc(sizeof(struct prt_event_set));
+	if(!set) {
+		fprintf(stderr, "prt_event_set_new(): Memory allocation failed\n");
+		return NULL;
+	}
+
+	set->ops = &select_ops;
+	set->epfd = -1;
+#ifdef HAVE_EPOLL
+	set->epoll_events = NULL;
+	set->num_epoll_events = 0;
+#endif /* HAVE_EPOLL */
+	set->masks = NULL;
+	set->num_masks = 0;
+	set->largest = -1;
+	set->readfds = NULL;
+	set->writefds = NULL;
+	set->fds_size = 0;
+#ifdef HAVE_IO_URING
+	set->ringfd = -1;
+
+	if(backend == PRT_EVENT_IO_URING) {
+		if(uring_init(set) != -1) {
+			set->ops = &uring_ops;
+			return set;
+		}
+		fprintf(stderr, "Warning: io_uring unavailable (%s); falling back to epoll\n", strerror(errno));
+	}
+#endif /* HAVE_IO_URING */
+
+#ifdef HAVE_EPOLL
+	if(backend == PRT_EVENT_SELECT)
+		return set;
+
+	set->epfd = epoll_create(64);
+	if(set->epfd != -1)
+		set->ops = &epoll_ops;
+	else
+		fprintf(stderr, "Warning: epoll_create failed; falling back to select\n");
+#endif /* HAVE_EPOLL */
+
+	return set;
+}
+
+/*
+ * chooses the backend used by sets created from now on: "select",
+ * "epoll" or "io_uring". returns 1 on success, or 0 if name isn't
+ * one that prtunnel was compiled with.
+ */
+int
+prt_event_set_backend(char *name)
+{
+	if(strcmp(name, "select") == 0)
+		backend = PRT_EVENT_SELECT;
+#ifdef HAVE_EPOLL
+	else if(strcmp(name, "epoll") == 0)
+		backend = PRT_EVENT_EPOLL;
+#endif /* HAVE_EPOLL */
+#ifdef HAVE_IO_URING
+	else if(strcmp(name, "io_uring") == 0)
+		backend = PRT_EVENT_IO_URING;
+#endif /* HAVE_IO_URING */
+	else
+		return 0;
+
+	return 1;
+}
+
+void
+prt_event_set_free(struct prt_event_set *set)
+{
+	set->ops->free(set);
+	free(set);
+}
+
+/*
+ * start watching fd. unless PRT_EVENT_LEVEL is given, notifications
+ * may be edge-triggered, so the caller must keep reading (or writing)
+ * until the socket would block before waiting again.
+ *
+ * PRT_EVENT_ACCEPT marks a listening socket. sets that do I/O
+ * themselves accept its connections for the caller, reporting each
+ * one as a PRT_EVENT_ACCEPT event whose result is the new socket
+ * (or -errno); others just report it readable.
+ */
+int
+prt_event_add(struct prt_event_set *set, int fd, int events)
+{
+	return set->ops->add(set, fd, events);
+}
+
+int
+prt_event_modify(struct prt_event_set *set, int fd, int events)
+{
+	return set->ops->modify(set, fd, events);
+}
+
+int
+prt_event_remove(struct prt_event_set *set, int fd)
+{
+	return set->ops->remove(set, fd);
+}
+
+/*
+ * returns nonzero if set only reports changes in readiness, in which
+ * case there's no need to change the events a socket is watched for
+ * as long as it's watched for everything it might need
+ */
+int
+prt_event_edge_triggered(struct prt_event_set *set)
+{
+#ifdef HAVE_IO_URING
+	/* multishot polls complete on every wakeup, which is just as good */
+	if(set->ops == &uring_ops)
+		return 1;
+#endif /* HAVE_IO_URING */
+#ifdef HAVE_EPOLL
+	return (set->ops == &epoll_ops);
+#else
+	return 0;
+#endif /* HAVE_EPOLL */
+}
+
+/*
+ * wait up to timeout milliseconds (forever if timeout is negative) for
+ * events; returns the number of entries filled in, or -1 on error.
+ */
+int
+prt_event_wait(struct prt_event_set *set, struct prt_event *events,
+               int max, int timeout)
+{
+	return set->ops->wait(set, events, max, timeout);
+}
+
+/*
+ * returns nonzero if set can do a socket's I/O itself, with the
+ * functions below, reporting completions instead of readiness
+ */
+int
+prt_event_completions(struct prt_event_set *set)
+{
+#ifdef HAVE_IO_URING
+	return (set->ops == &uring_ops);
+#else
+	return 0;
+#endif /* HAVE_IO_URING */
+}
+
+#ifdef HAVE_IO_URING
+/*
+ * keeps receiving from fd until it closes, it fails, or the caller
+ * holds on to a buffer (see prt_event_hold()). each time data arrives
+ * there's a PRT_EVENT_RECEIVED event, whose result is the number of
+ * bytes in buffer (see prt_event_buffer()); the caller passes the
+ * buffer to prt_event_release() or prt_event_hold() once it has
+ * looked at it, and if it doesn't before waiting again, the buffer
+ * is released for it. a result of 0 means the other side closed,
+ * and a negative one is -errno.
+ */
+int
+prt_event_recv(struct prt_event_set *set, int fd)
+{
+	if(fd_table_reserve(set, fd) == -1)
+		return -1;
+
+	set->ufds[fd].recv = 1;
+	return uring_start(set, fd);
+}
+
+/*
+ * starts sending len bytes of data to fd, reported by a PRT_EVENT_SENT
+ * event whose result is how many were sent, or -errno. fd can only
+ * have one send in flight. data must stay put until then; if fd is
+ * removed from the set in the meantime, owner is passed to free()
+ * once the kernel is done with it.
+ */
+int
+prt_event_send(struct prt_event_set *set, int fd, char *data,
+               unsigned int len, void *owner)
+{
+	struct io_uring_sqe *sqe;
+	struct uring_fd *ufd;
+
+	if(fd_table_reserve(set, fd) == -1)
+		return -1;
+	ufd = &set->ufds[fd];
+	if(ufd->busy & (1 << URING_SEND))
+		return -1;
+
+	sqe = uring_get_sqe(set);
+	if(!sqe)
+		return -1;
+	sqe->opcode = IORING_OP_SEND;
+	sqe->fd = fd;
+	sqe->addr = (__u64)(unsigned long)data;
+	sqe->len = len;
+	sqe->msg_flags = MSG_NOSIGNAL;
+	sqe->user_data = uring_user_data(URING_SEND, ufd->gen, fd);
+	ufd->busy |= 1 << URING_SEND;
+	ufd->owner = owner;
+
+	return 0;
+}
+
+char *
+prt_event_buffer(struct prt_event_set *set, unsigned int buffer)
+{
+	return set->buffers + buffer * URING_BUFFER_SIZE;
+}
+
+void
+prt_event_release(struct prt_event_set *set, unsigned int buffer)
+{
+	set->unclaimed[buffer] = 0;
+	uring_buffer_return(set, buffer);
+}
+
+/*
+ * keeps bytes start to end of buffer for fd until the caller has
+ * room for them (see prt_event_unhold()), and stops receiving from
+ * fd; data that was already on its way is still reported.
+ */
+void
+prt_event_hold(struct prt_event_set *set, int fd, unsigned int buffer,
+               unsigned int start, unsigned int end)
+{
+	struct uring_fd *ufd = &set->ufds[fd];
+
+	set->unclaimed[buffer] = 0;
+	set->held[buffer].next = -1;
+	set->held[buffer].start = start;
+	set->held[buffer].end = end;
+	if(ufd->held == -1)
+		ufd->held = buffer;
+	else
+		set->held[ufd->held_last].next = buffer;
+	ufd->held_last = buffer;
+
+	if(ufd->recv) {
+		ufd->recv = 0;
+		if(ufd->busy & (1 << URING_RECV))
+			uring_cancel(set, uring_user_data(URING_RECV, ufd->gen, fd));
+	}
+}
+
+/*
+ * copies up to size bytes held for fd to dest, oldest first, giving
+ * back the buffers that are emptied. returns the number copied.
+ */
+unsigned int
+prt_event_unhold(struct prt_event_set *set, int fd, char *dest,
+                 unsigned int size)
+{
+	struct uring_fd *ufd = &set->ufds[fd];
+	unsigned int copied = 0;
+
+	while(ufd->held != -1 && copied < size) {
+		struct uring_held *held = &set->held[ufd->held];
+		unsigned int n = held->end - held->start;
+
+		if(n > size - copied)
+			n = size - copied;
+		memcpy(dest + copied, prt_event_buffer(set, ufd->held) + held->start, n);
+		held->start += n;
+		copied += n;
+
+		if(held->start == held->end) {
+			int next = held->next;
+
+			uring_buffer_return(set, ufd->held);
+			ufd->held = next;
+		}
+	}
+
+	return copied;
+}
+#endif /* HAVE_IO_URING */
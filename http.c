@@ -24,21 +24,26 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <sys/types.h>
 #include "prtunnel.h"
 
 extern int flags;
 
-extern char *proxyhost;
-extern unsigned short proxyport;
-
-extern int establish_connection(char *, unsigned short);
+extern int establish_connection(unsigned char *, unsigned short);
 #ifdef IPV6
-extern int establish_connection6(char *, unsigned short);
+extern int establish_connection6(unsigned char *, unsigned short);
 #endif /* IPV6 */
 
-extern int read_byte(int);
+extern int connection_status(int);
+extern int send_pending(int, char *, unsigned int, unsigned int *);
+
+extern int prt_relay_preload(struct prt_context *context, int outgoing, char *data, int len);
+
+/* chain functions */
+extern void prt_chain_handshake(struct prt_context *context, struct prt_handshake *hs);
 
 /* base64 characters */
 static char b64chars[] = {
@@ -50,17 +55,16 @@ static char b64chars[] = {
 };
 
 #define BASE64LEN 512
-/* return base64 encoded string */
+/* base64 encode s into out, which must have room for BASE64LEN bytes */
 static char *
-base64(char *s)
+base64(char *s, char *out)
 {
 	int i, j;
 	unsigned int bits = 0;
 	unsigned char tmp[4];
-	static char out[BASE64LEN];
 
 	j = 0;
-	for(i = 0; i < strlen(s) && (j-4) < (BASE64LEN - 1); i++) {
+	for(i = 0; i < strlen(s) && j < (BASE64LEN - 8); i++) {
 		bits <<= 8;
 		bits |= s[i] & 0xff;
 
@@ -104,21 +108,36 @@ base64(char *s)
 	out[j] = '\0';
 	return out;
 }
-#undef BASE64LEN
 
-static int
-http_negotiate(int fd, char *hostname, unsigned short port,
-               char *username, char *password, int use_http_1_0)
-{
-	int i;
-	char buf[1024];
-	int len;
+/* where http_negotiate() is in setting up a tunnel */
+#define HTTP_CONNECTING       0
+#define HTTP_SENDING          1
+#define HTTP_READING_RESPONSE 2
+
+/* room for the CONNECT request, and for the proxy's response header */
+#define HTTP_BUFFER_SIZE 4096
+
+struct http_state {
+	int step;
+	char buf[HTTP_BUFFER_SIZE];
+	unsigned int len; /* bytes in buf to send, or received so far */
+	unsigned int pos; /* bytes sent, or looked through for the header's end */
 
+	/* the proxy's response, once it's all been read */
+	int status; /* status code */
+	char *status_line;
+	char *headers; /* header lines, each ending in \r\n */
+};
+
+static void
+http_build_request(char *buf, char *hostname, unsigned short port,
+                   char *username, char *password, int use_http_1_0)
+{
 	if(username && password) {
-		char *tmp;
+		char tmp[BASE64LEN];
 
 		snprintf(buf, 1024, "%s:%s", username, password);
-		tmp = base64(buf);
+		base64(buf, tmp);
 		if(use_http_1_0)
 			snprintf(buf, 1024, "CONNECT %s:%u HTTP/1.0\r\nProxy-Authorization: Basic %s\r\n\r\n", hostname, port, tmp); /* untested; sorry, I don't use auth. */
 		else
@@ -129,105 +148,257 @@ http_negotiate(int fd, char *hostname, unsigned short port,
 		else
 			snprintf(buf, 1024, "CONNECT %s:%u HTTP/1.1\r\nHost: %s:%u\r\n\r\n", hostname, port, hostname, port);
 	}
-	send(fd, buf, strlen(buf), 0);
+}
 
-	len = recv(fd, buf, 12, 0);
-	if(len <= 0) {
-		fprintf(stderr, "Error: Couldn't read from proxy after sending CONNECT command\n");
-		close(fd);
+/*
+ * parses the response header in state->buf, which is len bytes long
+ * including the blank line ending it, filling in state's status,
+ * status_line and headers. returns 0 on success or -1 if it isn't an
+ * HTTP/1.x response. the header comes from the proxy, so it's looked
+ * through by length; a NUL in it mustn't hide the end of a line.
+ */
+static int
+http_parse_response(struct http_state *state, unsigned int len)
+{
+	char *line = state->buf;
+	char *end;
+
+	/* the status line ends at the first \r\n, which may be the blank line's */
+	for(end = line; (end = memchr(end, '\r', len - 1 - (end - line))); end++) {
+		if(end[1] == '\n')
+			break;
+	}
+	if(!end || memchr(line, '\0', end - line))
+		return -1;
+
+	state->buf[len - 2] = '\0'; /* leaves the last header's \r\n */
+	*end = '\0';
+	state->status_line = line;
+	state->headers = end + 2;
+
+	/* HTTP/1.x nnn reason */
+	if(strncmp(line, "HTTP/1.", 7) != 0 || !line[7] || line[8] != ' ')
+		return -1;
+	line += 9;
+	if(line[0] < '0' || line[0] > '9' || line[1] < '0' || line[1] > '9' ||
+	   line[2] < '0' || line[2] > '9' || (line[3] != ' ' && line[3] != '\0'))
 		return -1;
+	state->status = (line[0] - '0') * 100 + (line[1] - '0') * 10 + (line[2] - '0');
+
+	return 0;
+}
+
+/*
+ * returns the value of the response header called name, which is
+ * stored in buf (with room for size bytes), or NULL if there isn't one
+ */
+static char *
+http_response_header(struct http_state *state, char *name,
+                     char *buf, unsigned int size)
+{
+	unsigned int namelen = strlen(name);
+	char *line, *end;
+
+	for(line = state->headers; *line; line = end + 2) {
+		end = strstr(line, "\r\n");
+		if(!end)
+			break;
+
+		if((unsigned int)(end - line) > namelen && line[namelen] == ':' &&
+		   strncasecmp(line, name, namelen) == 0) {
+			line += namelen + 1;
+			while(*line == ' ' || *line == '\t')
+				line++;
+			if((unsigned int)(end - line) >= size)
+				end = line + size - 1;
+			memcpy(buf, line, end - line);
+			buf[end - line] = '\0';
+			return buf;
+		}
 	}
-	buf[len] = '\0';
-	if(  (strcmp(buf, "HTTP/1.1 200") != 0) &&
-	     (strcmp(buf, "HTTP/1.0 200") != 0) ) {
-		fprintf(stderr, "HTTP Error: %s\n", buf);
-		shutdown(fd, SHUT_RDWR);
-		close(fd);
+
+	return NULL;
+}
+
+/*
+ * reads as much of the proxy's response as is there, and parses it once
+ * the whole header has arrived. if the CONNECT worked, anything after
+ * the header is already tunnel data, and is handed to the relay.
+ * returns 1 once the tunnel is set up, 0 if more has to be read, -1 on
+ * error, or PRT_NEGOTIATE_REFUSED if the proxy turned the CONNECT down.
+ */
+static int
+http_read_response(struct prt_context *context, struct http_state *state)
+{
+	char value[256];
+	int n;
+
+	n = recv(context->remotefd, state->buf + state->len, HTTP_BUFFER_SIZE - state->len, MSG_DONTWAIT);
+	if(n == 0) {
+		fprintf(stderr, "Error: Proxy closed the connection after CONNECT command\n");
+		return -1;
+	}
+	if(n < 0) {
+		if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+			return 0;
+		fprintf(stderr, "Error: Couldn't read from proxy after sending CONNECT command\n");
 		return -1;
 	}
+	state->len += n;
 
-	/*
-	 * the proxy might send some headers we don't need,
-	 * so we just keep reading bytes until we get \r\n\r\n
-	 */
-	for(i = 0; i < 4; i++) {
-		buf[i] = read_byte(fd);
-		if(buf[i] == -1) {
-			close(fd);
-			fprintf(stderr, "Error: Expected HTTP byte but couldn't read one\n");
-			return -1;
-		}
+	/* look for the blank line, starting where the last look left off */
+	for(; state->pos + 4 <= state->len; state->pos++) {
+		if(memcmp(state->buf + state->pos, "\r\n\r\n", 4) == 0)
+			break;
 	}
-	while(strncmp(buf, "\r\n\r\n", 4) != 0) {
-		for(i = 0; i < 3; i++)
-			buf[i] = buf[i+1];
-		buf[3] = read_byte(fd);
-		if(buf[3] == -1) {
-			close(fd);
-			fprintf(stderr, "Error: Expected HTTP byte but couldn't read one\n");
+	if(state->pos + 4 > state->len) {
+		if(state->len == HTTP_BUFFER_SIZE) {
+			fprintf(stderr, "Error: HTTP response header from proxy is too long\n");
 			return -1;
 		}
+		return 0;
 	}
+	n = state->pos + 4; /* header length */
 
-	return 0;
+	if(http_parse_response(state, n) == -1) {
+		fprintf(stderr, "HTTP Error: Invalid response from proxy\n");
+		return -1;
+	}
+	if(state->status < 200 || state->status > 299) {
+		fprintf(stderr, "HTTP Error: %s\n", state->status_line);
+		if(state->status == 407 && http_response_header(state, "Proxy-Authenticate", value, sizeof(value)))
+			fprintf(stderr, "Proxy requires authentication: %s\n", value);
+		return PRT_NEGOTIATE_REFUSED;
+	}
+
+	/*
+	 * tunnel data that came with the header goes ahead of anything
+	 * else. only a 2xx has any; anything else is the proxy's own body.
+	 */
+	if(state->len > (unsigned int)n &&
+	   prt_relay_preload(context, 0, state->buf + n, state->len - n) == -1) {
+		fprintf(stderr, "Error: Too much data from proxy\n");
+		return -1;
+	}
+
+	return 1;
 }
 
-/* connect to hostname:port via an http proxy; returns file descriptor */
-static int
-http_connect_to(struct prt_context *context,
-                char *hostname, unsigned short port,
-                char *username, char *password, int server_timeout)
+/*
+ * moves the CONNECT exchange with the proxy along as far as it can go
+ * without blocking; see the negotiate member of struct prt_context
+ */
+int
+http_negotiate(struct prt_context *context)
 {
-	int fd;
-	struct hostent *host;
-	int use_http_1_0;
+	struct http_state *state = context->data;
+	struct prt_handshake hs;
+	int fd = context->remotefd;
+
+	prt_chain_handshake(context, &hs);
+	for(;;) {
+		switch(state->step) {
+			case HTTP_CONNECTING:
+				switch(connection_status(fd)) {
+					case 0:
+						return PRT_EVENT_WRITE;
+					case -1:
+						fprintf(stderr, "Error: Unable to connect to HTTP proxy %s:%u\n", hs.server->host, hs.server->port);
+						return -1;
+				}
+				fprintf(stderr, "Connected to HTTP proxy %s:%u\n", hs.server->host, hs.server->port);
+				context->remote_connected = 1;
+
+				http_build_request(state->buf, hs.host, hs.port, hs.username, hs.password, (flags & PRT_HTTP_1_0) != 0);
+				state->len = strlen(state->buf);
+				state->pos = 0;
+				state->step = HTTP_SENDING;
+				break;
+			case HTTP_SENDING:
+				switch(send_pending(fd, state->buf, state->len, &state->pos)) {
+					case 0:
+						return PRT_EVENT_WRITE;
+					case -1:
+						fprintf(stderr, "Error: Couldn't send CONNECT command to proxy\n");
+						return -1;
+				}
+				state->len = 0;
+				state->pos = 0;
+				state->step = HTTP_READING_RESPONSE;
+				break;
+			case HTTP_READING_RESPONSE:
+				switch(http_read_response(context, state)) {
+					case 0:
+						return PRT_EVENT_READ;
+					case -1:
+						return -1;
+					case PRT_NEGOTIATE_REFUSED:
+						return PRT_NEGOTIATE_REFUSED;
+				}
+				return 0;
+		}
+	}
+}
 
-	if(!proxyhost) {
+/* connections go to the http proxy */
+static char *
+http_get_server(struct prt_context *context, int *family)
+{
+	if(!context->upstream) {
 		fprintf(stderr, "Error: No HTTP proxy host set\n");
-		return -1;
+		return NULL;
 	}
 
 #ifdef IPV6
-	if(flags & PRT_IPV6)
-		host = gethostbyname2(proxyhost, AF_INET6);
-	else
-		host = gethostbyname2(proxyhost, AF_INET);
+	*family = (flags & PRT_IPV6) ? AF_INET6 : AF_INET;
 #else
-	host = gethostbyname(proxyhost);
+	*family = AF_INET;
 #endif /* IPV6 */
-	if(!host) {
-		fprintf(stderr, "Error: Unable to resolve hostname %s\n", proxyhost);
+	return context->upstream->host;
+}
+
+/*
+ * gets ready to set up a tunnel through an http proxy over context's
+ * remote socket, which may be a tunnel through other proxies already
+ * (see chain.c). returns 0 on success or -1 on error.
+ */
+int
+http_start_hop(struct prt_context *context)
+{
+	struct http_state *state;
+
+	state = malloc(sizeof(struct http_state));
+	if(!state) {
+		fprintf(stderr, "http_start_hop(): Memory allocation failed\n");
 		return -1;
 	}
 
+	state->step = HTTP_CONNECTING;
+	context->data = state;
+
+	return 0;
+}
+
+/* start connecting to the http proxy at address; returns file descriptor */
+static int
+http_connect_to(struct prt_context *context, int family, unsigned char *address)
+{
+	int fd;
+
 #ifdef IPV6
-	if(flags & PRT_IPV6)
-		fd = establish_connection6(host->h_addr, proxyport);
+	if(family == AF_INET6)
+		fd = establish_connection6(address, context->upstream->port);
 	else
 #endif /* IPV6 */
-		fd = establish_connection(host->h_addr, proxyport);
+		fd = establish_connection(address, context->upstream->port);
 	if(fd == -1) {
-		fprintf(stderr, "Error: Unable to connect to HTTP proxy %s:%u\n", proxyhost, proxyport);
+		fprintf(stderr, "Error: Unable to connect to HTTP proxy %s:%u\n", context->upstream->host, context->upstream->port);
 		return -1;
 	}
-
-	/* set remote server socket timeout if necessary */
-	if(server_timeout) {
-		struct timeval timeout_val;
-
-		timeout_val.tv_sec = server_timeout;
-		timeout_val.tv_usec = 0;
-		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, (void *)&timeout_val, sizeof(timeout_val));
-	}
-
-	fprintf(stderr, "Connected to HTTP proxy %s:%u\n", proxyhost, proxyport);
-
-	if(flags & PRT_HTTP_1_0)
-		use_http_1_0 = 1;
-	else
-		use_http_1_0 = 0;
-	if(http_negotiate(fd, hostname, port, username, password, use_http_1_0) == -1)
+	if(http_start_hop(context) == -1) {
+		close(fd);
 		return -1;
+	}
 
 	return fd;
 }
@@ -239,36 +410,42 @@ http_disconnect(struct prt_context *context)
 	shutdown(context->remotefd, SHUT_RDWR);
 	close(context->localfd);
 	close(context->remotefd);
+
+	if(context->data)
+		free(context->data);
+	context->data = NULL;
 }
 
 static int
 http_local_read(struct prt_context *context, char *buf, int size)
 {
-	return recv(context->localfd, buf, size, 0);
+	return recv(context->localfd, buf, size, MSG_DONTWAIT);
 }
 
 static int
 http_remote_read(struct prt_context *context, char *buf, int size)
 {
-	return recv(context->remotefd, buf, size, 0);
+	return recv(context->remotefd, buf, size, MSG_DONTWAIT);
 }
 
 static int
 http_local_send(struct prt_context *context, char *buf, int size)
 {
-	return send(context->localfd, buf, size, 0);
+	return send(context->localfd, buf, size, MSG_DONTWAIT);
 }
 
 static int
 http_remote_send(struct prt_context *context, char *buf, int size)
 {
-	return send(context->remotefd, buf, size, 0);
+	return send(context->remotefd, buf, size, MSG_DONTWAIT);
 }
 
 void
 http_set_context(struct prt_context *context)
 {
+	context->get_server = http_get_server;
 	context->connect = http_connect_to;
+	context->negotiate = http_negotiate;
 	context->disconnect = http_disconnect;
 	context->local_read = http_local_read;
 	context->local_send = http_local_send;
@@ -0,0 +1,419 @@
+/*
+ * Copyright (C) 2002-2006 Josh A. Beam
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * limits on what clients may use: how many tunnels they can have open
+ * at once, how quickly they can open them, and how many bytes a
+ * second they can move each way. one set of limits applies to
+ * everyone together (--max-tunnels, --conn-rate and --rate-limit), and
+ * access list rules can have their own for the clients they match
+ * (see acl.c), shared by all of them.
+ *
+ * rates are token buckets holding up to a second's worth. bytes are
+ * taken from them once for each read, for as much as the read asks
+ * for, and what isn't read is put back; a direction that finds its
+ * bucket empty isn't read until it has refilled (see relay.c).
+ *
+ * the byte buckets are shared by every connection loop, so each loop
+ * takes tokens from them a chunk at a time into a stash of its own,
+ * and reads are paid for out of that. the lock is only taken when a
+ * stash runs dry.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#ifndef _WIN32
+#	include <pthread.h>
+#endif /* _WIN32 */
+#include "prtunnel.h"
+
+extern unsigned long prt_timer_clock();
+
+/* each loop takes up to this fraction of its share of a second's bytes at a time */
+#define PRT_STASH_PARTS 16
+
+/* big enough that loops' stashes don't share a cache line */
+#define PRT_STASH_SIZE 64
+
+struct prt_bucket {
+	unsigned long rate; /* tokens added a second; 0 for no limit */
+	unsigned long tokens;
+	unsigned long updated; /* when tokens were last added (prt_timer_clock()) */
+};
+
+/* tokens a loop has taken from a set of limits' byte buckets and not used yet */
+struct prt_stash {
+	unsigned long tokens[2];
+	char pad[PRT_STASH_SIZE - 2 * sizeof(unsigned long)];
+};
+
+struct prt_limit {
+	unsigned int max_tunnels; /* 0 for no limit */
+	unsigned int tunnels; /* open now */
+	struct prt_bucket conns; /* new tunnels */
+	struct prt_bucket bytes[2]; /* from the remote host, and from the client */
+	struct prt_stash *stashes; /* one for each loop (see prt_limit_start()) */
+	struct prt_limit *next; /* in the list of every set but global_limit */
+};
+
+static struct prt_limit global_limit;
+static int global_limited = 0; /* set if global_limit has anything set */
+static struct prt_limit *limits = NULL;
+static unsigned int num_stashes = 0;
+
+#ifndef _WIN32
+static pthread_mutex_t limit_lock = PTHREAD_MUTEX_INITIALIZER;
+#	define LOCK() pthread_mutex_lock(&limit_lock)
+#	define UNLOCK() pthread_mutex_unlock(&limit_lock)
+#else
+#	define LOCK()
+#	define UNLOCK()
+#endif /* _WIN32 */
+
+static void
+bucket_init(struct prt_bucket *bucket, unsigned long rate)
+{
+	bucket->rate = rate;
+	bucket->tokens = rate;
+	bucket->updated = prt_timer_clock();
+}
+
+/* adds the tokens bucket has earned since it was last topped up */
+static void
+bucket_refill(struct prt_bucket *bucket, unsigned long now)
+{
+	unsigned long elapsed = now - bucket->updated;
+	unsigned long earned;
+
+	if(elapsed >= 1000) {
+		bucket->tokens = bucket->rate;
+		bucket->updated = now;
+		return;
+	}
+
+	/* split up so a large rate can't overflow */
+	earned = elapsed * (bucket->rate / 1000) + elapsed * (bucket->rate % 1000) / 1000;
+	if(earned == 0)
+		return; /* let the fraction build up */
+	bucket->tokens += earned;
+	if(bucket->tokens > bucket->rate)
+		bucket->tokens = bucket->rate;
+	bucket->updated = now;
+}
+
+/*
+ * takes up to want tokens from bucket, returning how many it got. if
+ * it got none, *wait is lowered to the milliseconds until a useful
+ * number will be there.
+ */
+static unsigned long
+bucket_take(struct prt_bucket *bucket, unsigned long want,
+            unsigned long now, unsigned long *wait)
+{
+	unsigned long need;
+
+	if(!bucket->rate)
+		return want;
+
+	bucket_refill(bucket, now);
+	if(bucket->tokens == 0) {
+		/* waking up for a handful of bytes isn't worth it */
+		need = bucket->rate / 10;
+		if(need > want)
+			need = want;
+		if(need == 0)
+			need = 1;
+		need = (need * 1000 + bucket->rate - 1) / bucket->rate;
+		if(need < *wait)
+			*wait = need;
+		return 0;
+	}
+
+	if(want > bucket->tokens)
+		want = bucket->tokens;
+	bucket->tokens -= want;
+	return want;
+}
+
+void
+set_max_tunnels(unsigned int count)
+{
+	global_limit.max_tunnels = count;
+	if(count)
+		global_limited = 1;
+}
+
+void
+set_connection_rate(unsigned int rate)
+{
+	bucket_init(&global_limit.conns, rate);
+	if(rate)
+		global_limited = 1;
+}
+
+void
+set_rate_limit(unsigned long rate)
+{
+	bucket_init(&global_limit.bytes[0], rate);
+	bucket_init(&global_limit.bytes[1], rate);
+	if(rate)
+		global_limited = 1;
+}
+
+/*
+ * returns a new set of limits, with the given maximum tunnels, new
+ * tunnels a second and bytes a second from the client (up) and to it
+ * (down); 0 means no limit. returns NULL on error.
+ */
+struct prt_limit *
+prt_limit_new(unsigned int max_tunnels, unsigned int conn_rate,
+              unsigned long up, unsigned long down)
+{
+	struct prt_limit *limit;
+
+	limit = malloc(sizeof(struct prt_limit));
+	if(!limit) {
+		fprintf(stderr, "prt_limit_new(): Memory allocation failed\n");
+		return NULL;
+	}
+
+	limit->max_tunnels = max_tunnels;
+	limit->tunnels = 0;
+	bucket_init(&limit->conns, conn_rate);
+	bucket_init(&limit->bytes[0], down);
+	bucket_init(&limit->bytes[1], up);
+	limit->stashes = NULL;
+	limit->next = limits;
+	limits = limit;
+
+	return limit;
+}
+
+/* gives limit a stash for each of count loops. returns 0 on success or -1 on error */
+static int
+limit_start(struct prt_limit *limit, unsigned int count)
+{
+	if(!limit->bytes[0].rate && !limit->bytes[1].rate)
+		return 0;
+
+	limit->stashes = calloc(count, sizeof(struct prt_stash));
+	if(!limit->stashes) {
+		fprintf(stderr, "prt_limit_start(): Memory allocation failed\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * sets up the stashes that count connection loops pay for reads from.
+ * this has to be called before the loops start, after every set of
+ * limits has been made. returns 0 on success or -1 on error.
+ */
+int
+prt_limit_start(unsigned int count)
+{
+	struct prt_limit *limit;
+
+	num_stashes = count;
+	if(limit_start(&global_limit, count) == -1)
+		return -1;
+	for(limit = limits; limit; limit = limit->next) {
+		if(limit_start(limit, count) == -1)
+			return -1;
+	}
+
+	return 0;
+}
+
+/* returns nonzero if limit (which may be NULL) has room for another tunnel */
+static int
+limit_admits(struct prt_limit *limit)
+{
+	if(!limit)
+		return 1;
+	if(limit->max_tunnels && limit->tunnels >= limit->max_tunnels)
+		return 0;
+	if(limit->conns.rate) {
+		bucket_refill(&limit->conns, prt_timer_clock());
+		if(limit->conns.tokens == 0)
+			return 0;
+	}
+
+	return 1;
+}
+
+static void
+limit_admit(struct prt_limit *limit)
+{
+	if(!limit)
+		return;
+	limit->tunnels++;
+	if(limit->conns.rate)
+		limit->conns.tokens--;
+}
+
+/*
+ * counts a new tunnel from a client that limit (NULL if none) applies
+ * to, unless it or the global limits are used up. returns 1 if the
+ * tunnel can go ahead, or 0 if it should be turned away.
+ */
+int
+prt_limit_admit(struct prt_limit *limit)
+{
+	struct prt_limit *global = global_limited ? &global_limit : NULL;
+	int ok;
+
+	if(!limit && !global)
+		return 1;
+
+	LOCK();
+	ok = limit_admits(limit) && limit_admits(global);
+	if(ok) {
+		limit_admit(limit);
+		limit_admit(global);
+	}
+	UNLOCK();
+
+	return ok;
+}
+
+/* a tunnel counted by prt_limit_admit() has closed */
+void
+prt_limit_release(struct prt_limit *limit)
+{
+	if(!limit && !global_limited)
+		return;
+
+	LOCK();
+	if(limit)
+		limit->tunnels--;
+	if(global_limited)
+		global_limit.tunnels--;
+	UNLOCK();
+}
+
+/* returns nonzero if as many tunnels are open as are allowed in all */
+int
+prt_limit_full()
+{
+	int full;
+
+	if(!global_limit.max_tunnels)
+		return 0;
+
+	LOCK();
+	full = global_limit.tunnels >= global_limit.max_tunnels;
+	UNLOCK();
+
+	return full;
+}
+
+/*
+ * takes up to want tokens for one direction of limit out of loop
+ * worker's stash, topping it up from the bucket first if it hasn't
+ * got enough. if it gets none, *wait is lowered to the milliseconds
+ * until it's worth asking again.
+ */
+static unsigned long
+stash_take(struct prt_limit *limit, unsigned int worker, int outgoing,
+           unsigned long want, unsigned long *wait)
+{
+	struct prt_bucket *bucket = &limit->bytes[outgoing];
+	unsigned long *stash, chunk;
+
+	if(!bucket->rate)
+		return want;
+
+	stash = &limit->stashes[worker].tokens[outgoing];
+	if(*stash < want) {
+		chunk = bucket->rate / num_stashes / PRT_STASH_PARTS;
+		if(chunk < want - *stash)
+			chunk = want - *stash;
+
+		LOCK();
+		*stash += bucket_take(bucket, chunk, prt_timer_clock(), wait);
+		UNLOCK();
+
+		if(want > *stash)
+			want = *stash;
+	}
+
+	*stash -= want;
+	return want;
+}
+
+/*
+ * returns how many of want bytes may be read from the client (if
+ * outgoing is nonzero) or the remote host of a tunnel on loop worker
+ * that limit applies to. if the answer is 0, *wait is set to the
+ * milliseconds until it's worth asking again.
+ */
+unsigned int
+prt_limit_take(struct prt_limit *limit, unsigned int worker, int outgoing,
+               unsigned int want, unsigned long *wait)
+{
+	unsigned long got, got_global;
+
+	if((!limit || !limit->bytes[outgoing].rate) &&
+	   (!global_limited || !global_limit.bytes[outgoing].rate))
+		return want;
+
+	*wait = 1000;
+	got = limit ? stash_take(limit, worker, outgoing, want, wait) : want;
+	if(got) {
+		got_global = stash_take(&global_limit, worker, outgoing, got, wait);
+		if(limit && limit->bytes[outgoing].rate && got_global < got)
+			limit->stashes[worker].tokens[outgoing] += got - got_global;
+		got = got_global;
+	}
+
+	return got;
+}
+
+/* returns nonzero if prt_limit_take() may ever hold back a tunnel limit applies to */
+int
+prt_limit_bytes(struct prt_limit *limit)
+{
+	int i;
+
+	for(i = 0; i < 2; i++) {
+		if((limit && limit->bytes[i].rate) || (global_limited && global_limit.bytes[i].rate))
+			return 1;
+	}
+
+	return 0;
+}
+
+/* gives back bytes taken with prt_limit_take() that weren't read */
+void
+prt_limit_return(struct prt_limit *limit, unsigned int worker, int outgoing,
+                 unsigned int n)
+{
+	if(limit && limit->bytes[outgoing].rate)
+		limit->stashes[worker].tokens[outgoing] += n;
+	if(global_limit.bytes[outgoing].rate)
+		global_limit.stashes[worker].tokens[outgoing] += n;
+}
@@ -44,14 +44,35 @@
 unsigned int flags = 0;
 
 extern unsigned char proxytype;
-extern char *proxyhost;
 extern unsigned short proxyport;
 
 void show_usage_message(char *, FILE *);
 void show_version_message();
 
 extern void set_keepalive_interval(unsigned int, char);
+extern void set_worker_count(unsigned int);
+extern void set_listen_backlog(int);
+extern void set_max_loop_lag(unsigned int);
+extern void set_overload_shed(int);
+extern int set_metrics_endpoint(char *);
+extern int set_trace_file(char *);
+extern void set_slow_setup(unsigned int);
+extern void set_dns_cache_ttl(unsigned int);
+extern void set_udp_timeout(unsigned int);
+extern int set_balance_method(const char *);
+extern void set_health_check_interval(unsigned int);
+extern void set_upstream_timeout(unsigned int);
+extern void set_hedge_percentile(unsigned int);
+extern int set_proxy_chain(char *);
+extern unsigned int prt_chain_length();
+extern int prt_upstream_add(const char *, unsigned short);
 extern void add_trusted_address(char *);
+extern int add_denied_address(char *);
+extern int prt_event_set_backend(char *);
+extern int load_trusted_addresses(char *);
+extern void set_max_tunnels(unsigned int);
+extern void set_connection_rate(unsigned int);
+extern void set_rate_limit(unsigned long);
 extern int prt_proxy(unsigned char *, unsigned short, char *, unsigned short, char *, char *, int, int);
 
 static char username[USERNAME_MAX];
@@ -79,6 +100,8 @@ main(int argc, char *argv[])
 #endif /* IPV6 */
 	int timeout = 0, server_timeout = 0;
 	int password_prompt = 0;
+	char *proxyhosts[PRT_UPSTREAMS_MAX];
+	int num_proxyhosts = 0;
 #ifdef _WIN32
 	WSADATA wsadata;
 #endif /* _WIN32 */
@@ -106,18 +129,49 @@ main(int argc, char *argv[])
 			for(j = i; j < argc - 1; j++)
 				argv[j] = argv[j + 1];
 			argc--;
+			i--;
 		} else if(strcmp(argv[i], "--password-prompt") == 0) {
 			password_prompt = 1;
 
 			for(j = i; j < argc - 1; j++)
 				argv[j] = argv[j + 1];
 			argc--;
+			i--;
 		} else if(strcmp(argv[i], "--irc-auto-pong") == 0) {
 			flags |= PRT_IRC_AUTOPONG;
 
 			for(j = i; j < argc - 1; j++)
 				argv[j] = argv[j + 1];
 			argc--;
+			i--;
+		} else if(strcmp(argv[i], "--event-backend") == 0) {
+			if(i + 1 >= argc) {
+				show_usage_message(argv[0], stderr);
+				return 1;
+			}
+
+			if(!prt_event_set_backend(argv[i + 1])) {
+				fprintf(stderr, "Invalid or unsupported event backend `%s'\n", argv[i + 1]);
+				return 1;
+			}
+
+			for(j = i; j < argc - 1; j++)
+				argv[j] = argv[j + 1];
+			for(j = i; j < argc - 1; j++)
+				argv[j] = argv[j + 1];
+			argc -= 2;
+			i--;
+		} else if(strcmp(argv[i], "--splice") == 0) {
+#ifndef __linux__
+			fprintf(stderr, "Can't use --splice; prtunnel not compiled with splice support\n");
+			return 1;
+#endif /* __linux__ */
+			flags |= PRT_SPLICE;
+
+			for(j = i; j < argc - 1; j++)
+				argv[j] = argv[j + 1];
+			argc--;
+			i--;
 		} else if(strcmp(argv[i], "--telnet-keep-alive") == 0) {
 			unsigned long keepalive;
 
@@ -134,6 +188,7 @@ main(int argc, char *argv[])
 			for(j = i; j < argc - 1; j++)
 				argv[j] = argv[j + 1];
 			argc -= 2;
+			i--;
 		} else if(strcmp(argv[i], "--crlf-keep-alive") == 0) {
 			unsigned int keepalive;
 
@@ -150,6 +205,7 @@ main(int argc, char *argv[])
 			for(j = i; j < argc - 1; j++)
 				argv[j] = argv[j + 1];
 			argc -= 2;
+			i--;
 		} else if(strcmp(argv[i], "--max-processes") == 0) {
 			if(i + 1 >= argc) {
 				show_usage_message(argv[0], stderr);
@@ -163,6 +219,7 @@ main(int argc, char *argv[])
 			for(j = i; j < argc - 1; j++)
 				argv[j] = argv[j + 1];
 			argc -= 2;
+			i--;
 		} else if(strcmp(argv[i], "--timeout") == 0) {
 			if(i + 1 >= argc) {
 				show_usage_message(argv[0], stderr);
@@ -176,6 +233,7 @@ main(int argc, char *argv[])
 			for(j = i; j < argc - 1; j++)
 				argv[j] = argv[j + 1];
 			argc -= 2;
+			i--;
 		} else if(strcmp(argv[i], "--server-timeout") == 0) {
 			if(i + 1 >= argc) {
 				show_usage_message(argv[0], stderr);
@@ -189,6 +247,390 @@ main(int argc, char *argv[])
 			for(j = i; j < argc - 1; j++)
 				argv[j] = argv[j + 1];
 			argc -= 2;
+			i--;
+		} else if(strcmp(argv[i], "--balance") == 0) {
+			if(i + 1 >= argc) {
+				show_usage_message(argv[0], stderr);
+				return 1;
+			}
+
+			if(set_balance_method(argv[i + 1]) == -1) {
+				fprintf(stderr, "Invalid balancing method `%s'\n", argv[i + 1]);
+				return 1;
+			}
+
+			for(j = i; j < argc - 1; j++)
+				argv[j] = argv[j + 1];
+			for(j = i; j < argc - 1; j++)
+				argv[j] = argv[j + 1];
+			argc -= 2;
+			i--;
+		} else if(strcmp(argv[i], "--health-check") == 0) {
+			int interval;
+
+			if(i + 1 >= argc) {
+				show_usage_message(argv[0], stderr);
+				return 1;
+			}
+
+			interval = atoi(argv[i + 1]);
+			if(interval < 0) {
+				fprintf(stderr, "Invalid health check interval `%s'\n", argv[i + 1]);
+				return 1;
+			}
+#ifdef _WIN32
+			if(interval > 0) {
+				fprintf(stderr, "Can't do health checks; prtunnel not compiled with thread support\n");
+				return 1;
+			}
+#endif /* _WIN32 */
+			set_health_check_interval(interval);
+
+			for(j = i; j < argc - 1; j++)
+				argv[j] = argv[j + 1];
+			for(j = i; j < argc - 1; j++)
+				argv[j] = argv[j + 1];
+			argc -= 2;
+			i--;
+		} else if(strcmp(argv[i], "--upstream-timeout") == 0) {
+			int timeout;
+
+			if(i + 1 >= argc) {
+				show_usage_message(argv[0], stderr);
+				return 1;
+			}
+
+			timeout = atoi(argv[i + 1]);
+			if(timeout < 0) {
+				fprintf(stderr, "Invalid upstream timeout `%s'\n", argv[i + 1]);
+				return 1;
+			}
+			set_upstream_timeout(timeout);
+
+			for(j = i; j < argc - 1; j++)
+				argv[j] = argv[j + 1];
+			for(j = i; j < argc - 1; j++)
+				argv[j] = argv[j + 1];
+			argc -= 2;
+			i--;
+		} else if(strcmp(argv[i], "--hedge") == 0) {
+			int percentile;
+
+			if(i + 1 >= argc) {
+				show_usage_message(argv[0], stderr);
+				return 1;
+			}
+
+			percentile = atoi(argv[i + 1]);
+			if(percentile < 0 || percentile > 99) {
+				fprintf(stderr, "Invalid hedging percentile `%s'\n", argv[i + 1]);
+				return 1;
+			}
+			set_hedge_percentile(percentile);
+
+			for(j = i; j < argc - 1; j++)
+				argv[j] = argv[j + 1];
+			for(j = i; j < argc - 1; j++)
+				argv[j] = argv[j + 1];
+			argc -= 2;
+			i--;
+		} else if(strcmp(argv[i], "--max-tunnels") == 0) {
+			int count;
+
+			if(i + 1 >= argc) {
+				show_usage_message(argv[0], stderr);
+				return 1;
+			}
+
+			count = atoi(argv[i + 1]);
+			if(count < 0) {
+				fprintf(stderr, "Invalid tunnel count `%s'\n", argv[i + 1]);
+				return 1;
+			}
+			set_max_tunnels(count);
+
+			for(j = i; j < argc - 1; j++)
+				argv[j] = argv[j + 1];
+			for(j = i; j < argc - 1; j++)
+				argv[j] = argv[j + 1];
+			argc -= 2;
+			i--;
+		} else if(strcmp(argv[i], "--conn-rate") == 0) {
+			int rate;
+
+			if(i + 1 >= argc) {
+				show_usage_message(argv[0], stderr);
+				return 1;
+			}
+
+			rate = atoi(argv[i + 1]);
+			if(rate < 0) {
+				fprintf(stderr, "Invalid connection rate `%s'\n", argv[i + 1]);
+				return 1;
+			}
+			set_connection_rate(rate);
+
+			for(j = i; j < argc - 1; j++)
+				argv[j] = argv[j + 1];
+			for(j = i; j < argc - 1; j++)
+				argv[j] = argv[j + 1];
+			argc -= 2;
+			i--;
+		} else if(strcmp(argv[i], "--rate-limit") == 0) {
+			long rate;
+
+			if(i + 1 >= argc) {
+				show_usage_message(argv[0], stderr);
+				return 1;
+			}
+
+			rate = atol(argv[i + 1]);
+			if(rate < 0) {
+				fprintf(stderr, "Invalid rate limit `%s'\n", argv[i + 1]);
+				return 1;
+			}
+			set_rate_limit(rate);
+
+			for(j = i; j < argc - 1; j++)
+				argv[j] = argv[j + 1];
+			for(j = i; j < argc - 1; j++)
+				argv[j] = argv[j + 1];
+			argc -= 2;
+			i--;
+		} else if(strcmp(argv[i], "--deny") == 0) {
+			if(i + 1 >= argc) {
+				show_usage_message(argv[0], stderr);
+				return 1;
+			}
+
+			if(add_denied_address(argv[i + 1]) == -1)
+				return 1;
+
+			for(j = i; j < argc - 1; j++)
+				argv[j] = argv[j + 1];
+			for(j = i; j < argc - 1; j++)
+				argv[j] = argv[j + 1];
+			argc -= 2;
+			i--;
+		} else if(strcmp(argv[i], "--acl") == 0) {
+			if(i + 1 >= argc) {
+				show_usage_message(argv[0], stderr);
+				return 1;
+			}
+
+			if(load_trusted_addresses(argv[i + 1]) == -1)
+				return 1;
+
+			for(j = i; j < argc - 1; j++)
+				argv[j] = argv[j + 1];
+			for(j = i; j < argc - 1; j++)
+				argv[j] = argv[j + 1];
+			argc -= 2;
+			i--;
+		} else if(strcmp(argv[i], "--chain") == 0) {
+			if(i + 1 >= argc) {
+				show_usage_message(argv[0], stderr);
+				return 1;
+			}
+
+			if(set_proxy_chain(argv[i + 1]) == -1)
+				return 1;
+
+			for(j = i; j < argc - 1; j++)
+				argv[j] = argv[j + 1];
+			for(j = i; j < argc - 1; j++)
+				argv[j] = argv[j + 1];
+			argc -= 2;
+			i--;
+		} else if(strcmp(argv[i], "--workers") == 0) {
+			int workers;
+
+			if(i + 1 >= argc) {
+				show_usage_message(argv[0], stderr);
+				return 1;
+			}
+
+			workers = atoi(argv[i + 1]);
+			if(workers < 1) {
+				fprintf(stderr, "Invalid number of workers `%s'\n", argv[i + 1]);
+				return 1;
+			}
+#ifdef _WIN32
+			if(workers > 1) {
+				fprintf(stderr, "Can't use more than one worker; prtunnel not compiled with thread support\n");
+				return 1;
+			}
+#endif /* _WIN32 */
+			set_worker_count(workers);
+
+			for(j = i; j < argc - 1; j++)
+				argv[j] = argv[j + 1];
+			for(j = i; j < argc - 1; j++)
+				argv[j] = argv[j + 1];
+			argc -= 2;
+			i--;
+		} else if(strcmp(argv[i], "--backlog") == 0) {
+			int backlog;
+
+			if(i + 1 >= argc) {
+				show_usage_message(argv[0], stderr);
+				return 1;
+			}
+
+			backlog = atoi(argv[i + 1]);
+			if(backlog < 1) {
+				fprintf(stderr, "Invalid backlog `%s'\n", argv[i + 1]);
+				return 1;
+			}
+			set_listen_backlog(backlog);
+
+			for(j = i; j < argc - 1; j++)
+				argv[j] = argv[j + 1];
+			for(j = i; j < argc - 1; j++)
+				argv[j] = argv[j + 1];
+			argc -= 2;
+			i--;
+		} else if(strcmp(argv[i], "--max-loop-lag") == 0) {
+			int lag;
+
+			if(i + 1 >= argc) {
+				show_usage_message(argv[0], stderr);
+				return 1;
+			}
+
+			lag = atoi(argv[i + 1]);
+			if(lag < 0) {
+				fprintf(stderr, "Invalid loop lag `%s'\n", argv[i + 1]);
+				return 1;
+			}
+			set_max_loop_lag(lag);
+
+			for(j = i; j < argc - 1; j++)
+				argv[j] = argv[j + 1];
+			for(j = i; j < argc - 1; j++)
+				argv[j] = argv[j + 1];
+			argc -= 2;
+			i--;
+		} else if(strcmp(argv[i], "--overload") == 0) {
+			if(i + 1 >= argc) {
+				show_usage_message(argv[0], stderr);
+				return 1;
+			}
+
+			if(strcmp(argv[i + 1], "queue") == 0)
+				set_overload_shed(0);
+			else if(strcmp(argv[i + 1], "shed") == 0)
+				set_overload_shed(1);
+			else {
+				fprintf(stderr, "Invalid overload policy `%s'\n", argv[i + 1]);
+				return 1;
+			}
+
+			for(j = i; j < argc - 1; j++)
+				argv[j] = argv[j + 1];
+			for(j = i; j < argc - 1; j++)
+				argv[j] = argv[j + 1];
+			argc -= 2;
+			i--;
+		} else if(strcmp(argv[i], "--metrics") == 0) {
+			if(i + 1 >= argc) {
+				show_usage_message(argv[0], stderr);
+				return 1;
+			}
+
+#ifdef _WIN32
+			fprintf(stderr, "Can't serve metrics; prtunnel not compiled with thread support\n");
+			return 1;
+#endif /* _WIN32 */
+			if(set_metrics_endpoint(argv[i + 1]) == -1) {
+				fprintf(stderr, "Invalid metrics port or socket path `%s'\n", argv[i + 1]);
+				return 1;
+			}
+
+			for(j = i; j < argc - 1; j++)
+				argv[j] = argv[j + 1];
+			for(j = i; j < argc - 1; j++)
+				argv[j] = argv[j + 1];
+			argc -= 2;
+			i--;
+		} else if(strcmp(argv[i], "--trace") == 0) {
+			if(i + 1 >= argc) {
+				show_usage_message(argv[0], stderr);
+				return 1;
+			}
+
+			if(set_trace_file(argv[i + 1]) == -1)
+				return 1;
+
+			for(j = i; j < argc - 1; j++)
+				argv[j] = argv[j + 1];
+			for(j = i; j < argc - 1; j++)
+				argv[j] = argv[j + 1];
+			argc -= 2;
+			i--;
+		} else if(strcmp(argv[i], "--slow-setup") == 0) {
+			int msecs;
+
+			if(i + 1 >= argc) {
+				show_usage_message(argv[0], stderr);
+				return 1;
+			}
+
+			msecs = atoi(argv[i + 1]);
+			if(msecs < 0) {
+				fprintf(stderr, "Invalid setup time `%s'\n", argv[i + 1]);
+				return 1;
+			}
+			set_slow_setup(msecs);
+
+			for(j = i; j < argc - 1; j++)
+				argv[j] = argv[j + 1];
+			for(j = i; j < argc - 1; j++)
+				argv[j] = argv[j + 1];
+			argc -= 2;
+			i--;
+		} else if(strcmp(argv[i], "--dns-cache-ttl") == 0) {
+			int ttl;
+
+			if(i + 1 >= argc) {
+				show_usage_message(argv[0], stderr);
+				return 1;
+			}
+
+			ttl = atoi(argv[i + 1]);
+			if(ttl < 0) {
+				fprintf(stderr, "Invalid DNS cache TTL `%s'\n", argv[i + 1]);
+				return 1;
+			}
+			set_dns_cache_ttl(ttl);
+
+			for(j = i; j < argc - 1; j++)
+				argv[j] = argv[j + 1];
+			for(j = i; j < argc - 1; j++)
+				argv[j] = argv[j + 1];
+			argc -= 2;
+			i--;
+		} else if(strcmp(argv[i], "--udp-timeout") == 0) {
+			int timeout;
+
+			if(i + 1 >= argc) {
+				show_usage_message(argv[0], stderr);
+				return 1;
+			}
+
+			timeout = atoi(argv[i + 1]);
+			if(timeout < 0) {
+				fprintf(stderr, "Invalid UDP timeout `%s'\n", argv[i + 1]);
+				return 1;
+			}
+			set_udp_timeout(timeout);
+
+			for(j = i; j < argc - 1; j++)
+				argv[j] = argv[j + 1];
+			for(j = i; j < argc - 1; j++)
+				argv[j] = argv[j + 1];
+			argc -= 2;
+			i--;
 		} else if(strncmp(argv[i], "--", 2) == 0) {
 			fprintf(stderr, "Invalid option `%s'. Run %s --help for more information.\n", argv[i], argv[0]);
 			return 1;
@@ -241,7 +683,11 @@ main(int argc, char *argv[])
 				}
 				break;
 			case 'H':
-				proxyhost = optarg;
+				if(num_proxyhosts == PRT_UPSTREAMS_MAX) {
+					fprintf(stderr, "Too many proxy servers (at most %d)\n", PRT_UPSTREAMS_MAX);
+					return 1;
+				}
+				proxyhosts[num_proxyhosts++] = optarg;
 				break;
 			case 'P':
 				proxyport = atoi(optarg);
@@ -269,8 +715,19 @@ main(int argc, char *argv[])
 		return 1;
 	}
 
-	if(!proxyhost && proxytype != PRT_DIRECT && proxytype != PRT_DIRECT6) {
-		fprintf(stderr, "No proxy hostname has been specified. You can specify one with the -H option.\nRun `%s --help' for more information.\n", argv[0]);
+	if(proxytype != PRT_DIRECT && proxytype != PRT_DIRECT6) {
+		if(num_proxyhosts == 0) {
+			fprintf(stderr, "No proxy hostname has been specified. You can specify one with the -H option.\nRun `%s --help' for more information.\n", argv[0]);
+			return 1;
+		}
+
+		/* -P can come after -H, so ports are only filled in now */
+		for(i = 0; i < num_proxyhosts; i++) {
+			if(prt_upstream_add(proxyhosts[i], proxyport) == -1)
+				return 1;
+		}
+	} else if(prt_chain_length()) {
+		fprintf(stderr, "--chain needs a proxy server to start from; give one with -H.\n");
 		return 1;
 	}
 
@@ -324,9 +781,14 @@ show_usage_message(char *name, FILE *fp)
 	fprintf(fp, "  -c\t\t\tUse color to differentiate between incoming\n\t\t\tand outgoing data in verbose output\n");
 	fprintf(fp, "  -6\t\t\tUse IPv6; prtunnel must be compiled with IPv6 support\n");
 	fprintf(fp, "  -t <proxy type>\tSet proxy type. Valid types are http (default),\n\t\t\tsocks5, direct, direct6\n");
-	fprintf(fp, "  -H <proxy host>\tSet proxy server hostname\n");
+	fprintf(fp, "  -H <proxy host>\tSet proxy server hostname, optionally as host:port;\n\t\t\tgive it more than once to spread tunnels across\n\t\t\tseveral proxies\n");
 	fprintf(fp, "  -P <proxy port>\tSet proxy server port; defaults are 8080 for http,\n\t\t\t1080 for socks5\n");
-	fprintf(fp, "  -T <address>\t\tAdd a trusted address. For security reasons, only\n\t\t\t127.0.0.1 is trusted by default. See the prtunnel\n\t\t\tman page or README file for more information.\n");
+	fprintf(fp, "  -T <address>\t\tAdd a trusted address. For security reasons, only\n\t\t\t127.0.0.1 and ::1 are trusted by default. See the\n\t\t\tprtunnel man page or README file for more information.\n");
+	fprintf(fp, "  --deny <address>\tTurn clients from <address> away, even if a shorter\n\t\t\tprefix given with -T would allow them\n");
+	fprintf(fp, "  --acl <file>\t\tRead allow and deny rules for clients from <file>\n");
+	fprintf(fp, "  --max-tunnels <count>\n\t\t\tStop taking new connections while <count> tunnels\n\t\t\tare open (default 0; no limit; see --overload)\n");
+	fprintf(fp, "  --conn-rate <count>\tTurn clients away once <count> tunnels have been\n\t\t\topened in the last second (default 0; no limit)\n");
+	fprintf(fp, "  --rate-limit <bytes>\tRelay at most <bytes> a second each way, across all\n\t\t\ttunnels (default 0; no limit)\n");
 	fprintf(fp, "  -u <username>\t\tSet authentication username\n");
 	fprintf(fp, "  -p <password>\t\tSet authentication password\n");
 	fprintf(fp, "  --password-prompt\tPrompt for proxy username and password\n");
@@ -336,6 +798,22 @@ show_usage_message(char *name, FILE *fp)
 	fprintf(fp, "  --irc-auto-pong\tCauses prtunnel to automatically respond to PING\n\t\t\tcommands sent by IRC servers\n");
 	fprintf(fp, "  --timeout <time>\tAllows you to set a client socket timeout; if no data\n\t\t\tis recieved from the client for <time> seconds, the\n\t\t\tconnection will be closed\n");
 	fprintf(fp, "  --server-timeout <time>\n\t\t\tAllows you to set a server socket timeout; if no data\n\t\t\tis recieved from the remote host for <time> seconds,\n\t\t\tthe connection will be closed\n");
+	fprintf(fp, "  --workers <count>\tRun <count> worker threads in daemon mode, each with\n\t\t\tits own listening socket, to spread connections\n\t\t\tacross CPU cores\n");
+	fprintf(fp, "  --backlog <count>\tLet up to <count> connections wait to be accepted\n\t\t\t(default 128)\n");
+	fprintf(fp, "  --max-loop-lag <time>\n\t\t\tStop taking new connections while handling socket\n\t\t\tevents takes over <time> milliseconds (default 0;\n\t\t\tno limit)\n");
+	fprintf(fp, "  --overload <policy>\tWhat to do with new connections when overloaded:\n\t\t\tqueue (default; leave them waiting to be accepted)\n\t\t\tor shed (accept and close them)\n");
+	fprintf(fp, "  --metrics <port|path>\tServe counters and latency histograms for Prometheus\n\t\t\ton <port> of 127.0.0.1, or a Unix socket at <path>\n");
+	fprintf(fp, "  --trace <file>\tAppend a record of how long each step of setting\n\t\t\tit up took to <file> for every tunnel (- for\n\t\t\tstandard error)\n");
+	fprintf(fp, "  --slow-setup <time>\tLog the record of any tunnel that takes over <time>\n\t\t\tmilliseconds to set up (default 0; off)\n");
+	fprintf(fp, "  --balance <method>\tSet how a proxy is picked for each tunnel with more\n\t\t\tthan one -H: ewma (default; fastest to set up\n\t\t\ttunnels, weighed by load) or least-conn\n");
+	fprintf(fp, "  --health-check <interval>\n\t\t\tTry connecting to each proxy every <interval>\n\t\t\tseconds, and stop using those that fail\n\t\t\t(default 0; off)\n");
+	fprintf(fp, "  --upstream-timeout <time>\n\t\t\tTry another proxy if setting a tunnel up through\n\t\t\tone takes over <time> seconds (default 5; 0 for\n\t\t\tnever)\n");
+	fprintf(fp, "  --chain <hops>\tAfter the proxy, go through each of <hops>, given\n\t\t\tas http://host[:port] or socks5://host[:port] and\n\t\t\tseparated by commas; user:password@ can go before\n\t\t\thost\n");
+	fprintf(fp, "  --hedge <percentile>\tAlso try another proxy if setting a tunnel up is\n\t\t\tslower than <percentile>%% of recent ones, and use\n\t\t\twhichever is quicker (default 0; off)\n");
+	fprintf(fp, "  --dns-cache-ttl <time>\n\t\t\tRemember looked up host names for <time> seconds\n\t\t\t(default 60; 0 turns the cache off)\n");
+	fprintf(fp, "  --udp-timeout <time>\n\t\t\tEnd SOCKS5 UDP associations that go <time> seconds\n\t\t\twithout a datagram (default 60; 0 for never)\n");
+	fprintf(fp, "  --event-backend <name>\n\t\t\tSet the method used to wait for socket events:\n\t\t\tepoll (default on Linux), io_uring or select; with\n\t\t\tio_uring, tunnels that aren't rate limited or\n\t\t\tsplicing are relayed with completions\n");
+	fprintf(fp, "  --splice\t\tMove tunnel data with splice() instead of copying\n\t\t\tit (Linux only; not used with -V or --irc-auto-pong)\n");
 	fprintf(fp, "  -h, --help\t\tShow this help message\n");
 	fprintf(fp, "  -v, --version\t\tShow version information\n");
 }
@@ -0,0 +1,509 @@
+/*
+ * Copyright (C) 2002-2006 Josh A. Beam
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * counters and latency histograms, and an endpoint that serves them to
+ * Prometheus (--metrics). each connection loop keeps its own struct
+ * prt_metrics, written to by nothing but the loop's thread, so keeping
+ * count costs no more than an addition. the endpoint runs in its own
+ * thread, and adds every loop's counters up when it's asked for them,
+ * reading each with an atomic load (see PRT_COUNTER_ADD() in
+ * prtunnel.h). counters are read one at a time, so a report may be a
+ * moment behind on some of them, which doesn't matter to anything that
+ * looks at rates.
+ *
+ * the endpoint listens on a TCP port on 127.0.0.1, or a Unix socket if
+ * --metrics is given a path, and answers any HTTP GET for / or /metrics.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <sys/types.h>
+#ifndef _WIN32
+#	include <sys/stat.h>
+#	include <sys/un.h>
+#	include <arpa/inet.h>
+#	include <pthread.h>
+#endif /* _WIN32 */
+#include "prtunnel.h"
+
+/* where the endpoint listens: a Unix socket path, or else a port */
+static char *metrics_path = NULL;
+static unsigned short metrics_port = 0;
+
+/* each loop's metrics, from prt_metrics_new() */
+static struct prt_metrics *metrics = NULL;
+static unsigned int num_metrics = 0;
+
+static const char *failure_names[PRT_FAILURES] = {
+	"accept", "resolve", "connect", "handshake"
+};
+
+static const char *reject_names[PRT_REJECTS] = {
+	"acl", "limit", "overload"
+};
+
+static const char *latency_names[PRT_LATENCIES] = {
+	"resolve", "connect", "handshake", "first_byte"
+};
+
+static const char *latency_help[PRT_LATENCIES] = {
+	"Time taken to look up the server a tunnel connects to.",
+	"Time taken to connect to the server a tunnel goes through.",
+	"Time taken by the proxy server handshake, once connected.",
+	"Time from accepting a client to the first byte from the remote side."
+};
+
+/* writes n out in decimal to buf (PRT_COUNTER_STRING_MAX bytes) and returns it */
+char *
+prt_counter_string(prt_counter n, char *buf)
+{
+	char tmp[PRT_COUNTER_STRING_MAX];
+	int i = 0, j = 0;
+
+	do {
+		tmp[i++] = '0' + (int)(n % 10);
+		n /= 10;
+	} while(n);
+	while(i > 0)
+		buf[j++] = tmp[--i];
+	buf[j] = '\0';
+
+	return buf;
+}
+
+/*
+ * returns the bucket of a histogram that usecs goes in, or
+ * PRT_HISTOGRAM_BUCKETS if none. a latency equal to a bucket's bound
+ * goes in that bucket, as Prometheus' le buckets include their bound.
+ */
+static unsigned int
+histogram_bucket(unsigned long usecs)
+{
+	unsigned int e = PRT_HISTOGRAM_MIN_SHIFT;
+
+	/* so bucket bounds are inclusive */
+	if(usecs > 0)
+		usecs--;
+
+	if(usecs < (1UL << PRT_HISTOGRAM_MIN_SHIFT))
+		return 0;
+
+	/* find the doubling it's in, then which part of it */
+	while(usecs >> (e + 1))
+		e++;
+	if(e >= PRT_HISTOGRAM_MIN_SHIFT + PRT_HISTOGRAM_OCTAVES)
+		return PRT_HISTOGRAM_BUCKETS;
+
+	return 1 + ((e - PRT_HISTOGRAM_MIN_SHIFT) << PRT_HISTOGRAM_SUB_SHIFT) +
+	       ((usecs >> (e - PRT_HISTOGRAM_SUB_SHIFT)) & ((1 << PRT_HISTOGRAM_SUB_SHIFT) - 1));
+}
+
+/* returns the microseconds that nothing in bucket is over */
+static unsigned long
+histogram_bound(unsigned int bucket)
+{
+	unsigned int e, sub;
+
+	if(bucket == 0)
+		return 1UL << PRT_HISTOGRAM_MIN_SHIFT;
+
+	e = PRT_HISTOGRAM_MIN_SHIFT + ((bucket - 1) >> PRT_HISTOGRAM_SUB_SHIFT);
+	sub = (bucket - 1) & ((1 << PRT_HISTOGRAM_SUB_SHIFT) - 1);
+	return ((1UL << PRT_HISTOGRAM_SUB_SHIFT) + sub + 1) << (e - PRT_HISTOGRAM_SUB_SHIFT);
+}
+
+/* counts a latency of usecs microseconds in histogram */
+void
+prt_histogram_add(struct prt_histogram *histogram, unsigned long usecs)
+{
+	unsigned int bucket = histogram_bucket(usecs);
+
+	if(bucket < PRT_HISTOGRAM_BUCKETS)
+		PRT_COUNTER_ADD(histogram->buckets[bucket], 1);
+	PRT_COUNTER_ADD(histogram->count, 1);
+	PRT_COUNTER_ADD(histogram->sum, usecs);
+}
+
+/*
+ * sets where the metrics endpoint listens: a port on 127.0.0.1, or the
+ * path of a Unix socket. returns 0 on success or -1 if s is neither.
+ */
+int
+set_metrics_endpoint(char *s)
+{
+	int port;
+
+	if(strchr(s, '/')) {
+		metrics_path = s;
+		return 0;
+	}
+
+	port = atoi(s);
+	if(port < 1 || port > 65535)
+		return -1;
+	metrics_port = port;
+	return 0;
+}
+
+/*
+ * returns zeroed metrics for each of count connection loops, which the
+ * endpoint reports on, or NULL on error
+ */
+struct prt_metrics *
+prt_metrics_new(unsigned int count)
+{
+	metrics = calloc(count, sizeof(struct prt_metrics));
+	if(!metrics) {
+		fprintf(stderr, "prt_metrics_new(): Memory allocation failed\n");
+		return NULL;
+	}
+	num_metrics = count;
+
+	return metrics;
+}
+
+#ifndef _WIN32
+static int metrics_fd = -1;
+
+/* a response being put together */
+struct metrics_buffer {
+	char *data;
+	unsigned int len;
+	unsigned int size;
+};
+
+/* adds printf-style output to buf; returns 0 on success or -1 on error */
+static int
+metrics_printf(struct metrics_buffer *buf, const char *format, ...)
+{
+	char line[256];
+	va_list ap;
+	int n;
+
+	va_start(ap, format);
+	n = vsnprintf(line, sizeof(line), format, ap);
+	va_end(ap);
+	if(n < 0 || n >= (int)sizeof(line))
+		return -1;
+
+	if(buf->len + n > buf->size) {
+		unsigned int size = buf->size ? buf->size * 2 : 16384;
+		char *data;
+
+		while(buf->len + n > size)
+			size *= 2;
+		data = realloc(buf->data, size);
+		if(!data)
+			return -1;
+		buf->data = data;
+		buf->size = size;
+	}
+	memcpy(buf->data + buf->len, line, n);
+	buf->len += n;
+
+	return 0;
+}
+
+/* adds a metric with one value and no labels to buf */
+static int
+metrics_single(struct metrics_buffer *buf, const char *name,
+               const char *type, const char *help, prt_counter value)
+{
+	char num[PRT_COUNTER_STRING_MAX];
+
+	return metrics_printf(buf, "# HELP %s %s\n# TYPE %s %s\n%s %s\n", name, help, name, type, name, prt_counter_string(value, num));
+}
+
+/* adds a histogram of latencies to buf, with its times in seconds */
+static int
+metrics_histogram(struct metrics_buffer *buf, const char *name,
+                  const char *help, struct prt_histogram *histogram)
+{
+	char num[PRT_COUNTER_STRING_MAX];
+	prt_counter total = 0;
+	unsigned long bound;
+	unsigned int i;
+
+	if(metrics_printf(buf, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name) == -1)
+		return -1;
+	for(i = 0; i < PRT_HISTOGRAM_BUCKETS; i++) {
+		total += histogram->buckets[i];
+		bound = histogram_bound(i);
+		if(metrics_printf(buf, "%s_bucket{le=\"%lu.%06lu\"} %s\n", name, bound / 1000000, bound % 1000000, prt_counter_string(total, num)) == -1)
+			return -1;
+	}
+	/* the count may have been read before a bucket that has since gone up */
+	if(histogram->count < total)
+		histogram->count = total;
+	if(metrics_printf(buf, "%s_bucket{le=\"+Inf\"} %s\n", name, prt_counter_string(histogram->count, num)) == -1)
+		return -1;
+	if(metrics_printf(buf, "%s_sum %s.", name, prt_counter_string(histogram->sum / 1000000, num)) == -1)
+		return -1;
+	return metrics_printf(buf, "%06lu\n%s_count %s\n", (unsigned long)(histogram->sum % 1000000), name, prt_counter_string(histogram->count, num));
+}
+
+/* puts every loop's metrics together, in Prometheus' text format, in buf */
+static int
+metrics_report(struct metrics_buffer *buf)
+{
+	struct prt_metrics sum;
+	char num[PRT_COUNTER_STRING_MAX];
+	char name[64];
+	unsigned int i, j, k;
+
+	memset(&sum, 0, sizeof(sum));
+	for(i = 0; i < num_metrics; i++) {
+		struct prt_metrics *m = &metrics[i];
+
+		sum.tunnels += PRT_COUNTER_READ(m->tunnels);
+		sum.closed += PRT_COUNTER_READ(m->closed);
+		for(j = 0; j < 2; j++)
+			sum.bytes[j] += PRT_COUNTER_READ(m->bytes[j]);
+		for(j = 0; j < PRT_FAILURES; j++)
+			sum.failures[j] += PRT_COUNTER_READ(m->failures[j]);
+		for(j = 0; j < PRT_REJECTS; j++)
+			sum.rejected[j] += PRT_COUNTER_READ(m->rejected[j]);
+		for(j = 0; j < PRT_LATENCIES; j++) {
+			for(k = 0; k < PRT_HISTOGRAM_BUCKETS; k++)
+				sum.latency[j].buckets[k] += PRT_COUNTER_READ(m->latency[j].buckets[k]);
+			sum.latency[j].count += PRT_COUNTER_READ(m->latency[j].count);
+			sum.latency[j].sum += PRT_COUNTER_READ(m->latency[j].sum);
+		}
+	}
+
+	/* a loop may have closed a tunnel since its count was read */
+	if(metrics_single(buf, "prtunnel_tunnels_active", "gauge", "Tunnels open now.", sum.closed < sum.tunnels ? sum.tunnels - sum.closed : 0) == -1)
+		return -1;
+	if(metrics_single(buf, "prtunnel_tunnels_total", "counter", "Clients accepted.", sum.tunnels) == -1)
+		return -1;
+
+	if(metrics_printf(buf, "# HELP prtunnel_bytes_total Bytes relayed, from clients (up) and to them (down).\n# TYPE prtunnel_bytes_total counter\n") == -1)
+		return -1;
+	if(metrics_printf(buf, "prtunnel_bytes_total{direction=\"up\"} %s\n", prt_counter_string(sum.bytes[1], num)) == -1)
+		return -1;
+	if(metrics_printf(buf, "prtunnel_bytes_total{direction=\"down\"} %s\n", prt_counter_string(sum.bytes[0], num)) == -1)
+		return -1;
+
+	if(metrics_printf(buf, "# HELP prtunnel_failures_total Failed accepts, and attempts at setting tunnels up, by the step that failed.\n# TYPE prtunnel_failures_total counter\n") == -1)
+		return -1;
+	for(i = 0; i < PRT_FAILURES; i++) {
+		if(metrics_printf(buf, "prtunnel_failures_total{step=\"%s\"} %s\n", failure_names[i], prt_counter_string(sum.failures[i], num)) == -1)
+			return -1;
+	}
+
+	if(metrics_printf(buf, "# HELP prtunnel_rejected_total Clients turned away, by reason.\n# TYPE prtunnel_rejected_total counter\n") == -1)
+		return -1;
+	for(i = 0; i < PRT_REJECTS; i++) {
+		if(metrics_printf(buf, "prtunnel_rejected_total{reason=\"%s\"} %s\n", reject_names[i], prt_counter_string(sum.rejected[i], num)) == -1)
+			return -1;
+	}
+
+	for(i = 0; i < PRT_LATENCIES; i++) {
+		snprintf(name, sizeof(name), "prtunnel_%s_seconds", latency_names[i]);
+		if(metrics_histogram(buf, name, latency_help[i], &sum.latency[i]) == -1)
+			return -1;
+	}
+
+	return 0;
+}
+
+/* sends all len bytes of data to fd; returns 0 on success or -1 on error */
+static int
+metrics_send(int fd, const char *data, unsigned int len)
+{
+	int n;
+
+	while(len) {
+		n = send(fd, data, len, 0);
+		if(n == -1 && errno == EINTR)
+			continue;
+		if(n <= 0)
+			return -1;
+		data += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/* reads a request from a client of the endpoint, and answers it */
+static void
+metrics_serve(int fd)
+{
+	struct metrics_buffer buf;
+	struct timeval tv;
+	char request[1024];
+	char header[128];
+	unsigned int len = 0;
+	int n;
+
+	/* a client that doesn't say anything doesn't get to hold things up */
+	tv.tv_sec = 2;
+	tv.tv_usec = 0;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, (void *)&tv, sizeof(tv));
+
+	while(len < sizeof(request) - 1) {
+		n = recv(fd, request + len, sizeof(request) - 1 - len, 0);
+		if(n == -1 && errno == EINTR)
+			continue;
+		if(n <= 0)
+			return;
+		len += n;
+		request[len] = '\0';
+		if(strstr(request, "\r\n\r\n") || strstr(request, "\n\n"))
+			break;
+	}
+	request[len] = '\0';
+
+	if(strncmp(request, "GET / ", 6) != 0 && strncmp(request, "GET /metrics ", 13) != 0 &&
+	   strncmp(request, "GET /metrics?", 13) != 0) {
+		n = snprintf(header, sizeof(header), "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+		metrics_send(fd, header, n);
+		return;
+	}
+
+	buf.data = NULL;
+	buf.len = buf.size = 0;
+	if(metrics_report(&buf) == -1) {
+		n = snprintf(header, sizeof(header), "HTTP/1.0 500 Internal Server Error\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+		metrics_send(fd, header, n);
+	} else {
+		n = snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %u\r\nConnection: close\r\n\r\n", buf.len);
+		if(metrics_send(fd, header, n) == 0)
+			metrics_send(fd, buf.data, buf.len);
+	}
+	free(buf.data);
+}
+
+static void *
+metrics_thread(void *arg)
+{
+	int fd;
+
+	for(;;) {
+		fd = accept(metrics_fd, NULL, NULL);
+		if(fd == -1) {
+			/* out of descriptors, probably; give the tunnels a chance to free some */
+			if(errno != EINTR && errno != ECONNABORTED)
+				sleep(1);
+			continue;
+		}
+		metrics_serve(fd);
+		close(fd);
+	}
+
+	return arg;
+}
+
+/* returns a socket listening where the endpoint should, or -1 on error */
+static int
+metrics_listen()
+{
+	int fd, one = 1;
+
+	if(metrics_path) {
+		struct sockaddr_un sa;
+		struct stat st;
+
+		if(strlen(metrics_path) >= sizeof(sa.sun_path)) {
+			fprintf(stderr, "Error: Metrics socket path %s is too long\n", metrics_path);
+			return -1;
+		}
+		memset(&sa, 0, sizeof(sa));
+		sa.sun_family = AF_UNIX;
+		strcpy(sa.sun_path, metrics_path);
+
+		/* one left behind by an earlier run would be in the way */
+		if(stat(metrics_path, &st) == 0 && S_ISSOCK(st.st_mode))
+			unlink(metrics_path);
+
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if(fd == -1)
+			return -1;
+		if(bind(fd, (struct sockaddr *)&sa, sizeof(sa)) == -1) {
+			fprintf(stderr, "Error: Unable to bind metrics socket %s\n", metrics_path);
+			close(fd);
+			return -1;
+		}
+	} else {
+		struct sockaddr_in sin;
+
+		memset(&sin, 0, sizeof(sin));
+		sin.sin_family = AF_INET;
+		sin.sin_port = htons(metrics_port);
+		sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+		fd = socket(AF_INET, SOCK_STREAM, 0);
+		if(fd == -1)
+			return -1;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (void *)&one, sizeof(one));
+		if(bind(fd, (struct sockaddr *)&sin, sizeof(sin)) == -1) {
+			fprintf(stderr, "Error: Unable to bind metrics port %u\n", metrics_port);
+			close(fd);
+			return -1;
+		}
+	}
+
+	if(listen(fd, 16) == -1) {
+		fprintf(stderr, "Error: Unable to listen to metrics socket\n");
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+#endif /* _WIN32 */
+
+/*
+ * starts serving metrics in the background, if --metrics was given.
+ * returns 0 on success or -1 on error.
+ */
+int
+prt_metrics_start()
+{
+#ifndef _WIN32
+	pthread_t thread;
+
+	if(!metrics_path && !metrics_port)
+		return 0;
+
+	metrics_fd = metrics_listen();
+	if(metrics_fd == -1)
+		return -1;
+	if(pthread_create(&thread, NULL, metrics_thread, NULL) != 0) {
+		fprintf(stderr, "Error: Couldn't start metrics thread\n");
+		close(metrics_fd);
+		metrics_fd = -1;
+		return -1;
+	}
+	pthread_detach(thread);
+#endif /* _WIN32 */
+
+	return 0;
+}
@@ -26,21 +26,33 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <signal.h>
 #include <sys/types.h>
+#ifndef _WIN32
+#	include <pthread.h>
+#endif /* _WIN32 */
 #include "prtunnel.h"
 
-#ifndef NFDBITS
-#define NFDBITS (sizeof(fd_set) * 8)
-#endif
+/* contexts are allocated this many at a time */
+#define PRT_CONTEXT_SLAB_SIZE 64
+
+struct prt_context_slab {
+	struct prt_context_slab *next;
+	struct prt_context contexts[PRT_CONTEXT_SLAB_SIZE];
+};
 
+/*
+ * a loop's live contexts, kept packed at the start of contexts so
+ * adding and removing one takes constant time, along with a pool of
+ * unused contexts
+ */
 struct prt_context_list {
 	struct prt_context **contexts;
 	unsigned int num_contexts;
-};
-
-struct trusted_address {
-	unsigned char address[16];
-	int bitcheck;
+	unsigned int size; /* room in contexts */
+	struct prt_context *free_contexts;
+	struct prt_context_slab *slabs;
 };
 
 struct boundsocket {
@@ -52,7 +64,8 @@ struct boundsocket {
 	unsigned int len;
 };
 
-extern int read_byte(int fd);
+extern int connection_status(int fd);
+extern int set_nonblocking(int fd);
 
 /* protocol-specific functions */
 extern void direct_set_context(struct prt_context *context);
@@ -62,36 +75,215 @@ extern void direct6_set_context(struct prt_context *context);
 extern void http_set_context(struct prt_context *context);
 extern void socks5_set_context(struct prt_context *context);
 
+/* event notification functions */
+extern struct prt_event_set *prt_event_set_new();
+extern void prt_event_set_free(struct prt_event_set *set);
+extern int prt_event_add(struct prt_event_set *set, int fd, int events);
+extern int prt_event_modify(struct prt_event_set *set, int fd, int events);
+extern int prt_event_remove(struct prt_event_set *set, int fd);
+extern int prt_event_wait(struct prt_event_set *set, struct prt_event *events, int max, int timeout);
+extern int prt_event_edge_triggered(struct prt_event_set *set);
+
+/* relay functions */
+extern int prt_relay_init(struct prt_context *context);
+extern void prt_relay_free(struct prt_context *context);
+extern int prt_relay(struct prt_context *context, int fd, int events);
+extern int prt_relay_queue(struct prt_context *context, int outgoing, char *data, int len);
+extern int prt_relay_preload(struct prt_context *context, int outgoing, char *data, int len);
+extern int prt_relay_events(struct prt_context *context, int fd);
+extern int prt_relay_start(struct prt_context *context, struct prt_event_set *set);
+extern int prt_relay_complete(struct prt_context *context, struct prt_event *event);
+
+/* timer functions */
+extern struct prt_timer_wheel *prt_timer_wheel_new();
+extern void prt_timer_wheel_free(struct prt_timer_wheel *wheel);
+extern unsigned long prt_timer_now(struct prt_timer_wheel *wheel);
+extern void prt_timer_init(struct prt_timer *timer, void *arg);
+extern void prt_timer_set(struct prt_timer_wheel *wheel, struct prt_timer *timer, unsigned long when);
+extern void prt_timer_cancel(struct prt_timer_wheel *wheel, struct prt_timer *timer);
+extern int prt_timer_next(struct prt_timer_wheel *wheel);
+extern unsigned long prt_timer_usecs();
+extern struct prt_timer *prt_timer_expired(struct prt_timer_wheel *wheel);
+
+/* resolver functions */
+extern struct prt_resolver *prt_resolver_new();
+extern void prt_resolver_free(struct prt_resolver *resolver);
+extern int prt_resolver_fd(struct prt_resolver *resolver);
+extern struct prt_resolve_request *prt_resolve_start(struct prt_resolver *resolver, const char *hostname, int family, void *arg);
+extern void prt_resolve_cancel(struct prt_resolve_request *request);
+extern struct prt_resolve_request *prt_resolver_done(struct prt_resolver *resolver);
+
+/* upstream functions */
+extern struct prt_upstream *prt_upstream_pick(unsigned long exclude, int *trial);
+extern void prt_upstream_release(struct prt_upstream *up, int trial);
+extern void prt_upstream_sample(struct prt_upstream *up, unsigned long msecs);
+extern void prt_upstream_failed(struct prt_upstream *up, int trial);
+extern unsigned long prt_upstream_hedge_delay();
+extern int prt_upstream_start_checks();
+
+/* access list functions */
+extern int is_trusted_address(int family, const unsigned char *address, struct prt_limit **limit);
+
+/* limit functions */
+extern int prt_limit_admit(struct prt_limit *limit);
+extern void prt_limit_release(struct prt_limit *limit);
+extern int prt_limit_full();
+extern int prt_limit_start(unsigned int count);
+
+/* trace functions */
+extern int prt_trace_wanted();
+extern void prt_trace_setup(struct prt_context *context, const char *client, unsigned short port, int ok);
+
+/* metrics functions */
+extern struct prt_metrics *prt_metrics_new(unsigned int count);
+extern int prt_metrics_start();
+extern void prt_histogram_add(struct prt_histogram *histogram, unsigned long usecs);
+extern char *prt_counter_string(prt_counter n, char *buf);
+
+/* chain functions */
+extern int prt_chain_negotiate(struct prt_context *context);
+
+/* udp functions */
+extern struct prt_udp_association *prt_udp_new(int clientfd);
+extern void prt_udp_free(struct prt_udp_association *udp);
+extern void prt_udp_relay(struct prt_context *context, struct prt_resolver *resolver, int fd, unsigned long now);
+extern void prt_udp_resolved(struct prt_context *context, struct prt_resolve_request *request, unsigned long now);
+
 extern int flags;
 
 unsigned char proxytype = PRT_HTTP;
-char *proxyhost = NULL;
-unsigned short proxyport = 8080;
+unsigned short proxyport = 8080; /* for proxy servers given without a port */
 
-static struct trusted_address *trusted_addresses = NULL;
-static int num_trusted_addresses = 0;
 
 static unsigned long keepalive = 0;
 static char keepalive_type = PRT_KEEPALIVE_CRLF;
 
+static unsigned int num_workers = 1;
+
+/* connections the kernel may queue up for each listening socket */
+static int listen_backlog = 128;
+
+/*
+ * new connections stop being taken once a loop's lag (how long it
+ * spends handling a wakeup's events, in milliseconds) goes over
+ * max_loop_lag, or all the tunnels allowed are open; 0 means lag
+ * doesn't matter. while that's so, they're left waiting in the
+ * listen backlog, or accepted and closed right away if
+ * overload_shed is set.
+ */
+static unsigned int max_loop_lag = 0;
+static int overload_shed = 0;
+
+/* most connections taken from the listen backlog per wakeup */
+#define PRT_ACCEPT_BUDGET 64
+
+/*
+ * milliseconds between looks at whether an overloaded loop can take
+ * connections again
+ */
+#define PRT_ADMISSION_CHECK 100
+
+/*
+ * milliseconds a loop that ran out of descriptors waits before taking
+ * connections again, if no tunnel closing frees some up first
+ */
+#define PRT_FDS_WAIT 1000
+
+/* how long a UDP association may go without datagrams, in seconds */
+static unsigned int udp_timeout = 60;
+
+/*
+ * how long setting a tunnel up through one proxy server may take, in
+ * seconds, before another one is tried instead (if there's another)
+ */
+static unsigned int upstream_timeout = 5;
+
+/* most proxy servers a tunnel tries before giving up */
+#define PRT_UPSTREAM_ATTEMPTS 3
+
+/*
+ * how long, in milliseconds, a connection to one of a host's addresses
+ * gets before the next address is tried alongside it (RFC 8305's
+ * "Connection Attempt Delay")
+ */
+#define PRT_RACE_DELAY 250
+
+/*
+ * takes a context from list's pool, allocating another slab of them
+ * if the pool is empty
+ */
 static struct prt_context *
-prt_context_new(unsigned char type)
+prt_context_new(struct prt_context_list *list, unsigned char type)
 {
 	struct prt_context *context;
 
-	context = malloc(sizeof(struct prt_context));
-	if(!context) {
-		fprintf(stderr, "prt_context_new(): Memory allocation failed\n");
-		return NULL;
+	if(!list->free_contexts) {
+		struct prt_context_slab *slab;
+		unsigned int i;
+
+		slab = malloc(sizeof(struct prt_context_slab));
+		if(!slab) {
+			fprintf(stderr, "prt_context_new(): Memory allocation failed\n");
+			return NULL;
+		}
+		slab->next = list->slabs;
+		list->slabs = slab;
+
+		for(i = PRT_CONTEXT_SLAB_SIZE; i-- > 0;) {
+			slab->contexts[i].next_free = list->free_contexts;
+			list->free_contexts = &slab->contexts[i];
+		}
 	}
 
+	context = list->free_contexts;
+	list->free_contexts = context->next_free;
+
 	context->localfd = -1;
 	context->remotefd = -1;
 	context->sockaddr_len = 0;
 	context->bytes_sent = 0;
 	context->bytes_rcvd = 0;
 	context->data = NULL;
-	context->keepalive_seconds = 0;
+	prt_timer_init(&context->timer, context);
+	context->local_active = 0;
+	context->remote_active = 0;
+	context->keepalive_next = 0;
+	context->localbuf.data = NULL;
+	context->remotebuf.data = NULL;
+	context->state = PRT_STATE_RESOLVING;
+	context->remotehost = NULL;
+	context->remoteport = 0;
+	context->username = NULL;
+	context->password = NULL;
+	context->local_socks = 0;
+	context->connect_started = 0;
+	context->handshake_events = 0;
+	context->resolve_request = NULL;
+	context->udp = NULL;
+	context->upstream = NULL;
+	context->upstream_trial = 0;
+	context->upstream_started = 0;
+	context->upstream_deadline = 0;
+	context->upstreams_tried = 0;
+	context->attempts = 0;
+	context->hop = 0;
+	context->hedge = NULL;
+	context->hedge_at = 0;
+	context->race = NULL;
+	context->limit = NULL;
+	context->completions = NULL;
+	context->worker = 0;
+	context->throttle_wait = 0;
+	context->throttle_at = 0;
+	context->backlogged = 0;
+	context->backlog_prev = NULL;
+	context->backlog_next = NULL;
+	memset(context->trace, 0, sizeof(context->trace));
+	context->step_started = 0;
+	context->remote_connected = 0;
+	context->got_first_byte = 0;
+	context->list_index = 0;
+	context->next_free = NULL;
 
 	switch(type) {
 		default:
@@ -114,37 +306,12 @@ prt_context_new(unsigned char type)
 	return context;
 }
 
-/*
- * resizes a prt_context_list.
- * returns 1 on success or 0 on error.
- */
-static int
-prt_context_list_resize(struct prt_context_list *list, unsigned int size)
+/* returns context to list's pool */
+static void
+prt_context_free(struct prt_context_list *list, struct prt_context *context)
 {
-	unsigned int i;
-	struct prt_context **contexts;
-
-	if(size > 0) {
-		contexts = malloc(sizeof(struct prt_context *) * size);
-		if(!contexts) {
-			fprintf(stderr, "prt_context_list_resize(): Memory allocation failed\n");
-			return 0;
-		}
-
-		for(i = 0; i < list->num_contexts && i < size; i++)
-			contexts[i] = list->contexts[i];
-		for(; i < size; i++)
-			contexts[i] = NULL;
-	} else {
-		contexts = NULL;
-	}
-
-	if(list->contexts)
-		free(list->contexts);
-	list->contexts = contexts;
-	list->num_contexts = size;
-
-	return 1;
+	context->next_free = list->free_contexts;
+	list->free_contexts = context;
 }
 
 /*
@@ -155,46 +322,68 @@ static int
 prt_context_list_add_context(struct prt_context_list *list,
                              struct prt_context *context)
 {
-	unsigned int index = list->num_contexts;
+	if(list->num_contexts == list->size) {
+		unsigned int size = list->size ? list->size * 2 : 64;
+		struct prt_context **contexts;
 
-	if(!prt_context_list_resize(list, list->num_contexts + 1)) {
-		fprintf(stderr, "prt_context_list_add_context(): prt_context_list_resize failed\n");
-		return 0;
+		contexts = realloc(list->contexts, sizeof(struct prt_context *) * size);
+		if(!contexts) {
+			fprintf(stderr, "prt_context_list_add_context(): Memory allocation failed\n");
+			return 0;
+		}
+		list->contexts = contexts;
+		list->size = size;
 	}
 
-	list->contexts[index] = context;
+	context->list_index = list->num_contexts;
+	list->contexts[list->num_contexts++] = context;
 
 	return 1;
 }
 
 /*
- * removes a prt_context from a prt_context_list.
- * index is an index into the prt_context_list's contexts array.
- * note that this does not free the prt_context from memory.
+ * removes a prt_context from a prt_context_list. the last context
+ * in the list takes its place. note that this does not free the
+ * prt_context from memory.
  */
-static int
+static void
 prt_context_list_remove_context(struct prt_context_list *list,
-                                unsigned int index)
+                                struct prt_context *context)
 {
-	unsigned int i;
+	unsigned int index = context->list_index;
 
-	if(index >= list->num_contexts) {
-		fprintf(stderr, "prt_context_list_remove_context(): index is too large (%u >= %u)\n", index, list->num_contexts);
-		return 0;
-	}
+	if(index >= list->num_contexts || list->contexts[index] != context)
+		return;
 
-	for(i = index; i < (list->num_contexts - 1); i++)
-		list->contexts[i] = list->contexts[i+1];
+	list->contexts[index] = list->contexts[--list->num_contexts];
+	list->contexts[index]->list_index = index;
+}
 
-	prt_context_list_resize(list, list->num_contexts - 1);
+/* frees a prt_context_list's table and its pool of contexts */
+static void
+prt_context_list_free(struct prt_context_list *list)
+{
+	struct prt_context_slab *slab;
 
-	return 1;
+	while((slab = list->slabs)) {
+		list->slabs = slab->next;
+		free(slab);
+	}
+	free(list->contexts);
+	list->contexts = NULL;
+	list->num_contexts = 0;
+	list->size = 0;
+	list->free_contexts = NULL;
 }
 
-static char *
-get_address_string(const unsigned char *addr, unsigned char is_ipv6_address)
+/*
+ * writes the printable form of addr to s, which must have room for
+ * ADDRESS_STRING_MAX bytes, and returns s
+ */
+char *
+get_address_string(const unsigned char *addr, unsigned char is_ipv6_address,
+                   char *s)
 {
-	static char s[128];
 	int i;
 
 	s[0] = '\0';
@@ -221,7 +410,7 @@ get_address_string(const unsigned char *addr, unsigned char is_ipv6_address)
 				strcat(s, ":");
 		}
 	} else {
-		snprintf(s, 128, "%u.%u.%u.%u", addr[0], addr[1], addr[2], addr[3]);
+		snprintf(s, ADDRESS_STRING_MAX, "%u.%u.%u.%u", addr[0], addr[1], addr[2], addr[3]);
 	}
 
 	return s;
@@ -254,183 +443,25 @@ set_keepalive_interval(unsigned int interval, char type)
 	keepalive_type = type;
 }
 
-void
-add_trusted_address(char *s)
-{
-	int i;
-	struct hostent *host;
-	int bitcheck = -1;
-	struct trusted_address *tmp;
-
-	if(!s)
-		return;
-
-	for(i = 0; s[i] != '/' && s[i] != '\0'; i++)
-		;
-	if(s[i] == '/') {
-		int j = 0;
-		char tmp[4];
-
-		s[i] = '\0';
-		i++;
-		while(s[i] != '\0' && j < 3)
-			tmp[j++] = s[i++];
-
-		bitcheck = atoi(tmp);
-		if(flags & PRT_IPV6) {
-			if(bitcheck >= 128 || bitcheck < 0) {
-				fprintf(stderr, "Error: Bad bitcheck number (%d) for address %s; must be 0 to 127\n", bitcheck, s);
-				return;
-			}
-		} else if(bitcheck >= 32 || bitcheck < 0) {
-			fprintf(stderr, "Error: Bad bitcheck number (%d) for address %s; must be 0 to 31\n", bitcheck, s);
-			return;
-		}
-	}
-
-#ifdef IPV6
-	if(flags & PRT_IPV6)
-		host = gethostbyname2(s, AF_INET6);
-	else
-#endif /* IPV6 */
-		host = gethostbyname(s);
-	if(!host) {
-		fprintf(stderr, "Error: Unable to resolve hostname %s for trusted addresses\n", s);
-		return;
-	}
-
-	tmp = realloc(trusted_addresses, sizeof(struct trusted_address) * (num_trusted_addresses + 1));
-	if(!tmp) {
-		fprintf(stderr, "Error: Unable to reallocate memory for trusted addresses\n");
-		return;
-	}
-	trusted_addresses = tmp;
-
-	i = num_trusted_addresses;
-	if(flags & PRT_IPV6) {
-		int j;
-
-		for(j = 0; j < 16; j++)
-			trusted_addresses[i].address[j] = host->h_addr[j];
-	} else {
-		int j;
-
-		for(j = 0; j < 4; j++)
-			trusted_addresses[i].address[j] = host->h_addr[j];
-	}
-	trusted_addresses[i].bitcheck = bitcheck;
-
-	num_trusted_addresses++;
-
-	if(flags & PRT_IPV6)
-		fprintf(stderr, "Added trusted address %s", get_address_string((unsigned char *)host->h_addr, 1));
-	else
-		fprintf(stderr, "Added trusted address %s", get_address_string((unsigned char *)host->h_addr, 0));
-	if(bitcheck > -1)
-		fprintf(stderr, ", comparing only the first %u bits", bitcheck);
-	fprintf(stderr, "\n");
-}
-
-/* return 1 if the specified address is trusted; otherwise return 0 */
-static int
-is_trusted_address(const unsigned char *addr)
-{
-	int i, j;
-
-	if(flags & PRT_IPV6) {
-		if(addr[0] == 0 && addr[1] == 0 && addr[2] == 0 && addr[3] == 0 &&
-		   addr[4] == 0 && addr[5] == 0 && addr[6] == 0 && addr[7] == 0 &&
-		   addr[8] == 0 && addr[9] == 0 && addr[10] == 0 && addr[11] == 0 &&
-		   addr[12] == 0 && addr[13] == 0 && addr[14] == 0 && addr[15] == 1)
-			return 1;
-	} else {
-		if(addr[0] == 127 && addr[1] == 0 && addr[2] == 0 && addr[3] == 1)
-			return 1; /* we can trust ourselves, right? right? */
-	}
-
-	for(i = 0; i < num_trusted_addresses; i++) {
-		if(flags & PRT_IPV6) {
-			int n = 0;
-
-			for(j = 0; j < 16 && addr[j] == trusted_addresses[i].address[j]; j++)
-				n++;
-
-			if(n == 16)
-				return 1;
-		} else {
-			if(addr[0] == trusted_addresses[i].address[0] &&
-			   addr[1] == trusted_addresses[i].address[1] &&
-			   addr[2] == trusted_addresses[i].address[2] &&
-			   addr[3] == trusted_addresses[i].address[3])
-				return 1;
-		}
-
-		if(trusted_addresses[i].bitcheck > -1) {
-			int fullbytes, extrabits;
-
-			fullbytes = trusted_addresses[i].bitcheck;
-			extrabits = fullbytes % 8;
-			fullbytes -= extrabits;
-			fullbytes /= 8;
-
-			for(j = 0; j < fullbytes; j++) {
-				if(addr[j] != trusted_addresses[i].address[j])
-					break;
-			}
-			if(j == fullbytes && (addr[j] >> (8 - extrabits)) == (trusted_addresses[i].address[j] >> (8 - extrabits)))
-				return 1;
-		}
-	}
-
-	return 0;
-}
-
 /*
- * if the PRT_VERBOSE bit is set, print s; if the PRT_COLOR bit
- * is set, print s in color for outgoing data
+ * lets several sockets bind to the same address and port, so that each
+ * worker can have its own listening socket; the kernel then spreads
+ * incoming connections across them. returns 0 on success or -1 on error.
  */
-static void
-print_data(char *s, int len, unsigned char outgoing)
+static int
+set_reuseport(int fd)
 {
-	int i;
-
-	if(!(flags & PRT_VERBOSE))
-		return;
-
-	if(flags & PRT_COLOR) {
-		if(outgoing)
-			printf("\033[1;31m");
-		else
-			printf("\033[0;0m");
-
-		for(i = 0; i < len; i++)
-			putchar(s[i]);
-
-		if(outgoing)
-			printf("\033[0;0m");
-	} else {
-		for(i = 0; i < len; i++) {
-			if(i == 0) {
-				if(outgoing)
-					printf(">>> ");
-				else
-					printf("<<< ");
-			}
-			putchar(s[i]);
-			if(s[i] == '\n' && (len - 1) > i) {
-				if(outgoing)
-					printf(">>> ");
-				else
-					printf("<<< ");
-			}
-		}
-	}
+#ifdef SO_REUSEPORT
+	int on = 1;
 
-	fflush(stdout);
+	return setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, (void *)&on, sizeof(on));
+#else
+	return -1;
+#endif /* SO_REUSEPORT */
 }
 
 static struct boundsocket
-tcp_bind_to(unsigned char address[4], unsigned short port)
+tcp_bind_to(unsigned char address[4], unsigned short port, int reuseport)
 {
 	struct boundsocket bs;
 
@@ -438,6 +469,12 @@ tcp_bind_to(unsigned char address[4], unsigned short port)
 	if(bs.fd == -1)
 		return bs;
 
+	if(reuseport && set_reuseport(bs.fd) == -1) {
+		close(bs.fd);
+		bs.fd = -1;
+		return bs;
+	}
+
 	bs.sin.sin_family = AF_INET;
 	bs.sin.sin_port = htons(port);
 	memcpy(&bs.sin.sin_addr, address, 4);
@@ -452,7 +489,6 @@ tcp_bind_to(unsigned char address[4], unsigned short port)
 	return bs;
 }
 
-#if 0
 static struct boundsocket
 udp_bind_to(unsigned char address[4], unsigned short port)
 {
@@ -475,11 +511,10 @@ udp_bind_to(unsigned char address[4], unsigned short port)
 
 	return bs;
 }
-#endif
 
 #ifdef IPV6
 static struct boundsocket
-tcp_bind_to6(unsigned char address[16], unsigned short port)
+tcp_bind_to6(unsigned char address[16], unsigned short port, int reuseport)
 {
 	struct boundsocket bs;
 
@@ -487,6 +522,12 @@ tcp_bind_to6(unsigned char address[16], unsigned short port)
 	if(bs.fd == -1)
 		return bs;
 
+	if(reuseport && set_reuseport(bs.fd) == -1) {
+		close(bs.fd);
+		bs.fd = -1;
+		return bs;
+	}
+
 	bs.sin6.sin6_family = AF_INET6;
 	bs.sin6.sin6_port = htons(port);
 	memcpy(&bs.sin6.sin6_addr, address, 16);
@@ -501,9 +542,8 @@ tcp_bind_to6(unsigned char address[16], unsigned short port)
 	return bs;
 }
 
-#if 0
 static struct boundsocket
-udp_bind_to6(unsigned char address[4], unsigned short port)
+udp_bind_to6(unsigned char address[16], unsigned short port)
 {
 	struct boundsocket bs;
 
@@ -511,10 +551,11 @@ udp_bind_to6(unsigned char address[4], unsigned short port)
 	if(bs.fd == -1)
 		return bs;
 
-	bs.sin6.sin6_family = AF_INET;
+	memset(&bs.sin6, 0, sizeof(bs.sin6));
+	bs.sin6.sin6_family = AF_INET6;
 	bs.sin6.sin6_port = htons(port);
-	memcpy(&bs.sin.sin_addr, address, 4);
-	bs.len = sizeof(bs.sin);
+	memcpy(&bs.sin6.sin6_addr, address, 16);
+	bs.len = sizeof(bs.sin6);
 
 	if((bind(bs.fd, (struct sockaddr *)&bs.sin6, bs.len)) == -1) {
 		close(bs.fd);
@@ -524,147 +565,152 @@ udp_bind_to6(unsigned char address[4], unsigned short port)
 
 	return bs;
 }
-#endif
 #endif /* IPV6 */
 
 /*
- * accept and respond to socks commands from client,
- * return socks version
+ * parses as much of the client's socks request as has been read. it's
+ * read into the buffer that later holds data going to the remote host,
+ * and is parsed again from the start each time more of it comes in.
+ * a socks5 greeting is answered as soon as it's complete. returns 1
+ * once the request is complete, with remotehost and remoteport set
+ * and only data following the request left in the buffer (2 instead
+ * for a socks5 UDP ASSOCIATE), 0 if more has to be read, or -1 if the
+ * client should be dropped.
  *
- * written by ZIGLIO Frediano with minor changes by Josh Beam
- * (same for socks_method_connected function below)
+ * the socks4 and socks5 replies are as ZIGLIO Frediano first wrote them
  */
 static int
-socks_method(struct prt_context *context, char **remotehostp,
-             unsigned short *remoteportp)
+socks_parse_request(struct prt_context *context)
 {
-	int i;
-	int local_socks = 0;
-	char buf[512];
-	int len;
-	char *remotehost = *remotehostp;
-	unsigned short remoteport = *remoteportp;
-
-	/* socks proxy ?? */
-	if (!remotehost) {
-		local_socks = read_byte(context->localfd);
-		switch(local_socks) {
-		default:
-			shutdown(context->localfd, SHUT_RDWR);
-			close(context->localfd);
+	struct prt_buffer *buf = &context->localbuf;
+	unsigned char *p = (unsigned char *)buf->data;
+	char addrstr[ADDRESS_STRING_MAX];
+	char *remotehost;
+	unsigned short remoteport;
+	unsigned int i, n;
+	int ret = 1;
+
+	if(buf->end == 0)
+		return 0;
+
+	if(context->local_socks == 0 && p[0] == 5) {
+		/* greeting: version, number of methods, methods */
+		if(buf->end < 2 || buf->end < 2u + p[1])
+			return 0;
+
+		/* we support only no password */
+		for(i = 0; i < p[1] && p[2 + i] != 0x00; i++)
+			;
+		if(i == p[1]) {
+			context->local_send(context, "\x05\xff", 2);
 			return -1;
-		case 5:
-			len = read_byte(context->localfd);
-			if (len < 0) {
-				shutdown(context->localfd, SHUT_RDWR);
-				close(context->localfd);
-				return -1;
-			}
-			/* discard all methods */
-			for (i=0; i < len; ++i)
-				if (read_byte(context->localfd) < 0) {
-					shutdown(context->localfd, SHUT_RDWR);
-					close(context->localfd);
-					return -1;
-				}
-		
-			/* we support only no password */
-			context->local_send(context, "\x05\x00", 2);
-
-			/* version must be 5 */
-			if ((i=read_byte(context->localfd)) != 5) {
-				context->local_send(context, "\x05\x01\x00\x01\x00\x00\x00\x00\x00\x00", 10);
-				shutdown(context->localfd, SHUT_RDWR);
-				close(context->localfd);
-				return -1;
-			}
-		
-			/* only connect */
-			if (read_byte(context->localfd) != 1) {
-				context->local_send(context, "\x05\x07\x00\x01\x00\x00\x00\x00\x00\x00", 10);
-				shutdown(context->localfd, SHUT_RDWR);
-				close(context->localfd);
-				return -1;
-			}
-			read_byte(context->localfd);
-	
-			switch(read_byte(context->localfd)) {
+		}
+		context->local_send(context, "\x05\x00", 2);
+		context->local_socks = 5;
+
+		/* the request may have come along with it */
+		n = 2 + p[1];
+		buf->end -= n;
+		memmove(buf->data, buf->data + n, buf->end);
+		if(buf->end == 0)
+			return 0;
+	}
+
+	if(context->local_socks == 5) {
+		/* request: version, command, reserved, address type, address, port */
+		if(buf->end < 5)
+			return 0;
+		if(p[0] != 5) {
+			context->local_send(context, "\x05\x01\x00\x01\x00\x00\x00\x00\x00\x00", 10);
+			return -1;
+		}
+		/* only connect and UDP associate */
+		if(p[1] != 1 && p[1] != 3) {
+			context->local_send(context, "\x05\x07\x00\x01\x00\x00\x00\x00\x00\x00", 10);
+			return -1;
+		}
+		switch(p[3]) {
 			case 1: /* ipv4 */
-				for(i = 0; i < 4; ++i)
-					buf[i] = read_byte(context->localfd);
-				remotehost = strdup(get_address_string((unsigned char *)buf, 0));
-				if(!remotehost) {
-					fprintf(stderr, "Error: Memory allocation failed\n");
-					return -1;
-				}
+				n = 4 + 4;
 				break;
 			case 3: /* name */
-				len = read_byte(context->localfd);
-				remotehost = malloc(len+1);
-				if(!remotehost) {
-					fprintf(stderr, "Error: Memory allocation failed\n");
-					return -1;
-				}
-				for(i = 0; i < len; ++i)
-					remotehost[i] = read_byte(context->localfd);
-				remotehost[len] = 0;
+				n = 4 + 1 + p[4];
 				break;
 			case 4: /* ipv6 */
-				for(i = 0; i < 16; ++i)
-					buf[i] = read_byte(context->localfd);
-				remotehost = strdup(get_address_string((unsigned char *)buf, 1));
-				if(!remotehost) {
-					fprintf(stderr, "Error: Memory allocation failed\n");
-					return -1;
-				}
+				n = 4 + 16;
 				break;
 			default:
 				context->local_send(context, "\x05\x08\x00\x01\x00\x00\x00\x00\x00\x00", 10);
-				shutdown(context->localfd, SHUT_RDWR);
-				close(context->localfd);
 				return -1;
-			}
-		
-			/* port */
-			remoteport = read_byte(context->localfd) << 8;
-			remoteport |= read_byte(context->localfd);
-			break;
-
-		case 4:
-			/* only connect */
-			if (read_byte(context->localfd) != 1) {
-				context->local_send(context, "\x00\x5b\x00\x00\x00\x00\x00\x00", 8);
-				shutdown(context->localfd, SHUT_RDWR);
-				close(context->localfd);
-				return -1;
-			}
+		}
+		if(buf->end < n + 2)
+			return 0;
 
-			remoteport = read_byte(context->localfd) << 8;
-			remoteport |= read_byte(context->localfd);
-			
-			for(i = 0; i < 4; ++i)
-				buf[i] = read_byte(context->localfd);
-			remotehost = strdup(get_address_string((unsigned char *)buf, 0));
-			if(!remotehost) {
-				fprintf(stderr, "Error: Memory allocation failed\n");
-				return -1;
+		if(p[3] == 3) {
+			remotehost = malloc(p[4] + 1);
+			if(remotehost) {
+				memcpy(remotehost, p + 5, p[4]);
+				remotehost[p[4]] = '\0';
 			}
-			
-			/* discard user */
-			while (read_byte(context->localfd) != 0);
+		} else {
+			remotehost = strdup(get_address_string(p + 4, p[3] == 4, addrstr));
+		}
+		remoteport = (p[n] << 8) | p[n + 1];
+		n += 2;
+		if(p[1] == 3)
+			ret = 2;
+	} else if(p[0] == 4) {
+		/* version, command, port, address, user id */
+		if(buf->end < 2)
+			return 0;
+		/* only connect */
+		if(p[1] != 1) {
+			context->local_send(context, "\x00\x5b\x00\x00\x00\x00\x00\x00", 8);
+			return -1;
+		}
+		if(buf->end < 9)
+			return 0;
 
-			break;
+		/* discard user */
+		for(n = 8; n < buf->end && p[n]; n++)
+			;
+		if(n == buf->end)
+			return 0;
+		n++;
+
+		if(p[4] == 0 && p[5] == 0 && p[6] == 0 && p[7] != 0) {
+			/* socks4a: the host name follows the user id */
+			for(i = n; i < buf->end && p[i]; i++)
+				;
+			if(i == buf->end)
+				return 0;
+			remotehost = strdup((char *)p + n);
+			n = i + 1;
+		} else {
+			remotehost = strdup(get_address_string(p + 4, 0, addrstr));
 		}
-		
-		fprintf(stderr, "Connect to %s:%d\n", remotehost, remoteport);
+		remoteport = (p[2] << 8) | p[3];
+		context->local_socks = 4;
+	} else {
+		return -1;
+	}
 
-		*remotehostp = remotehost;
-		*remoteportp = remoteport;
+	if(!remotehost) {
+		fprintf(stderr, "Error: Memory allocation failed\n");
+		return -1;
 	}
+	context->remotehost = remotehost;
+	context->remoteport = remoteport;
 
-	return local_socks;
+	buf->end -= n;
+	memmove(buf->data, buf->data + n, buf->end);
+
+	return ret;
 }
 
+/*
+ * written by ZIGLIO Frediano with minor changes by Josh Beam
+ */
 static void
 socks_method_connected(struct prt_context *context, int local_socks)
 {
@@ -679,193 +725,1848 @@ socks_method_connected(struct prt_context *context, int local_socks)
 	}
 }
 
-/*
- * this function checks data from the remote server
- * and responds to IRC PINGs and such if required.
- */
-static void
-check_incoming_data(struct prt_context *context, char *buf, int len)
+/* returns the current time in seconds */
+unsigned long
+current_seconds()
 {
-	int i;
-
-	if((flags & PRT_IRC_AUTOPONG) == 0)
-		return;
-
-	for(i = 0; i < len; i++) {
-		if(i == 0 || buf[i] == '\n') {
-			char *s = buf + ((i == 0) ? -1 : i) + 1;
-
-			if((flags & PRT_IRC_AUTOPONG) && strncmp(s, "PING :", 6) == 0) {
-				int j;
-				char tmp[512];
-				char *servname;
-
-				for(j = i + 1; s[j] != '\n' && j < len - 1; j++)
-					;
-				buf[j] = '\0';
+#ifdef _WIN32
+	return GetTickCount() / 1000;
+#else
+	struct timeval tv;
 
-				servname = buf + 6;
-				snprintf(tmp, 512, "PONG :%s\n", servname);
-				context->remote_send(context, tmp, strlen(tmp));
-			}
-		}
-	}
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec;
+#endif /* _WIN32 */
 }
 
-static unsigned long
-get_seconds()
+/*
+ * accepts a connection on fd. on Linux, the new socket is non-blocking
+ * and closed on exec from the start, which saves a few system calls.
+ */
+static int
+accept_connection(int fd, struct sockaddr *addr, unsigned int *addrlen)
 {
-#ifdef _WIN32
-	static unsigned long last = -1;
-	unsigned long tmp;
-	unsigned long retval;
-
-	tmp = GetTickCount() / 1000;
-	if(tmp < last)
-		last = tmp;
-	retval = tmp - last;
-	last = tmp;
-
-	return retval;
+#ifdef __linux__
+	return accept4(fd, addr, addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
 #else
-	static unsigned long last = -1;
-	struct timeval tv;
-	unsigned long retval;
+	return accept(fd, addr, addrlen);
+#endif /* __linux__ */
+}
 
-	gettimeofday(&tv, NULL);
-	if(last < 0 || tv.tv_sec < last)
-		last = tv.tv_sec;
-	retval = tv.tv_sec - last;
-	last = tv.tv_sec;
+/*
+ * accept_connection(), for a connection that may have been accepted
+ * from fd already (see prt_tcp_handle_connection())
+ */
+static int
+take_connection(int fd, int accepted, struct sockaddr *addr, unsigned int *addrlen)
+{
+	if(accepted == -1)
+		return accept_connection(fd, addr, addrlen);
 
-	return retval;
-#endif /* _WIN32 */
+	if(getpeername(accepted, addr, addrlen) == -1) {
+		close(accepted);
+		errno = ECONNABORTED;
+		return -1;
+	}
+	return accepted;
 }
 
+/*
+ * accepts a connection and works out where it's going; the loop
+ * then looks up the server and connects to it (see prt_loop_resolved()
+ * and prt_loop_negotiate()). if the event set has accepted the
+ * connection already, accepted is its socket; otherwise it's -1, and
+ * *drained is set if there was nothing to accept, or to -1 if there
+ * was no descriptor to accept it with.
+ * what happens is counted in metrics, and the tunnel is marked as
+ * belonging to loop number worker.
+ */
 static struct prt_context *
 prt_tcp_handle_connection(struct boundsocket *bsocket,
                           struct prt_context_list *context_list,
                           char *remotehost, unsigned short remoteport,
-                          char *username, char *password, int server_timeout)
+                          char *username, char *password,
+                          struct prt_metrics *metrics, unsigned int worker,
+                          int accepted, int *drained)
 {
 	unsigned char *addr;
 	unsigned short port;
-	int local_socks = 0;
+	char addrstr[ADDRESS_STRING_MAX];
+	struct prt_limit *limit;
 
-	struct prt_context *context = prt_context_new(proxytype);
+	struct prt_context *context = prt_context_new(context_list, proxytype);
 	if(!context) {
 		fprintf(stderr, "Error: Couldn't create new prt_context\n");
 		return NULL;
 	}
 
+	context->trace[PRT_TRACE_ACCEPT] = prt_timer_usecs();
 #ifdef IPV6
 	if(flags & PRT_IPV6) {
 		context->sockaddr_len = sizeof(context->sin6);
-		context->localfd = accept(bsocket->fd, (struct sockaddr *)&(context->sin6), &(context->sockaddr_len));
+		context->localfd = take_connection(bsocket->fd, accepted, (struct sockaddr *)&(context->sin6), &(context->sockaddr_len));
 
 		get_ipv6_addr_and_port(&context->sin6, &addr, &port);
 	} else
 #endif /* IPV6 */
 	{
 		context->sockaddr_len = sizeof(context->sin);
-		context->localfd = accept(bsocket->fd, (struct sockaddr *)&(context->sin), &(context->sockaddr_len));
+		context->localfd = take_connection(bsocket->fd, accepted, (struct sockaddr *)&(context->sin), &(context->sockaddr_len));
 
 		get_ipv4_addr_and_port(&context->sin, &addr, &port);
 	}
 
 	/* handle connection */
 	if(context->localfd == -1) {
-		free(context);
+		/* nothing left to take for now, or no room to take it */
+		*drained = (errno == EMFILE || errno == ENFILE) ? -1 : 1;
+		if(errno != EAGAIN && errno != EWOULDBLOCK)
+			PRT_COUNTER_ADD(metrics->failures[PRT_FAILURE_ACCEPT], 1);
+		prt_context_free(context_list, context);
 		return NULL;
 	}
+	context->trace[PRT_TRACE_ACCEPTED] = prt_timer_usecs();
 
-	if(!is_trusted_address(addr)) {
-		fprintf(stderr, "Connection attempt from non-trusted address %s (port %u). Closing it.\n", get_address_string(addr, (flags & PRT_IPV6) != 0), port);
+	if(!is_trusted_address((flags & PRT_IPV6) ? AF_INET6 : AF_INET, addr, &limit)) {
+		fprintf(stderr, "Connection attempt from non-trusted address %s (port %u). Closing it.\n", get_address_string(addr, (flags & PRT_IPV6) != 0, addrstr), port);
+		PRT_COUNTER_ADD(metrics->rejected[PRT_REJECT_ACL], 1);
 		close(context->localfd);
-		free(context);
+		prt_context_free(context_list, context);
 		return NULL;
 	}
+	if(!prt_limit_admit(limit)) {
+		fprintf(stderr, "Connection from %s (port %u) is over its limits. Closing it.\n", get_address_string(addr, (flags & PRT_IPV6) != 0, addrstr), port);
+		PRT_COUNTER_ADD(metrics->rejected[PRT_REJECT_LIMIT], 1);
+		close(context->localfd);
+		prt_context_free(context_list, context);
+		return NULL;
+	}
+	context->limit = limit;
+	context->worker = worker;
+	context->trace[PRT_TRACE_ADMITTED] = prt_timer_usecs();
+
+	fprintf(stderr, "Connection from %s (port %u) accepted\n", get_address_string(addr, (flags & PRT_IPV6) != 0, addrstr), port);
+
+	/*
+	 * without a predefined remotehost, the client tells us where to
+	 * go with a socks request (see prt_loop_socks())
+	 */
+	if(remotehost) {
+		remotehost = strdup(remotehost);
+		if(!remotehost) {
+			fprintf(stderr, "Error: Memory allocation failed\n");
+			close(context->localfd);
+			prt_limit_release(context->limit);
+			prt_context_free(context_list, context);
+			return NULL;
+		}
+	}
+
+	/* the context keeps what negotiate needs to know */
+	context->remotehost = remotehost;
+	context->remoteport = remoteport;
+	context->username = username;
+	context->password = password;
+
+	if(!prt_context_list_add_context(context_list, context)) {
+		close(context->localfd);
+		prt_limit_release(context->limit);
+		free(context->remotehost);
+		prt_context_free(context_list, context);
+		return NULL;
+	}
+
+	PRT_COUNTER_ADD(metrics->tunnels, 1);
+	return context;
+}
+
+/* number of events fetched from the event set per wakeup */
+#define PRT_MAX_EVENTS 64
+
+/*
+ * state shared by the functions that drive a connection loop;
+ * each worker thread has its own
+ */
+struct prt_loop {
+	struct boundsocket bsocket;
+	struct prt_context_list context_list;
+	struct prt_event_set *events;
+	struct prt_context **fd_contexts; /* contexts indexed by fd */
+	unsigned int num_fd_contexts;
+	struct prt_resolver *resolver;
+	struct prt_timer_wheel *timers;
+	unsigned long now; /* wheel time when the loop last woke up */
+	unsigned long lag; /* eighths of a millisecond spent per wakeup, smoothed */
+	unsigned int index; /* its position among the workers */
+	struct prt_metrics *metrics; /* this loop's own (see metrics.c) */
+	int accepting; /* whether the listening socket is being watched */
+	unsigned long fds_wait; /* when to try accepting again after running out of descriptors (wheel time); 0 if it hasn't */
+
+	/* tunnels waiting for another turn, in the order they'll get it */
+	struct prt_context *backlog;
+	struct prt_context *backlog_tail;
+
+	/* tunnel settings given to prt_proxy() */
+	char *remotehost;
+	unsigned short remoteport;
+	char *username;
+	char *password;
+	int timeout;
+	int server_timeout;
+
+#ifndef _WIN32
+	pthread_t thread;
+#endif /* _WIN32 */
+	int retval;
+};
+
+/*
+ * returns the events worth waiting for on fd, one of context's
+ * sockets, with a set that isn't edge-triggered
+ */
+static int
+prt_loop_wanted_events(struct prt_context *context, int fd)
+{
+	if(context->state == PRT_STATE_RELAY)
+		return prt_relay_events(context, fd);
+	if(context->state == PRT_STATE_SOCKS || context->state == PRT_STATE_UDP)
+		return PRT_EVENT_READ;
+
+	/* the client has to wait until the tunnel is set up */
+	if(context->race && fd != context->localfd)
+		return PRT_EVENT_WRITE;
+	if(context->hedge && fd == context->hedge->fd)
+		return context->hedge->handshake_events;
+	return (fd == context->remotefd) ? context->handshake_events : 0;
+}
+
+/*
+ * sets context's timer for the earliest of its deadlines. data coming
+ * in only moves deadlines later, so the timer isn't touched then;
+ * if it goes off early, prt_loop_timeout() just sets it again.
+ */
+static void
+prt_loop_schedule(struct prt_loop *loop, struct prt_context *context)
+{
+	unsigned long when = 0, deadline;
+	int found = 0;
+
+	if(context->state == PRT_STATE_SOCKS) {
+		if(loop->timeout) {
+			when = context->connect_started + loop->timeout * 1000;
+			found = 1;
+		}
+	} else if(context->state == PRT_STATE_UDP) {
+		if(udp_timeout) {
+			when = context->udp->last_active + udp_timeout * 1000;
+			found = 1;
+		}
+	} else if(context->state != PRT_STATE_RELAY) {
+		if(loop->server_timeout) {
+			when = context->connect_started + loop->server_timeout * 1000;
+			found = 1;
+		}
+		if(context->upstream_deadline) {
+			if(!found || context->upstream_deadline < when)
+				when = context->upstream_deadline;
+			found = 1;
+		}
+		if(context->hedge_at) {
+			if(!found || context->hedge_at < when)
+				when = context->hedge_at;
+			found = 1;
+		}
+		if(context->race && context->race->next < context->race->num_addresses) {
+			if(!found || context->race->next_attempt < when)
+				when = context->race->next_attempt;
+			found = 1;
+		}
+	} else {
+		if(loop->timeout) {
+			when = context->local_active + loop->timeout * 1000;
+			found = 1;
+		}
+		if(loop->server_timeout) {
+			deadline = context->remote_active + loop->server_timeout * 1000;
+			if(!found || deadline < when)
+				when = deadline;
+			found = 1;
+		}
+		if(keepalive) {
+			if(!found || context->keepalive_next < when)
+				when = context->keepalive_next;
+			found = 1;
+		}
+		if(context->throttle_at) {
+			if(!found || context->throttle_at < when)
+				when = context->throttle_at;
+			found = 1;
+		}
+	}
+
+	if(found)
+		prt_timer_set(loop->timers, &context->timer, when);
+	else
+		prt_timer_cancel(loop->timers, &context->timer);
+}
+
+/*
+ * makes sure the loop's fd table has room for fd. returns 1 on
+ * success or 0 on error.
+ */
+static int
+prt_loop_reserve_fd(struct prt_loop *loop, int fd)
+{
+	unsigned int i, size;
+	struct prt_context **tmp;
+
+	if((unsigned int)fd < loop->num_fd_contexts)
+		return 1;
+
+	size = loop->num_fd_contexts ? loop->num_fd_contexts : 64;
+	while(size <= (unsigned int)fd)
+		size *= 2;
+	tmp = realloc(loop->fd_contexts, sizeof(struct prt_context *) * size);
+	if(!tmp) {
+		fprintf(stderr, "prt_loop_reserve_fd(): Memory allocation failed\n");
+		return 0;
+	}
+	for(i = loop->num_fd_contexts; i < size; i++)
+		tmp[i] = NULL;
+	loop->fd_contexts = tmp;
+	loop->num_fd_contexts = size;
+
+	return 1;
+}
+
+/*
+ * records fd, one of context's sockets, in the loop's fd table and
+ * starts watching it. *events is set to what it's watched for.
+ * returns 1 on success or 0 on error.
+ */
+static int
+prt_loop_watch_fd(struct prt_loop *loop, struct prt_context *context,
+                  int fd, int *events)
+{
+	if(!prt_loop_reserve_fd(loop, fd))
+		return 0;
+
+	/*
+	 * edge-triggered sets can watch for everything up front; with
+	 * anything else we only wait for what the context can use
+	 */
+	if(prt_event_edge_triggered(loop->events))
+		*events = PRT_EVENT_READ | PRT_EVENT_WRITE;
+	else
+		*events = prt_loop_wanted_events(context, fd);
+
+	if(prt_event_add(loop->events, fd, *events) == -1) {
+		fprintf(stderr, "prt_loop_watch_fd(): Unable to watch socket\n");
+		return 0;
+	}
+	loop->fd_contexts[fd] = context;
+
+	return 1;
+}
+
+/*
+ * picks the proxy server context's tunnel goes through, if it goes
+ * through one, and starts looking up the server it has to connect to.
+ * returns 1 on success or 0 on error.
+ */
+static int
+prt_loop_resolve(struct prt_loop *loop, struct prt_context *context)
+{
+	char *server;
+	int family;
+
+	if((proxytype == PRT_HTTP || proxytype == PRT_SOCKS5) && !context->upstream)
+		context->upstream = prt_upstream_pick(0, &context->upstream_trial);
+
+	server = context->get_server(context, &family);
+	if(!server)
+		return 0;
+	context->step_started = prt_timer_usecs();
+	context->resolve_request = prt_resolve_start(loop->resolver, server, family, context);
+	if(!context->resolve_request)
+		return 0;
+
+	return 1;
+}
+
+/*
+ * starts watching a newly accepted context's client socket, and either
+ * looking up the server it has to connect to or, if the client has to
+ * tell us where it's going, reading its socks request.
+ * returns 1 on success or 0 on error.
+ */
+static int
+prt_loop_watch_context(struct prt_loop *loop, struct prt_context *context)
+{
+	context->state = context->remotehost ? PRT_STATE_RESOLVING : PRT_STATE_SOCKS;
+	context->connect_started = prt_timer_now(loop->timers);
+	prt_loop_schedule(loop, context);
+
+	if(!prt_relay_init(context))
+		return 0;
+	if(!prt_loop_watch_fd(loop, context, context->localfd, &context->localevents))
+		return 0;
+
+	if(context->state == PRT_STATE_SOCKS)
+		return 1;
+	return prt_loop_resolve(loop, context);
+}
+
+/*
+ * brings the events context's sockets are watched for up to date
+ * with its state and that of its relay buffers
+ */
+static void
+prt_loop_update_events(struct prt_loop *loop, struct prt_context *context)
+{
+	int events;
+
+	if(prt_event_edge_triggered(loop->events))
+		return;
+
+	events = prt_loop_wanted_events(context, context->localfd);
+	if(events != context->localevents) {
+		prt_event_modify(loop->events, context->localfd, events);
+		context->localevents = events;
+	}
+
+	if(context->remotefd == -1)
+		return;
+	events = prt_loop_wanted_events(context, context->remotefd);
+	if(events != context->remoteevents) {
+		prt_event_modify(loop->events, context->remotefd, events);
+		context->remoteevents = events;
+	}
+}
+
+/* stops watching the sockets of a UDP association */
+static void
+prt_loop_unwatch_udp(struct prt_loop *loop, struct prt_udp_association *udp)
+{
+	int fds[3];
+	int i;
+
+	fds[0] = udp->clientfd;
+	fds[1] = udp->remotefd;
+	fds[2] = udp->remotefd6;
+	for(i = 0; i < 3; i++) {
+		if(fds[i] == -1 || (unsigned int)fds[i] >= loop->num_fd_contexts ||
+		   !loop->fd_contexts[fds[i]])
+			continue;
+		prt_event_remove(loop->events, fds[i]);
+		loop->fd_contexts[fds[i]] = NULL;
+	}
+}
+
+/* drops whatever context has of the connection it was setting up */
+static void
+prt_loop_drop_remote(struct prt_loop *loop, struct prt_context *context)
+{
+	if(context->resolve_request) {
+		prt_resolve_cancel(context->resolve_request);
+		context->resolve_request = NULL;
+	}
+	if(context->remotefd != -1) {
+		prt_event_remove(loop->events, context->remotefd);
+		if((unsigned int)context->remotefd < loop->num_fd_contexts)
+			loop->fd_contexts[context->remotefd] = NULL;
+		close(context->remotefd);
+		context->remotefd = -1;
+	}
+	free(context->data);
+	context->data = NULL;
+	context->hop = 0;
+	context->remote_connected = 0;
+}
+
+/*
+ * trades the attempt at setting context's tunnel up that it's working
+ * on for its hedge, so the same code can work on either
+ */
+static void
+prt_loop_swap_hedge(struct prt_context *context)
+{
+	struct prt_hedge *hedge = context->hedge;
+	struct prt_hedge tmp;
+
+	tmp = *hedge;
+	hedge->fd = context->remotefd;
+	hedge->data = context->data;
+	hedge->upstream = context->upstream;
+	hedge->trial = context->upstream_trial;
+	hedge->started = context->upstream_started;
+	hedge->events = context->remoteevents;
+	hedge->handshake_events = context->handshake_events;
+	hedge->resolve_request = context->resolve_request;
+	hedge->hop = context->hop;
+	hedge->remote_connected = context->remote_connected;
+	hedge->step_started = context->step_started;
+	context->remotefd = tmp.fd;
+	context->data = tmp.data;
+	context->upstream = tmp.upstream;
+	context->upstream_trial = tmp.trial;
+	context->upstream_started = tmp.started;
+	context->remoteevents = tmp.events;
+	context->handshake_events = tmp.handshake_events;
+	context->resolve_request = tmp.resolve_request;
+	context->hop = tmp.hop;
+	context->remote_connected = tmp.remote_connected;
+	context->step_started = tmp.step_started;
+}
+
+/* gives up on context's hedge */
+static void
+prt_loop_drop_hedge(struct prt_loop *loop, struct prt_context *context)
+{
+	struct prt_upstream *up = context->hedge->upstream;
+	int trial = context->hedge->trial;
+
+	prt_loop_swap_hedge(context);
+	prt_loop_drop_remote(loop, context);
+	prt_loop_swap_hedge(context);
+	prt_upstream_release(up, trial);
+	free(context->hedge);
+	context->hedge = NULL;
+}
+
+/* puts context at the back of the loop's backlog */
+static void
+prt_loop_backlog_add(struct prt_loop *loop, struct prt_context *context)
+{
+	context->backlogged = 1;
+	context->backlog_next = NULL;
+	context->backlog_prev = loop->backlog_tail;
+	if(loop->backlog_tail)
+		loop->backlog_tail->backlog_next = context;
+	else
+		loop->backlog = context;
+	loop->backlog_tail = context;
+}
+
+static void
+prt_loop_backlog_remove(struct prt_loop *loop, struct prt_context *context)
+{
+	if(context->backlog_prev)
+		context->backlog_prev->backlog_next = context->backlog_next;
+	else
+		loop->backlog = context->backlog_next;
+	if(context->backlog_next)
+		context->backlog_next->backlog_prev = context->backlog_prev;
+	else
+		loop->backlog_tail = context->backlog_prev;
+	context->backlogged = 0;
+	context->backlog_prev = context->backlog_next = NULL;
+}
+
+/* ends context's race, closing the connections still left in it */
+static void
+prt_loop_end_race(struct prt_loop *loop, struct prt_context *context)
+{
+	struct prt_race *race = context->race;
+	unsigned int i;
+
+	for(i = 0; i < race->num_addresses; i++) {
+		if(race->fds[i] == -1)
+			continue;
+		prt_event_remove(loop->events, race->fds[i]);
+		if((unsigned int)race->fds[i] < loop->num_fd_contexts)
+			loop->fd_contexts[race->fds[i]] = NULL;
+		close(race->fds[i]);
+	}
+	free(race);
+	context->race = NULL;
+}
+
+/*
+ * writes out the trace of setting context's tunnel up (see trace.c);
+ * ok is nonzero if it was set up
+ */
+static void
+prt_loop_trace(struct prt_context *context, int ok)
+{
+	unsigned char *addr;
+	unsigned short port;
+	char addrstr[ADDRESS_STRING_MAX];
+
+	if(!prt_trace_wanted())
+		return;
+
+#ifdef IPV6
+	if(flags & PRT_IPV6)
+		get_ipv6_addr_and_port(&context->sin6, &addr, &port);
+	else
+#endif /* IPV6 */
+		get_ipv4_addr_and_port(&context->sin, &addr, &port);
+	prt_trace_setup(context, get_address_string(addr, (flags & PRT_IPV6) != 0, addrstr), port, ok);
+}
+
+/* removes context from the loop, closes its sockets and frees it */
+static void
+prt_loop_close_context(struct prt_loop *loop, struct prt_context *context)
+{
+	unsigned char *addr;
+	unsigned short port;
+	char addrstr[ADDRESS_STRING_MAX];
+	char sent[PRT_COUNTER_STRING_MAX], rcvd[PRT_COUNTER_STRING_MAX];
+
+	PRT_COUNTER_ADD(loop->metrics->closed, 1);
+	if(loop->fds_wait)
+		loop->fds_wait = loop->now; /* its descriptors are free now */
+	if(context->state != PRT_STATE_RELAY && context->state != PRT_STATE_UDP)
+		prt_loop_trace(context, 0);
+	prt_context_list_remove_context(&loop->context_list, context);
+	prt_timer_cancel(loop->timers, &context->timer);
+	if(context->resolve_request)
+		prt_resolve_cancel(context->resolve_request);
+	if(context->hedge)
+		prt_loop_drop_hedge(loop, context);
+	if(context->race)
+		prt_loop_end_race(loop, context);
+	if(context->backlogged)
+		prt_loop_backlog_remove(loop, context);
+
+	prt_event_remove(loop->events, context->localfd);
+	if((unsigned int)context->localfd < loop->num_fd_contexts)
+		loop->fd_contexts[context->localfd] = NULL;
+	if(context->remotefd != -1) {
+		prt_event_remove(loop->events, context->remotefd);
+		if((unsigned int)context->remotefd < loop->num_fd_contexts)
+			loop->fd_contexts[context->remotefd] = NULL;
+	}
+	if(context->udp) {
+		prt_loop_unwatch_udp(loop, context->udp);
+		prt_udp_free(context->udp);
+		context->udp = NULL;
+	}
+	if(context->upstream)
+		prt_upstream_release(context->upstream, context->upstream_trial);
+	prt_limit_release(context->limit);
+
+	context->disconnect(context);
+	prt_relay_free(context);
+#ifdef IPV6
+	if(flags & PRT_IPV6)
+		get_ipv6_addr_and_port(&context->sin6, &addr, &port);
+	else
+#endif /* IPV6 */
+		get_ipv4_addr_and_port(&context->sin, &addr, &port);
+	fprintf(stderr, "Connection from %s (port %u) closed - %s bytes sent, %s bytes received\n", get_address_string(addr, (flags & PRT_IPV6) != 0, addrstr), port, prt_counter_string(context->bytes_sent, sent), prt_counter_string(context->bytes_rcvd, rcvd));
+	free(context->remotehost);
+	prt_context_free(&loop->context_list, context);
+}
+
+/*
+ * counts the step of setting context's tunnel up that finished at now
+ * (see prt_timer_usecs()) in the loop's histogram for latency, and
+ * starts timing the next one
+ */
+static void
+prt_loop_step_done(struct prt_loop *loop, struct prt_context *context,
+                   int latency, unsigned long now)
+{
+	static const int marks[PRT_LATENCIES] = {
+		PRT_TRACE_RESOLVED, PRT_TRACE_CONNECTED, PRT_TRACE_ESTABLISHED, -1
+	};
+
+	prt_histogram_add(&loop->metrics->latency[latency], now - context->step_started);
+	context->step_started = now;
+	if(marks[latency] != -1)
+		context->trace[marks[latency]] = now;
+}
+
+/* counts a failed attempt at setting context's tunnel up, by how far it got */
+static void
+prt_loop_count_failure(struct prt_loop *loop, struct prt_context *context)
+{
+	if(context->state == PRT_STATE_RESOLVING)
+		PRT_COUNTER_ADD(loop->metrics->failures[PRT_FAILURE_RESOLVE], 1);
+	else if(!context->remote_connected)
+		PRT_COUNTER_ADD(loop->metrics->failures[PRT_FAILURE_CONNECT], 1);
+	else
+		PRT_COUNTER_ADD(loop->metrics->failures[PRT_FAILURE_HANDSHAKE], 1);
+}
+
+/* counts what was relayed for context since it had sent and rcvd bytes */
+static void
+prt_loop_count_bytes(struct prt_loop *loop, struct prt_context *context,
+                     prt_counter sent, prt_counter rcvd)
+{
+	PRT_COUNTER_ADD(loop->metrics->bytes[1], context->bytes_sent - sent);
+	PRT_COUNTER_ADD(loop->metrics->bytes[0], context->bytes_rcvd - rcvd);
+}
+
+/*
+ * picks another proxy server for context's tunnel to try, if it can
+ * try another, setting *trial as prt_upstream_pick() does; returns
+ * NULL if it can't
+ */
+static struct prt_upstream *
+prt_loop_next_upstream(struct prt_context *context, int *trial)
+{
+	if(!context->upstream || context->attempts + 1 >= PRT_UPSTREAM_ATTEMPTS)
+		return NULL;
+
+	return prt_upstream_pick(context->upstreams_tried | (1UL << context->upstream->index), trial);
+}
+
+/*
+ * the proxy server context's tunnel is going through couldn't set it
+ * up; if the tunnel was trying the server, it's no longer
+ */
+static void
+prt_loop_upstream_failed(struct prt_context *context)
+{
+	prt_upstream_failed(context->upstream, context->upstream_trial);
+	context->upstream_trial = 0;
+}
+
+/* the hedge couldn't be set up; refused is as for prt_loop_setup_failed() */
+static void
+prt_loop_hedge_failed(struct prt_loop *loop, struct prt_context *context,
+                      int refused)
+{
+	if(!refused && !context->hedge->hop) {
+		prt_upstream_failed(context->hedge->upstream, context->hedge->trial);
+		context->hedge->trial = 0;
+	}
+	context->upstreams_tried |= 1UL << context->hedge->upstream->index;
+	prt_loop_drop_hedge(loop, context);
+}
+
+/*
+ * gives up on the attempt context was working on in favour of its
+ * hedge, which it carries on with instead
+ */
+static void
+prt_loop_promote_hedge(struct prt_loop *loop, struct prt_context *context)
+{
+	prt_loop_swap_hedge(context);
+	prt_loop_drop_hedge(loop, context);
+	context->state = (context->remotefd == -1) ? PRT_STATE_RESOLVING : PRT_STATE_CONNECTING;
+	context->upstream_deadline = 0;
+	context->hedge_at = 0;
+	prt_loop_schedule(loop, context);
+}
+
+/*
+ * starts a hedge for context: another attempt at setting its tunnel
+ * up, through another proxy server, alongside the one that's slow
+ */
+static void
+prt_loop_start_hedge(struct prt_loop *loop, struct prt_context *context)
+{
+	struct prt_upstream *up;
+	struct prt_hedge *hedge;
+	int ok, trial;
+
+	up = prt_loop_next_upstream(context, &trial);
+	if(!up)
+		return;
+
+	hedge = malloc(sizeof(struct prt_hedge));
+	if(!hedge) {
+		fprintf(stderr, "prt_loop_start_hedge(): Memory allocation failed\n");
+		prt_upstream_release(up, trial);
+		return;
+	}
+	hedge->fd = -1;
+	hedge->data = NULL;
+	hedge->upstream = up;
+	hedge->trial = trial;
+	hedge->started = loop->now;
+	hedge->events = 0;
+	hedge->handshake_events = 0;
+	hedge->resolve_request = NULL;
+	hedge->hop = 0;
+	hedge->remote_connected = 0;
+	hedge->step_started = 0;
+	context->hedge = hedge;
+	context->attempts++;
+	fprintf(stderr, "Also trying proxy server %s:%u\n", up->host, up->port);
+
+	prt_loop_swap_hedge(context);
+	ok = prt_loop_resolve(loop, context);
+	prt_loop_swap_hedge(context);
+	if(!ok)
+		prt_loop_hedge_failed(loop, context, 0);
+}
+
+/* the hedge's proxy server has been looked up; start connecting to it */
+static void
+prt_loop_hedge_resolved(struct prt_loop *loop, struct prt_context *context,
+                        struct prt_resolve_request *request)
+{
+	int ok = 0;
+
+	prt_loop_swap_hedge(context);
+	context->resolve_request = NULL;
+	if(request->status == -1) {
+		fprintf(stderr, "Error: Unable to resolve hostname %s\n", request->hostname);
+	} else {
+		prt_loop_step_done(loop, context, PRT_LATENCY_RESOLVE, prt_timer_usecs());
+		context->upstream_started = loop->now;
+		context->remotefd = context->connect(context, request->family, request->address);
+		context->handshake_events = PRT_EVENT_WRITE; /* wait for connect() */
+		if(context->remotefd != -1) {
+			ok = prt_loop_watch_fd(loop, context, context->remotefd, &context->remoteevents);
+			if(!ok) {
+				close(context->remotefd);
+				context->remotefd = -1;
+			}
+		}
+	}
+	prt_loop_swap_hedge(context);
+	free(request);
+
+	if(!ok)
+		prt_loop_hedge_failed(loop, context, 0);
+}
+
+/*
+ * gives up on the proxy server context's tunnel is going through, and
+ * starts setting it up through up instead, without the client knowing;
+ * trial is as set by prt_loop_next_upstream(). returns 1 on success or
+ * 0 on error.
+ */
+static int
+prt_loop_switch_upstream(struct prt_loop *loop, struct prt_context *context,
+                         struct prt_upstream *up, int trial)
+{
+	prt_loop_drop_remote(loop, context);
+	context->trace[PRT_TRACE_RESOLVED] = context->trace[PRT_TRACE_CONNECTED] = 0;
+
+	context->upstreams_tried |= 1UL << context->upstream->index;
+	context->attempts++;
+	prt_upstream_release(context->upstream, context->upstream_trial);
+	context->upstream = up;
+	context->upstream_trial = trial;
+	context->upstream_deadline = 0;
+	fprintf(stderr, "Trying proxy server %s:%u instead\n", up->host, up->port);
+
+	context->state = PRT_STATE_RESOLVING;
+	prt_loop_schedule(loop, context);
+	return prt_loop_resolve(loop, context);
+}
+
+/*
+ * setting context's tunnel up failed; refused is nonzero if the proxy
+ * server turned it down, which isn't the server's fault. unless that's
+ * the case, the tunnel is tried through another proxy server if there
+ * is one, and otherwise the client is let go.
+ */
+static void
+prt_loop_setup_failed(struct prt_loop *loop, struct prt_context *context,
+                      int refused)
+{
+	struct prt_upstream *up;
+	int trial;
+
+	prt_loop_count_failure(loop, context);
+
+	/*
+	 * past the first hop of a --chain, the first proxy server has
+	 * done its part, and trying another instead wouldn't help
+	 */
+	if(context->hop)
+		refused = 1;
+
+	/* turning a tunnel down still shows the proxy server is working */
+	if(context->upstream && refused) {
+		prt_upstream_sample(context->upstream, loop->now - context->upstream_started);
+		context->upstream_trial = 0;
+	}
+
+	if(context->upstream && !refused) {
+		prt_loop_upstream_failed(context);
+
+		/* if there's a hedge, it's all that's left to try */
+		if(context->hedge) {
+			context->upstreams_tried |= 1UL << context->upstream->index;
+			prt_loop_promote_hedge(loop, context);
+			return;
+		}
+
+		up = prt_loop_next_upstream(context, &trial);
+		if(up) {
+			if(!prt_loop_switch_upstream(loop, context, up, trial))
+				prt_loop_close_context(loop, context);
+			return;
+		}
+	}
+
+	fprintf(stderr, "Error: Unable to connect to remote host %s (port %u)\n", context->remotehost, context->remoteport);
+	prt_loop_close_context(loop, context);
+}
+
+/*
+ * starts a connection to the next address in context's race that can
+ * be connected to. returns 1 if one was started, or 0 if there are no
+ * addresses left.
+ */
+static int
+prt_loop_race_attempt(struct prt_loop *loop, struct prt_context *context)
+{
+	struct prt_race *race = context->race;
+	struct prt_address *a;
+	unsigned int i;
+	int fd;
+
+	while(race->next < race->num_addresses) {
+		i = race->next++;
+		a = &race->addresses[i];
+		fd = context->connect(context, a->family, a->address);
+		if(fd == -1)
+			continue;
+		if(!prt_loop_watch_fd(loop, context, fd, &race->events[i])) {
+			close(fd);
+			continue;
+		}
+		race->fds[i] = fd;
+		race->next_attempt = loop->now + PRT_RACE_DELAY;
+		return 1;
+	}
+
+	return 0;
+}
+
+/* returns nonzero if any of the connections in context's race are still going */
+static int
+prt_loop_race_running(struct prt_context *context)
+{
+	unsigned int i;
+
+	for(i = 0; i < context->race->num_addresses; i++) {
+		if(context->race->fds[i] != -1)
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * starts racing connections to the addresses request found, in the
+ * order the resolver gave them: each gets PRT_RACE_DELAY to connect
+ * before the next is started alongside it, or is followed right away
+ * if it fails. the first to connect is kept and the rest are dropped.
+ */
+static void
+prt_loop_start_race(struct prt_loop *loop, struct prt_context *context,
+                    struct prt_resolve_request *request)
+{
+	struct prt_race *race;
+	unsigned int i;
+
+	race = malloc(sizeof(struct prt_race));
+	if(!race) {
+		fprintf(stderr, "prt_loop_start_race(): Memory allocation failed\n");
+		prt_loop_close_context(loop, context);
+		return;
+	}
+	memcpy(race->addresses, request->addresses, sizeof(race->addresses));
+	race->num_addresses = request->num_addresses;
+	race->next = 0;
+	for(i = 0; i < PRT_ADDRESSES_MAX; i++)
+		race->fds[i] = -1;
+	race->next_attempt = 0;
+	context->race = race;
+
+	context->upstream_started = loop->now;
+	context->state = PRT_STATE_CONNECTING;
+	if(!prt_loop_race_attempt(loop, context)) {
+		prt_loop_end_race(loop, context);
+		prt_loop_setup_failed(loop, context, 0);
+		return;
+	}
+	prt_loop_schedule(loop, context);
+}
+
+/*
+ * starts connecting to the server once its address has been looked up,
+ * and has prt_loop_negotiate() take over from there
+ */
+static void
+prt_loop_resolved(struct prt_loop *loop, struct prt_resolve_request *request)
+{
+	struct prt_context *context = request->arg;
+	unsigned long delay;
+	prt_counter sent, rcvd;
+
+	/* UDP associations look up where their datagrams go */
+	if(context->state == PRT_STATE_UDP) {
+		sent = context->bytes_sent;
+		rcvd = context->bytes_rcvd;
+		prt_udp_resolved(context, request, loop->now);
+		prt_loop_count_bytes(loop, context, sent, rcvd);
+		free(request);
+		return;
+	}
+	if(context->hedge && request == context->hedge->resolve_request) {
+		prt_loop_hedge_resolved(loop, context, request);
+		return;
+	}
+
+	context->resolve_request = NULL;
+	if(request->status == -1) {
+		fprintf(stderr, "Error: Unable to resolve hostname %s\n", request->hostname);
+		free(request);
+		prt_loop_setup_failed(loop, context, 0);
+		return;
+	}
+	prt_loop_step_done(loop, context, PRT_LATENCY_RESOLVE, prt_timer_usecs());
+
+	/* connecting directly, any of the host's addresses will do */
+	if(!context->upstream) {
+		prt_loop_start_race(loop, context, request);
+		free(request);
+		return;
+	}
+
+	context->upstream_started = loop->now;
+	context->remotefd = context->connect(context, request->family, request->address);
+	free(request);
+	if(context->remotefd == -1) {
+		prt_loop_setup_failed(loop, context, 0);
+		return;
+	}
+
+	/* a proxy server that's slow to answer can be given up on */
+	if(upstream_timeout) {
+		context->upstream_deadline = loop->now + upstream_timeout * 1000;
+		prt_loop_schedule(loop, context);
+	}
+
+	/* and one that's only slower than usual can be raced with another */
+	if(context->upstream && !context->hedge) {
+		delay = prt_upstream_hedge_delay();
+		if(delay) {
+			context->hedge_at = loop->now + delay;
+			prt_loop_schedule(loop, context);
+		}
+	}
+
+	context->state = PRT_STATE_CONNECTING;
+	context->handshake_events = PRT_EVENT_WRITE; /* wait for connect() */
+	if(!prt_loop_watch_fd(loop, context, context->remotefd, &context->remoteevents)) {
+		/* close_context() mustn't touch a socket that isn't being watched */
+		close(context->remotefd);
+		context->remotefd = -1;
+		prt_loop_close_context(loop, context);
+	}
+}
+
+/* hands every lookup that's finished to prt_loop_resolved() */
+static void
+prt_loop_check_resolver(struct prt_loop *loop)
+{
+	struct prt_resolve_request *request;
+
+	while((request = prt_resolver_done(loop->resolver)))
+		prt_loop_resolved(loop, request);
+}
+
+/*
+ * sets up a socks5 UDP association for context's client, with a socket
+ * for its datagrams on the address it reached us at, and tells the
+ * client where that is. the association lasts until the client closes
+ * its connection, or no datagrams go through for udp_timeout seconds.
+ */
+static void
+prt_loop_udp_associate(struct prt_loop *loop, struct prt_context *context)
+{
+	struct boundsocket bs;
+	unsigned char reply[22];
+	int replylen;
+	int events;
+
+	bs.fd = -1;
+#ifdef IPV6
+	if(flags & PRT_IPV6) {
+		bs.len = sizeof(bs.sin6);
+		if(getsockname(context->localfd, (struct sockaddr *)&bs.sin6, &bs.len) == 0)
+			bs = udp_bind_to6((unsigned char *)&bs.sin6.sin6_addr, 0);
+		if(bs.fd != -1 && getsockname(bs.fd, (struct sockaddr *)&bs.sin6, &bs.len) == -1) {
+			close(bs.fd);
+			bs.fd = -1;
+		}
+	} else
+#endif /* IPV6 */
+	{
+		bs.len = sizeof(bs.sin);
+		if(getsockname(context->localfd, (struct sockaddr *)&bs.sin, &bs.len) == 0)
+			bs = udp_bind_to((unsigned char *)&bs.sin.sin_addr, 0);
+		if(bs.fd != -1 && getsockname(bs.fd, (struct sockaddr *)&bs.sin, &bs.len) == -1) {
+			close(bs.fd);
+			bs.fd = -1;
+		}
+	}
+	if(bs.fd != -1) {
+		context->udp = prt_udp_new(bs.fd);
+		if(!context->udp)
+			close(bs.fd);
+	}
+	if(!context->udp) {
+		fprintf(stderr, "Error: Unable to set up UDP association\n");
+		context->local_send(context, "\x05\x01\x00\x01\x00\x00\x00\x00\x00\x00", 10);
+		prt_loop_close_context(loop, context);
+		return;
+	}
+
+	context->state = PRT_STATE_UDP;
+	context->udp->last_active = loop->now;
+	if(!prt_loop_watch_fd(loop, context, context->udp->clientfd, &events) ||
+	   (context->udp->remotefd != -1 &&
+	    !prt_loop_watch_fd(loop, context, context->udp->remotefd, &events)) ||
+	   (context->udp->remotefd6 != -1 &&
+	    !prt_loop_watch_fd(loop, context, context->udp->remotefd6, &events))) {
+		context->local_send(context, "\x05\x01\x00\x01\x00\x00\x00\x00\x00\x00", 10);
+		prt_loop_close_context(loop, context);
+		return;
+	}
+
+	reply[0] = 0x05;
+	reply[1] = 0x00;
+	reply[2] = 0x00;
+#ifdef IPV6
+	if(flags & PRT_IPV6) {
+		reply[3] = 0x04;
+		memcpy(reply + 4, &bs.sin6.sin6_addr, 16);
+		memcpy(reply + 20, &bs.sin6.sin6_port, 2);
+		replylen = 22;
+	} else
+#endif /* IPV6 */
+	{
+		reply[3] = 0x01;
+		memcpy(reply + 4, &bs.sin.sin_addr, 4);
+		memcpy(reply + 8, &bs.sin.sin_port, 2);
+		replylen = 10;
+	}
+	context->local_send(context, (char *)reply, replylen);
+	fprintf(stderr, "UDP association set up on port %u\n", (reply[replylen - 2] << 8) | reply[replylen - 1]);
+
+	prt_loop_schedule(loop, context);
+	prt_loop_update_events(loop, context);
+}
+
+/*
+ * reads from the connection that holds a UDP association open, which
+ * the client isn't meant to send anything more on, and ends the
+ * association once it's closed
+ */
+static void
+prt_loop_udp_control(struct prt_loop *loop, struct prt_context *context)
+{
+	char buf[256];
+	int n;
+
+	for(;;) {
+		n = context->local_read(context, buf, sizeof(buf));
+		if(n > 0)
+			continue;
+		if(n < 0 && errno == EINTR)
+			continue;
+		if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return;
+		prt_loop_close_context(loop, context);
+		return;
+	}
+}
+
+/*
+ * reads and parses what the client has sent of its socks request,
+ * and goes on to look up the server once it's all in
+ */
+static void
+prt_loop_socks(struct prt_loop *loop, struct prt_context *context)
+{
+	struct prt_buffer *buf = &context->localbuf;
+	unsigned int len;
+	int n;
+
+	for(;;) {
+		if(buf->end == PRT_BUFFER_SIZE) {
+			fprintf(stderr, "Error: SOCKS request from client is too long\n");
+			prt_loop_close_context(loop, context);
+			return;
+		}
+		n = context->local_read(context, buf->data + buf->end, PRT_BUFFER_SIZE - buf->end);
+		if(n < 0 && errno == EINTR)
+			continue;
+		if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return;
+		if(n <= 0) {
+			prt_loop_close_context(loop, context);
+			return;
+		}
+		buf->end += n;
+
+		n = socks_parse_request(context);
+		if(n == -1) {
+			prt_loop_close_context(loop, context);
+			return;
+		}
+		if(n == 2) {
+			prt_loop_udp_associate(loop, context);
+			return;
+		}
+		if(n == 1)
+			break;
+	}
+
+	fprintf(stderr, "Connect to %s:%d\n", context->remotehost, context->remoteport);
+
+	/* whatever came after the request goes to the remote host */
+	len = buf->end;
+	buf->end = 0;
+	if(len) {
+		prt_relay_preload(context, 1, buf->data, len);
+		PRT_COUNTER_ADD(loop->metrics->bytes[1], len);
+	}
+
+	/* the setup timeout starts over for the connection itself */
+	context->trace[PRT_TRACE_REQUEST] = prt_timer_usecs();
+	context->state = PRT_STATE_RESOLVING;
+	context->connect_started = loop->now;
+	prt_loop_schedule(loop, context);
+	prt_loop_update_events(loop, context);
+
+	if(!prt_loop_resolve(loop, context))
+		prt_loop_close_context(loop, context);
+}
+
+/*
+ * follows up on relaying data for context, which had sent and rcvd
+ * bytes relayed before, with n being what prt_relay() (or
+ * prt_relay_complete()) returned: notes which sides were heard from,
+ * and closes the context if the tunnel is done. a tunnel that had
+ * more to relay than one turn allows goes in the backlog. returns -1
+ * if it was closed, 0 otherwise.
+ */
+static int
+prt_loop_relayed(struct prt_loop *loop, struct prt_context *context,
+                 prt_counter sent, prt_counter rcvd, int n)
+{
+	prt_loop_count_bytes(loop, context, sent, rcvd);
+	if(!context->got_first_byte && context->bytes_rcvd != rcvd) {
+		context->got_first_byte = 1;
+		prt_histogram_add(&loop->metrics->latency[PRT_LATENCY_FIRST_BYTE], prt_timer_usecs() - context->trace[PRT_TRACE_ACCEPTED]);
+	}
+	if(n == -1) {
+		prt_loop_close_context(loop, context);
+		return -1;
+	}
+	if(n && !context->backlogged)
+		prt_loop_backlog_add(loop, context);
+	else if(!n && context->backlogged)
+		prt_loop_backlog_remove(loop, context);
+
+	/* a side that's being held back isn't idle */
+	if(context->bytes_sent != sent || context->localbuf.throttled)
+		context->local_active = loop->now;
+	if(context->bytes_rcvd != rcvd || context->remotebuf.throttled)
+		context->remote_active = loop->now;
+	prt_loop_update_events(loop, context);
+
+	if(context->throttle_wait) {
+		if(!context->throttle_at || loop->now + context->throttle_wait < context->throttle_at) {
+			context->throttle_at = loop->now + context->throttle_wait;
+			prt_loop_schedule(loop, context);
+		}
+		context->throttle_wait = 0;
+	}
+
+	return 0;
+}
+
+/* relays data for context after events on fd (see prt_loop_relayed()) */
+static int
+prt_loop_relay(struct prt_loop *loop, struct prt_context *context,
+               int fd, int events)
+{
+	prt_counter sent = context->bytes_sent;
+	prt_counter rcvd = context->bytes_rcvd;
+
+	return prt_loop_relayed(loop, context, sent, rcvd, prt_relay(context, fd, events));
+}
+
+/* the event set has finished something for context's tunnel */
+static int
+prt_loop_complete(struct prt_loop *loop, struct prt_context *context,
+                  struct prt_event *event)
+{
+	prt_counter sent = context->bytes_sent;
+	prt_counter rcvd = context->bytes_rcvd;
+
+	return prt_loop_relayed(loop, context, sent, rcvd, prt_relay_complete(context, event));
+}
+
+/* context's tunnel is set up; start relaying */
+static void
+prt_loop_established(struct prt_loop *loop, struct prt_context *context)
+{
+	if(context->hedge)
+		prt_loop_drop_hedge(loop, context);
+
+	if(context->upstream) {
+		prt_upstream_sample(context->upstream, loop->now - context->upstream_started);
+		context->upstream_trial = 0;
+		prt_loop_step_done(loop, context, PRT_LATENCY_HANDSHAKE, prt_timer_usecs());
+	} else {
+		context->trace[PRT_TRACE_ESTABLISHED] = prt_timer_usecs();
+	}
+	prt_loop_trace(context, 1);
+
+	if(context->local_socks) /* connected with socks; tell socks client */
+		socks_method_connected(context, context->local_socks);
+
+	fprintf(stderr, "Connected to remote host %s (port %u)\n", context->remotehost, context->remoteport);
+	context->state = PRT_STATE_RELAY;
+
+	/* idle time counts from here */
+	context->local_active = context->remote_active = loop->now;
+	context->keepalive_next = loop->now + keepalive * 1000;
+	prt_loop_schedule(loop, context);
+
+	/*
+	 * the event set may be able to take it from here; if not,
+	 * anything that arrived in the meantime hasn't been looked at,
+	 * so try relaying in both directions
+	 */
+	switch(prt_relay_start(context, loop->events)) {
+		case -1:
+			prt_loop_close_context(loop, context);
+			break;
+		case 0:
+			prt_loop_relay(loop, context, context->localfd, PRT_EVENT_READ | PRT_EVENT_WRITE);
+			break;
+	}
+}
+
+/*
+ * moves context's connection to the remote host along, and starts
+ * relaying once it's set up
+ */
+static void
+prt_loop_negotiate(struct prt_loop *loop, struct prt_context *context)
+{
+	int was_connected = context->remote_connected;
+	unsigned long now = prt_timer_usecs();
+	prt_counter sent = context->bytes_sent;
+	prt_counter rcvd = context->bytes_rcvd;
+	int events;
+
+	/*
+	 * negotiate may get through the handshake in the same call that
+	 * finds the socket connected, so the connection is timed from now.
+	 * whatever came after the proxy's reply is tunnel data already.
+	 */
+	events = prt_chain_negotiate(context);
+	prt_loop_count_bytes(loop, context, sent, rcvd);
+	if(!was_connected && context->remote_connected)
+		prt_loop_step_done(loop, context, PRT_LATENCY_CONNECT, now);
+	if(events == -1 || events == PRT_NEGOTIATE_REFUSED) {
+		prt_loop_setup_failed(loop, context, events == PRT_NEGOTIATE_REFUSED);
+		return;
+	}
+	if(events) {
+		context->handshake_events = events;
+		prt_loop_update_events(loop, context);
+		return;
+	}
+
+	prt_loop_established(loop, context);
+}
+
+/*
+ * moves context's hedge along; whichever of it and the attempt it's
+ * racing is set up first is the one the tunnel goes through
+ */
+static void
+prt_loop_negotiate_hedge(struct prt_loop *loop, struct prt_context *context)
+{
+	unsigned long now = prt_timer_usecs();
+	prt_counter sent, rcvd;
+	int was_connected;
+	int events;
+
+	prt_loop_swap_hedge(context);
+	was_connected = context->remote_connected;
+	sent = context->bytes_sent;
+	rcvd = context->bytes_rcvd;
+	events = prt_chain_negotiate(context);
+	prt_loop_count_bytes(loop, context, sent, rcvd);
+	if(!was_connected && context->remote_connected)
+		prt_loop_step_done(loop, context, PRT_LATENCY_CONNECT, now);
+	if(events > 0) {
+		context->handshake_events = events;
+		prt_loop_update_events(loop, context);
+	}
+	prt_loop_swap_hedge(context);
+
+	if(events == -1 || events == PRT_NEGOTIATE_REFUSED) {
+		prt_loop_hedge_failed(loop, context, events == PRT_NEGOTIATE_REFUSED);
+		return;
+	}
+	if(events)
+		return;
+
+	fprintf(stderr, "Proxy server %s:%u was quicker\n", context->hedge->upstream->host, context->hedge->upstream->port);
+	prt_loop_promote_hedge(loop, context);
+	prt_loop_established(loop, context);
+}
+
+/*
+ * deals with fd, one of the connections in context's race, once it's
+ * ready. the first to connect goes on to prt_loop_negotiate().
+ */
+static void
+prt_loop_race_event(struct prt_loop *loop, struct prt_context *context, int fd)
+{
+	struct prt_race *race = context->race;
+	char addrstr[ADDRESS_STRING_MAX];
+	unsigned int i;
+
+	for(i = 0; i < race->num_addresses; i++) {
+		if(race->fds[i] == fd)
+			break;
+	}
+	if(i == race->num_addresses)
+		return;
+
+	switch(connection_status(fd)) {
+		case 0:
+			return;
+		case 1:
+			context->remotefd = fd;
+			context->remoteevents = race->events[i];
+			context->remote_connected = 1;
+			prt_loop_step_done(loop, context, PRT_LATENCY_CONNECT, prt_timer_usecs());
+			race->fds[i] = -1;
+			prt_loop_end_race(loop, context);
+			context->handshake_events = PRT_EVENT_WRITE;
+			prt_loop_negotiate(loop, context);
+			return;
+	}
+
+	fprintf(stderr, "Error: Unable to connect to %s (port %u)\n", get_address_string(race->addresses[i].address, race->addresses[i].family == AF_INET6, addrstr), context->remoteport);
+	prt_event_remove(loop->events, fd);
+	loop->fd_contexts[fd] = NULL;
+	close(fd);
+	race->fds[i] = -1;
+
+	/* don't wait out the delay when there's nothing to wait for */
+	if(prt_loop_race_attempt(loop, context) || prt_loop_race_running(context)) {
+		prt_loop_schedule(loop, context);
+		return;
+	}
+	prt_loop_end_race(loop, context);
+	prt_loop_setup_failed(loop, context, 0);
+}
+
+/*
+ * gives each tunnel in the backlog another turn, in order; those that
+ * still have more to do go to the back for the next round. tunnels
+ * that aren't backlogged are dealt with as soon as their events come
+ * in, so interactive ones never wait behind bulk transfers for more
+ * than a round.
+ */
+static void
+prt_loop_backlog_round(struct prt_loop *loop)
+{
+	struct prt_context *context, *last = loop->backlog_tail;
+	int done = 0;
 
-	fprintf(stderr, "Connection from %s (port %u) accepted\n", get_address_string(addr, (flags & PRT_IPV6) != 0), port);
-
-	if(!remotehost) { /* accept socks commands if there's no predefined remotehost */
-		local_socks = socks_method(context, &remotehost, &remoteport);
-		if(local_socks == -1) {
-			close(context->localfd);
-			free(context);
-			return NULL;
-		}
+	while(!done && (context = loop->backlog)) {
+		done = (context == last);
+		prt_loop_backlog_remove(loop, context);
+		prt_loop_relay(loop, context, context->localfd, PRT_EVENT_READ | PRT_EVENT_WRITE);
 	}
+}
 
-	/* connect to remote server */
-	context->remotefd = context->connect(context, remotehost, remoteport, username, password, server_timeout);
-	if(context->remotefd == -1) {
-		fprintf(stderr, "Error: Unable to connect to remote host %s (port %u)\n", remotehost, remoteport);
-		close(context->localfd);
-		free(context);
-		return NULL;
+/* sends keep-alive data to the remote host */
+static int
+prt_loop_send_keepalive(struct prt_context *context)
+{
+	unsigned char s[2];
+
+	switch(keepalive_type) {
+		default:
+		case PRT_KEEPALIVE_CRLF:
+			s[0] = '\r';
+			s[1] = '\n';
+			break;
+		case PRT_KEEPALIVE_TELNET:
+			s[0] = 255;
+			s[1] = 241;
+			break;
 	}
 
-	if(local_socks) /* connected with socks; tell socks client */
-		socks_method_connected(context, local_socks);
+	return prt_relay_queue(context, 1, (char *)s, 2);
+}
 
-	fprintf(stderr, "Connected to remote host %s (port %u)\n", remotehost, remoteport);
-	if(!prt_context_list_add_context(context_list, context)) {
-		free(context);
-		return NULL;
+/*
+ * called when context's timer goes off; deals with whichever of its
+ * deadlines have passed, and sets the timer for the next one
+ */
+static void
+prt_loop_timeout(struct prt_loop *loop, struct prt_context *context)
+{
+	unsigned long now = loop->now;
+	struct prt_upstream *up;
+	int trial;
+
+	if(context->state == PRT_STATE_SOCKS) {
+		if(loop->timeout && now - context->connect_started >= (unsigned long)loop->timeout * 1000) {
+			fprintf(stderr, "Error: Timed out waiting for SOCKS request from client\n");
+			prt_loop_close_context(loop, context);
+			return;
+		}
+	} else if(context->state == PRT_STATE_UDP) {
+		if(udp_timeout && now - context->udp->last_active >= (unsigned long)udp_timeout * 1000) {
+			fprintf(stderr, "UDP association timed out\n");
+			prt_loop_close_context(loop, context);
+			return;
+		}
+	} else if(context->state != PRT_STATE_RELAY) {
+		if(loop->server_timeout && now - context->connect_started >= (unsigned long)loop->server_timeout * 1000) {
+			fprintf(stderr, "Error: Timed out connecting to remote host %s (port %u)\n", context->remotehost, context->remoteport);
+			prt_loop_count_failure(loop, context);
+			if(context->upstream && context->state == PRT_STATE_CONNECTING)
+				prt_loop_upstream_failed(context);
+			prt_loop_close_context(loop, context);
+			return;
+		}
+		if(context->upstream_deadline && now >= context->upstream_deadline) {
+			/* if there's nothing else to try, keep waiting */
+			context->upstream_deadline = 0;
+			if(context->hedge) {
+				fprintf(stderr, "Error: Timed out setting up tunnel through proxy server %s:%u\n", context->upstream->host, context->upstream->port);
+				prt_loop_count_failure(loop, context);
+				prt_loop_upstream_failed(context);
+				context->upstreams_tried |= 1UL << context->upstream->index;
+				prt_loop_promote_hedge(loop, context);
+			} else if((up = prt_loop_next_upstream(context, &trial))) {
+				fprintf(stderr, "Error: Timed out setting up tunnel through proxy server %s:%u\n", context->upstream->host, context->upstream->port);
+				prt_loop_count_failure(loop, context);
+				prt_loop_upstream_failed(context);
+				if(!prt_loop_switch_upstream(loop, context, up, trial)) {
+					prt_loop_close_context(loop, context);
+					return;
+				}
+			}
+		}
+		if(context->hedge_at && now >= context->hedge_at) {
+			context->hedge_at = 0;
+			if(!context->hedge)
+				prt_loop_start_hedge(loop, context);
+		}
+		if(context->race && context->race->next < context->race->num_addresses &&
+		   now >= context->race->next_attempt) {
+			if(!prt_loop_race_attempt(loop, context) && !prt_loop_race_running(context)) {
+				prt_loop_end_race(loop, context);
+				prt_loop_setup_failed(loop, context, 0);
+				return;
+			}
+		}
+	} else {
+		if(loop->timeout && now - context->local_active >= (unsigned long)loop->timeout * 1000) {
+			fprintf(stderr, "Error: Timed out waiting for data from client\n");
+			prt_loop_close_context(loop, context);
+			return;
+		}
+		if(loop->server_timeout && now - context->remote_active >= (unsigned long)loop->server_timeout * 1000) {
+			fprintf(stderr, "Error: Timed out waiting for data from remote host %s (port %u)\n", context->remotehost, context->remoteport);
+			prt_loop_close_context(loop, context);
+			return;
+		}
+		if(keepalive && now >= context->keepalive_next) {
+			/* keep to the interval, even if the timer went off late */
+			context->keepalive_next += keepalive * 1000;
+			if(context->keepalive_next <= now)
+				context->keepalive_next = now + keepalive * 1000;
+			if(prt_loop_send_keepalive(context) == -1) {
+				prt_loop_close_context(loop, context);
+				return;
+			}
+			prt_loop_update_events(loop, context);
+		}
+		if(context->throttle_at && now >= context->throttle_at) {
+			/* the rate limits' buckets have refilled; read again */
+			context->throttle_at = 0;
+			if(prt_loop_relay(loop, context, context->localfd, PRT_EVENT_READ | PRT_EVENT_WRITE) == -1)
+				return;
+		}
 	}
 
-	return context;
+	prt_loop_schedule(loop, context);
 }
 
-#ifdef _WIN32
+/* hands every context whose timer has gone off to prt_loop_timeout() */
 static void
-bzero(void *p, unsigned int size)
+prt_loop_check_timers(struct prt_loop *loop)
 {
-	unsigned int i;
+	struct prt_timer *timer;
 
-	for(i = 0; i < size; i++)
-		((unsigned char *)p)[i] = 0;
+	while((timer = prt_timer_expired(loop->timers)))
+		prt_loop_timeout(loop, timer->arg);
 }
-#endif /* _WIN32 */
 
+/*
+ * folds how long the loop took over this wakeup's work into its lag,
+ * which moves an eighth of the way towards each new reading
+ */
+static void
+prt_loop_measure_lag(struct prt_loop *loop)
+{
+	unsigned long took = prt_timer_now(loop->timers) - loop->now;
+
+	loop->lag = loop->lag - loop->lag / 8 + took;
+}
+
+/*
+ * returns nonzero if the loop has more on its hands than it should take
+ * new connections for: it's lagging, or every tunnel allowed is open
+ */
 static int
-prt_tcp_loop(unsigned char *localaddr, unsigned short localport,
-             char *remotehost, unsigned short remoteport,
-             char *username, char *password, int timeout, int server_timeout)
+prt_loop_overloaded(struct prt_loop *loop)
 {
-	struct boundsocket bsocket;
-	struct prt_context_list context_list;
-	fd_set *readfds = NULL;
-	unsigned int readfds_size = 0, old_readfds_size = 0;
-	unsigned char *addr;
-	unsigned short port;
-	unsigned int i;
-	int tmp;
-	int largest;
-	struct timeval tv;
+	if(max_loop_lag && loop->lag / 8 > max_loop_lag)
+		return 1;
+	return prt_limit_full();
+}
+
+/*
+ * stops watching the listening socket while the loop is overloaded
+ * (unless overloaded connections are shed) or out of descriptors, so
+ * new connections wait in the listen backlog, and starts again once
+ * it isn't
+ */
+static void
+prt_loop_admission(struct prt_loop *loop)
+{
+	int overloaded;
+
+	if(!(flags & PRT_DAEMON))
+		return;
+
+	if(loop->fds_wait && loop->now >= loop->fds_wait)
+		loop->fds_wait = 0;
+	overloaded = !overload_shed && prt_loop_overloaded(loop);
+	if((overloaded || loop->fds_wait) && loop->accepting) {
+		prt_event_remove(loop->events, loop->bsocket.fd);
+		loop->accepting = 0;
+		if(loop->fds_wait)
+			fprintf(stderr, "Out of file descriptors; holding new connections back\n");
+		else
+			fprintf(stderr, "Overloaded; holding new connections back\n");
+	} else if(!overloaded && !loop->fds_wait && !loop->accepting) {
+		if(prt_event_add(loop->events, loop->bsocket.fd, PRT_EVENT_ACCEPT) == -1)
+			return; /* try again next time */
+		loop->accepting = 1;
+		fprintf(stderr, "Taking new connections again\n");
+	}
+}
+
+/*
+ * accepts and closes up to budget connections, for an overloaded
+ * loop, starting with fd if the event set has accepted one already
+ */
+static void
+prt_loop_shed(struct prt_loop *loop, int fd, int budget)
+{
+	int shed = 0;
+
+	if(fd != -1) {
+		close(fd);
+		shed++;
+	}
+	while(shed < budget && (fd = accept_connection(loop->bsocket.fd, NULL, NULL)) != -1) {
+		close(fd);
+		shed++;
+	}
+	PRT_COUNTER_ADD(loop->metrics->rejected[PRT_REJECT_OVERLOAD], shed);
+	if(shed)
+		fprintf(stderr, "Overloaded; turned away %d connection%s\n", shed, shed == 1 ? "" : "s");
+}
+
+/*
+ * takes connections from the listening socket until there are none
+ * left, or PRT_ACCEPT_BUDGET of them, so a burst of new connections
+ * can't keep the loop from the tunnels it already has. the listening
+ * socket is level-triggered, so if there's no descriptor to take one
+ * with, it's left alone until a tunnel closes, or for PRT_FDS_WAIT ms
+ * if none does. an event set that accepts connections itself reports
+ * each one in its own event.
+ */
+static void
+prt_loop_accept(struct prt_loop *loop, struct prt_event *event)
+{
+	struct prt_context *context;
+	int drained = 0;
+	int i;
+
+	if(event->events & PRT_EVENT_ACCEPT) {
+		if(event->result < 0) {
+			if(event->result == -EMFILE || event->result == -ENFILE)
+				drained = -1;
+			else
+				PRT_COUNTER_ADD(loop->metrics->failures[PRT_FAILURE_ACCEPT], 1);
+		} else if(overload_shed && prt_loop_overloaded(loop)) {
+			prt_loop_shed(loop, event->result, PRT_ACCEPT_BUDGET);
+		} else {
+			/* too late to leave it in the listen backlog if overloaded */
+			context = prt_tcp_handle_connection(&loop->bsocket, &loop->context_list, loop->remotehost, loop->remoteport, loop->username, loop->password, loop->metrics, loop->index, event->result, &drained);
+			if(context && !prt_loop_watch_context(loop, context))
+				prt_loop_close_context(loop, context);
+		}
+	} else {
+		for(i = 0; i < PRT_ACCEPT_BUDGET && !drained; i++) {
+			if(prt_loop_overloaded(loop)) {
+				if(overload_shed)
+					prt_loop_shed(loop, -1, PRT_ACCEPT_BUDGET - i);
+				return;
+			}
+
+			context = prt_tcp_handle_connection(&loop->bsocket, &loop->context_list, loop->remotehost, loop->remoteport, loop->username, loop->password, loop->metrics, loop->index, -1, &drained);
+			if(context && !prt_loop_watch_context(loop, context))
+				prt_loop_close_context(loop, context);
+		}
+	}
+
+	if(drained == -1) {
+		loop->fds_wait = loop->now + PRT_FDS_WAIT;
+		prt_loop_admission(loop);
+	}
+}
+
+/* returns how long the loop may sleep, in milliseconds, or -1 for no limit */
+static int
+prt_loop_wait_time(struct prt_loop *loop)
+{
+	int timeout;
+
+	/*
+	 * backlogged tunnels have something to do already, as does a loop
+	 * that's had a tunnel close since it ran out of descriptors
+	 */
+	if(loop->backlog || (loop->fds_wait && loop->fds_wait <= loop->now))
+		return 0;
+
+	/*
+	 * nothing wakes the loop up when it can take connections again,
+	 * so it has to look every so often
+	 */
+	timeout = prt_timer_next(loop->timers);
+	if((flags & PRT_DAEMON) && !loop->accepting && (timeout == -1 || timeout > PRT_ADMISSION_CHECK))
+		timeout = PRT_ADMISSION_CHECK;
+
+	return timeout;
+}
+
+/* closes the listening socket and frees what prt_loop_init() set up */
+static void
+prt_loop_free(struct prt_loop *loop)
+{
+	close(loop->bsocket.fd);
+	prt_event_set_free(loop->events);
+	prt_resolver_free(loop->resolver);
+	prt_timer_wheel_free(loop->timers);
+	prt_context_list_free(&loop->context_list);
+	if(loop->fd_contexts)
+		free(loop->fd_contexts);
+}
 
-	context_list.contexts = NULL;
-	context_list.num_contexts = 0;
+/*
+ * binds and listens to the local port and sets up everything else
+ * a connection loop needs. returns 0 on success or -1 on error.
+ */
+static int
+prt_loop_init(struct prt_loop *loop, unsigned char *localaddr,
+              unsigned short localport, int reuseport)
+{
+	loop->context_list.contexts = NULL;
+	loop->context_list.num_contexts = 0;
+	loop->context_list.size = 0;
+	loop->context_list.free_contexts = NULL;
+	loop->context_list.slabs = NULL;
+	loop->fd_contexts = NULL;
+	loop->num_fd_contexts = 0;
+	loop->backlog = NULL;
+	loop->backlog_tail = NULL;
+	loop->lag = 0;
+	loop->accepting = (flags & PRT_DAEMON) != 0;
+	loop->fds_wait = 0;
 
 #ifdef IPV6
 	if(flags & PRT_IPV6)
-		bsocket = tcp_bind_to6(localaddr, localport);
+		loop->bsocket = tcp_bind_to6(localaddr, localport, reuseport);
 	else
 #endif /* IPV6 */
-		bsocket = tcp_bind_to(localaddr, localport);
-	if(bsocket.fd == -1) {
+		loop->bsocket = tcp_bind_to(localaddr, localport, reuseport);
+	if(loop->bsocket.fd == -1) {
 		fprintf(stderr, "Error: Unable to bind socket. The port you specified (%u) may be reserved or already in use.\n", localport);
 		return -1;
 	}
 
-	if(listen(bsocket.fd, 0) == -1) {
+	if(listen(loop->bsocket.fd, listen_backlog) == -1) {
 		fprintf(stderr, "Error: Unable to listen to socket\n");
-		close(bsocket.fd);
+		close(loop->bsocket.fd);
 		return -1;
 	}
 
-	fprintf(stderr, "Waiting for connection to port %u...\n", localport);
+	/* in daemon mode, connections are accepted until there are no more */
+	if((flags & PRT_DAEMON) && set_nonblocking(loop->bsocket.fd) == -1) {
+		fprintf(stderr, "Error: Unable to make listening socket non-blocking\n");
+		close(loop->bsocket.fd);
+		return -1;
+	}
+
+	loop->events = prt_event_set_new();
+	if(!loop->events) {
+		close(loop->bsocket.fd);
+		return -1;
+	}
+
+	loop->resolver = prt_resolver_new();
+	if(!loop->resolver) {
+		prt_event_set_free(loop->events);
+		close(loop->bsocket.fd);
+		return -1;
+	}
+
+	loop->timers = prt_timer_wheel_new();
+	if(!loop->timers) {
+		prt_resolver_free(loop->resolver);
+		prt_event_set_free(loop->events);
+		close(loop->bsocket.fd);
+		return -1;
+	}
+	loop->now = prt_timer_now(loop->timers);
+
+	if((flags & PRT_DAEMON) && prt_event_add(loop->events, loop->bsocket.fd, PRT_EVENT_ACCEPT) == -1) {
+		fprintf(stderr, "Error: Unable to watch listening socket\n");
+		prt_loop_free(loop);
+		return -1;
+	}
+
+	if(prt_resolver_fd(loop->resolver) != -1 && prt_event_add(loop->events, prt_resolver_fd(loop->resolver), PRT_EVENT_READ | PRT_EVENT_LEVEL) == -1) {
+		fprintf(stderr, "Error: Unable to watch resolver\n");
+		prt_loop_free(loop);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int
+prt_tcp_loop(struct prt_loop *loop)
+{
+	struct prt_event events[PRT_MAX_EVENTS];
+	int i, n;
 
 	/*
 	 * if not in daemon mode, we just wait for one connection
@@ -873,223 +2574,148 @@ prt_tcp_loop(unsigned char *localaddr, unsigned short localport,
 	 */
 	if(!(flags & PRT_DAEMON)) {
 		struct prt_context *context = NULL;
+		int drained;
+
 		while(!context) {
-			context = prt_tcp_handle_connection(&bsocket, &context_list, remotehost, remoteport, username, password, server_timeout);
+			context = prt_tcp_handle_connection(&loop->bsocket, &loop->context_list, loop->remotehost, loop->remoteport, loop->username, loop->password, loop->metrics, loop->index, -1, &drained);
 			if(context) {
-				context->keepalive_seconds = get_seconds();
-
-				/* set client socket timeout if necessary */
-				if(timeout) {
-					struct timeval timeout_val;
-
-					timeout_val.tv_sec = timeout;
-					timeout_val.tv_usec = 0;
-					setsockopt(context->localfd, SOL_SOCKET, SO_RCVTIMEO, (void *)&timeout_val, sizeof(timeout_val));
+				if(!prt_loop_watch_context(loop, context)) {
+					prt_loop_close_context(loop, context);
+					context = NULL;
 				}
 			}
 		}
 	}
 
-	/* determine largest fd */
-	if(flags & PRT_DAEMON)
-		largest = bsocket.fd;
-	else
-		largest = -1;
-	for(i = 0; i < context_list.num_contexts; i++) {
-		struct prt_context *context = context_list.contexts[i];
-		if(!context)
-			continue;
-
-		if(context->localfd > largest)
-			largest = context->localfd;
-		if(context->remotefd > largest)
-			largest = context->remotefd;
-	}
-
-	/* allocate memory for fd_set */
-	readfds_size = ((largest + NFDBITS) / NFDBITS) * sizeof(fd_set);
-	old_readfds_size = readfds_size;
-	readfds = malloc(readfds_size);
-	if(!readfds) {
-		fprintf(stderr, "Error: Memory allocation failed\n");
-		return -1;
-	}
-
-	/* add bound socket fd to fd_set */
-	bzero(readfds, readfds_size);
-	if(flags & PRT_DAEMON)
-		FD_SET(bsocket.fd, readfds);
-	/* add each fd from every context in list */
-	for(i = 0; i < context_list.num_contexts; i++) {
-		struct prt_context *context = context_list.contexts[i];
-		if(!context)
-			continue;
-
-		FD_SET(context->localfd, readfds);
-		FD_SET(context->remotefd, readfds);
-	}
+	for(;;) {
+		/*
+		 * sleep until there's something to do, or the next timer
+		 * goes off; backlogged tunnels have something to do already
+		 */
+		n = prt_event_wait(loop->events, events, PRT_MAX_EVENTS, prt_loop_wait_time(loop));
+		if(n == -1 && errno != EINTR)
+			break;
+		loop->now = prt_timer_now(loop->timers);
+		prt_loop_admission(loop);
 
-	tv.tv_sec = 1; /* one second timeout for select call */
-	tv.tv_usec = 0;
-	while((tmp = select(largest + 1, readfds, NULL, NULL, &tv)) > -1) {
-		/* handle new connections */
-		if(FD_ISSET(bsocket.fd, readfds)) {
-			struct prt_context *context = prt_tcp_handle_connection(&bsocket, &context_list, remotehost, remoteport, username, password, server_timeout);
-			if(context) {
-				context->keepalive_seconds = get_seconds();
+		for(i = 0; i < n; i++) {
+			struct prt_context *context;
+			int fd = events[i].fd;
 
-				/* set client socket timeout if necessary */
-				if(timeout) {
-					struct timeval timeout_val;
+			/* handle new connections */
+			if(fd == loop->bsocket.fd) {
+				prt_loop_accept(loop, &events[i]);
+				continue;
+			}
 
-					timeout_val.tv_sec = timeout;
-					timeout_val.tv_usec = 0;
-					setsockopt(context->localfd, SOL_SOCKET, SO_RCVTIMEO, (void *)&timeout_val, sizeof(timeout_val));
-				}
+			/* lookups have finished */
+			if(fd == prt_resolver_fd(loop->resolver)) {
+				prt_loop_check_resolver(loop);
+				continue;
 			}
-		}
 
-		/* loop through context list and handle any pending data */
-		for(i = 0; i < context_list.num_contexts; i++) {
-			struct prt_context *context = context_list.contexts[i];
+			/* the context may have been closed earlier in this batch */
+			if(fd < 0 || (unsigned int)fd >= loop->num_fd_contexts)
+				continue;
+			context = loop->fd_contexts[fd];
 			if(!context)
 				continue;
 
-			/* send keepalive */
-			context->keepalive_seconds += get_seconds();
-			if(keepalive && context->keepalive_seconds >= keepalive) {
-				unsigned char s[2];
-
-				context->keepalive_seconds = 0;
-
-				switch(keepalive_type) {
-					default:
-					case PRT_KEEPALIVE_CRLF:
-						s[0] = '\r';
-						s[1] = '\n';
-						context->remote_send(context, (char *)s, 2);
-						break;
-					case PRT_KEEPALIVE_TELNET:
-						s[0] = 255;
-						s[1] = 241;
-						context->remote_send(context, (char *)s, 2);
-						break;
+			if(context->state == PRT_STATE_SOCKS) {
+				prt_loop_socks(loop, context);
+			} else if(context->state == PRT_STATE_UDP) {
+				if(fd == context->localfd) {
+					prt_loop_udp_control(loop, context);
+				} else {
+					prt_counter sent = context->bytes_sent;
+					prt_counter rcvd = context->bytes_rcvd;
+
+					prt_udp_relay(context, loop->resolver, fd, loop->now);
+					prt_loop_count_bytes(loop, context, sent, rcvd);
 				}
+			} else if(context->state != PRT_STATE_RELAY) {
+				/* the client's socket isn't looked at until then */
+				if(fd == context->remotefd)
+					prt_loop_negotiate(loop, context);
+				else if(context->race && fd != context->localfd)
+					prt_loop_race_event(loop, context, fd);
+				else if(context->hedge && fd == context->hedge->fd)
+					prt_loop_negotiate_hedge(loop, context);
+			} else if(context->completions) {
+				prt_loop_complete(loop, context, &events[i]);
+			} else if(!context->backlogged) {
+				/* backlogged tunnels wait for prt_loop_backlog_round() */
+				prt_loop_relay(loop, context, fd, events[i].events);
 			}
+		}
 
-			/* send data from client to remote server */
-			if(FD_ISSET(context->localfd, readfds)) {
-				char buf[512];
-
-				tmp = context->local_read(context, buf, 512);
-				if(tmp <= 0) { /* connection closed */
-					prt_context_list_remove_context(&context_list, i);
-					context->disconnect(context);
-#ifdef IPV6
-					if(flags & PRT_IPV6)
-						get_ipv6_addr_and_port(&context->sin6, &addr, &port);
-					else
-#endif /* IPV6 */
-						get_ipv4_addr_and_port(&context->sin, &addr, &port);
-					fprintf(stderr, "Connection from %s (port %u) closed - %u bytes sent, %u bytes received\n", get_address_string(addr, (flags & PRT_IPV6) != 0), port, context->bytes_sent, context->bytes_rcvd);
-					free(context);
-					if(!(flags & PRT_DAEMON)) {
-						shutdown(bsocket.fd, SHUT_RDWR);
-						close(bsocket.fd);
-						return 0;
-					}
-					continue;
-				}
-
-				context->remote_send(context, buf, tmp);
-				context->bytes_sent += tmp;
+		/* without a descriptor to wait on, lookups finish right away */
+		if(prt_resolver_fd(loop->resolver) == -1)
+			prt_loop_check_resolver(loop);
 
-				print_data(buf, tmp, 1);
-			}
+		prt_loop_backlog_round(loop);
 
-			/* send data from remote server to client */
-			if(FD_ISSET(context->remotefd, readfds)) {
-				char buf[512];
+		prt_loop_check_timers(loop);
 
-				tmp = context->remote_read(context, buf, 512);
-				if(tmp <= 0) { /* connection closed */
-					prt_context_list_remove_context(&context_list, i);
-					context->disconnect(context);
-#ifdef IPV6
-					if(flags & PRT_IPV6)
-						get_ipv6_addr_and_port(&context->sin6, &addr, &port);
-					else
-#endif /* IPV6 */
-						get_ipv4_addr_and_port(&context->sin, &addr, &port);
-					fprintf(stderr, "Connection from %s (port %u) closed - %u bytes sent, %u bytes received\n", get_address_string(addr, (flags & PRT_IPV6) != 0), port, context->bytes_sent, context->bytes_rcvd);
-					free(context);
-					if(!(flags & PRT_DAEMON)) {
-						shutdown(bsocket.fd, SHUT_RDWR);
-						close(bsocket.fd);
-						return 0;
-					}
-					continue;
-				}
+		prt_loop_measure_lag(loop);
 
-				context->local_send(context, buf, tmp);
-				context->bytes_rcvd += tmp;
+		/* outside of daemon mode, we're done once the connection closes */
+		if(!(flags & PRT_DAEMON) && loop->context_list.num_contexts == 0) {
+			shutdown(loop->bsocket.fd, SHUT_RDWR);
+			prt_loop_free(loop);
+			return 0;
+		}
+	}
 
-				print_data(buf, tmp, 0);
+	prt_loop_free(loop);
+	return 0;
+}
 
-				/* check_incoming_data must come last, since it might modify buf */
-				check_incoming_data(context, buf, tmp);
-			}
-		}
+#ifndef _WIN32
+static void *
+prt_worker_thread(void *arg)
+{
+	struct prt_loop *loop = arg;
 
-		/* determine largest fd */
-		if(flags & PRT_DAEMON)
-			largest = bsocket.fd;
-		else
-			largest = -1;
-		for(i = 0; i < context_list.num_contexts; i++) {
-			struct prt_context *context = context_list.contexts[i];
-			if(!context)
-				continue;
+	loop->retval = prt_tcp_loop(loop);
+	return NULL;
+}
+#endif /* _WIN32 */
 
-			if(context->localfd > largest)
-				largest = context->localfd;
-			if(context->remotefd > largest)
-				largest = context->remotefd;
-		}
+void
+set_worker_count(unsigned int count)
+{
+	num_workers = count;
+}
 
-		/* allocate memory for fd_set */
-		readfds_size = ((largest + NFDBITS) / NFDBITS) * sizeof(fd_set);
-		if(readfds_size != old_readfds_size) {
-			if(readfds)
-				free(readfds);
-			readfds = malloc(readfds_size);
-			if(!readfds) {
-				fprintf(stderr, "Error: Memory allocation failed\n");
-				return -1;
-			}
-			old_readfds_size = readfds_size;
-		}
+void
+set_listen_backlog(int count)
+{
+	listen_backlog = count;
+}
 
-		/* add bound socket fd to fd_set */
-		bzero(readfds, readfds_size);
-		if(flags & PRT_DAEMON)
-			FD_SET(bsocket.fd, readfds);
-		/* add each fd from every context in list */
-		for(i = 0; i < context_list.num_contexts; i++) {
-			struct prt_context *context = context_list.contexts[i];
-			if(!context)
-				continue;
+void
+set_max_loop_lag(unsigned int msecs)
+{
+	max_loop_lag = msecs;
+}
 
-			FD_SET(context->localfd, readfds);
-			FD_SET(context->remotefd, readfds);
-		}
+void
+set_overload_shed(int shed)
+{
+	overload_shed = shed;
+}
 
-		tv.tv_sec = 1; /* one second timeout for select call */
-		tv.tv_usec = 0;
-	}
+void
+set_udp_timeout(unsigned int seconds)
+{
+	udp_timeout = seconds;
+}
 
-	close(bsocket.fd);
-	return 0;
+void
+set_upstream_timeout(unsigned int seconds)
+{
+	upstream_timeout = seconds;
 }
 
 int
@@ -1098,6 +2724,11 @@ prt_proxy(unsigned char *localaddr, unsigned short localport,
           char *username, char *password,
           int timeout, int server_timeout)
 {
+	struct prt_loop *loops;
+	struct prt_metrics *metrics;
+	unsigned int i, started;
+	int retval;
+
 #ifndef _WIN32
 	if(flags & PRT_DAEMON) { /* we're a daemon, so fork and return */
 		int daemonpid;
@@ -1114,7 +2745,84 @@ prt_proxy(unsigned char *localaddr, unsigned short localport,
 		setsid();
 		chdir("/");
 	}
+
+	/* a client or server that disappears shouldn't take us with it */
+	signal(SIGPIPE, SIG_IGN);
+#endif /* _WIN32 */
+
+	/* only one connection is handled when not in daemon mode */
+	if(!(flags & PRT_DAEMON))
+		num_workers = 1;
+
+	loops = malloc(sizeof(struct prt_loop) * num_workers);
+	if(!loops) {
+		fprintf(stderr, "Error: Memory allocation failed\n");
+		return -1;
+	}
+
+	/* the metrics endpoint may look at these for as long as we're running */
+	metrics = prt_metrics_new(num_workers);
+	if(!metrics) {
+		free(loops);
+		return -1;
+	}
+
+	/*
+	 * every worker gets its own listening socket, bound with
+	 * SO_REUSEPORT when there's more than one of them
+	 */
+	for(i = 0; i < num_workers; i++) {
+		loops[i].remotehost = remotehost;
+		loops[i].remoteport = remoteport;
+		loops[i].username = username;
+		loops[i].password = password;
+		loops[i].timeout = timeout;
+		loops[i].server_timeout = server_timeout;
+		loops[i].retval = 0;
+		loops[i].index = i;
+		loops[i].metrics = &metrics[i];
+
+		if(prt_loop_init(&loops[i], localaddr, localport, num_workers > 1) == -1) {
+			while(i-- > 0)
+				prt_loop_free(&loops[i]);
+			free(loops);
+			return -1;
+		}
+	}
+
+	if(prt_limit_start(num_workers) == -1 || prt_upstream_start_checks() == -1 ||
+	   prt_metrics_start() == -1) {
+		for(i = 0; i < num_workers; i++)
+			prt_loop_free(&loops[i]);
+		free(loops);
+		return -1;
+	}
+
+	fprintf(stderr, "Waiting for connection to port %u...\n", localport);
+
+	/* the first loop runs in this thread, the rest get their own */
+	started = 1;
+#ifndef _WIN32
+	for(; started < num_workers; started++) {
+		if(pthread_create(&loops[started].thread, NULL, prt_worker_thread, &loops[started]) != 0) {
+			fprintf(stderr, "Warning: Couldn't start worker thread; running with %u workers\n", started);
+			break;
+		}
+	}
+#endif /* _WIN32 */
+	for(i = started; i < num_workers; i++)
+		prt_loop_free(&loops[i]);
+
+	retval = prt_tcp_loop(&loops[0]);
+
+#ifndef _WIN32
+	for(i = 1; i < started; i++) {
+		pthread_join(loops[i].thread, NULL);
+		if(loops[i].retval == -1)
+			retval = -1;
+	}
 #endif /* _WIN32 */
 
-	return prt_tcp_loop(localaddr, localport, remotehost, remoteport, username, password, timeout, server_timeout);
+	free(loops);
+	return retval;
 }
@@ -30,6 +30,7 @@
 #define PRT_IPV6    0x8
 #define PRT_IRC_AUTOPONG 0x10
 #define PRT_HTTP_1_0     0x20
+#define PRT_SPLICE       0x40
 
 /* proxy types */
 #define PRT_DIRECT     0
@@ -41,11 +42,33 @@
 #define PRT_KEEPALIVE_TELNET 0
 #define PRT_KEEPALIVE_CRLF   1
 
+/* context states */
+#define PRT_STATE_SOCKS      0 /* reading the client's socks request */
+#define PRT_STATE_RESOLVING  1 /* looking up the server's address */
+#define PRT_STATE_CONNECTING 2 /* connecting to and negotiating with the remote side */
+#define PRT_STATE_RELAY      3 /* relaying data */
+#define PRT_STATE_UDP        4 /* relaying datagrams for a socks5 UDP association */
+
+/* event types (see event.c) */
+#define PRT_EVENT_READ  0x1
+#define PRT_EVENT_WRITE 0x2
+#define PRT_EVENT_ERROR 0x4
+#define PRT_EVENT_LEVEL 0x8 /* request level-triggered notification */
+#define PRT_EVENT_ACCEPT 0x10 /* a listening socket; with io_uring, connections come accepted */
+
+/* completions, from event sets that do I/O themselves (see event.c) */
+#define PRT_EVENT_RECEIVED 0x20 /* data (or the end of it) in one of the set's buffers */
+#define PRT_EVENT_SENT     0x40
+
+/* size of the buffer passed to get_address_string() */
+#define ADDRESS_STRING_MAX 128
+
 #ifdef _WIN32
 #	include <winsock2.h>
 #	define SHUT_RDWR SD_BOTH
 #	define close(s) closesocket(s)
 #	define snprintf _snprintf
+#	define strncasecmp _strnicmp
 #else
 #	include <unistd.h>
 #	include <sys/time.h>
@@ -54,9 +77,292 @@
 #	include <netdb.h>
 #endif /* _WIN32 */
 
+#ifndef MSG_DONTWAIT
+#	define MSG_DONTWAIT 0
+#endif
+
+/* size of each direction's relay buffer (see relay.c) */
+#define PRT_BUFFER_SIZE 16384
+
+/* a 64-bit count, for things like bytes relayed that outgrow 32 bits */
+#if defined(_WIN32)
+typedef unsigned __int64 prt_counter;
+#elif defined(__GNUC__)
+__extension__ typedef unsigned long long prt_counter;
+#else
+typedef unsigned long prt_counter;
+#endif
+
+/*
+ * adds n to counter c, which nothing but the calling thread writes to,
+ * and reads c from any thread. with GCC these are atomic loads and
+ * stores, so a reader never sees a count torn in half, and the writer
+ * still only pays for an addition.
+ */
+#if defined(__GNUC__) && !defined(_WIN32) && \
+    (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 7))
+#	define PRT_COUNTER_ADD(c, n) __atomic_store_n(&(c), __atomic_load_n(&(c), __ATOMIC_RELAXED) + (n), __ATOMIC_RELAXED)
+#	define PRT_COUNTER_READ(c) __atomic_load_n(&(c), __ATOMIC_RELAXED)
+#else
+#	define PRT_COUNTER_ADD(c, n) ((c) += (n))
+#	define PRT_COUNTER_READ(c) (c)
+#endif
+
+/* size of the buffer passed to prt_counter_string() */
+#define PRT_COUNTER_STRING_MAX 24
+
+struct prt_event_set;
+struct prt_resolver;
+struct prt_limit;
+
+/* a timer on a connection loop's timer wheel (see timer.c) */
+struct prt_timer {
+	struct prt_timer *next;
+	struct prt_timer **prevp;
+	unsigned long expires; /* tick it's due on */
+	struct prt_timer *child; /* first child in the overflow heap */
+	int pending;
+	void *arg;
+};
+
+/* a host name lookup (see resolve.c) */
+/* most addresses kept for one host name */
+#define PRT_ADDRESSES_MAX 8
+
+struct prt_address {
+	int family; /* AF_INET or AF_INET6 */
+	unsigned char address[16]; /* 4 bytes for AF_INET */
+};
+
+struct prt_resolve_request {
+	struct prt_resolver *resolver;
+	char *hostname;
+	int family; /* AF_INET, AF_INET6, or AF_UNSPEC for either */
+	int status; /* 0 once the addresses are filled in, -1 on failure */
+	unsigned char address[16]; /* the first of addresses */
+	struct prt_address addresses[PRT_ADDRESSES_MAX];
+	unsigned int num_addresses;
+	int cancelled; /* set if nobody wants the result any more */
+	void *arg;
+	struct prt_resolve_request *next;
+};
+
+struct prt_event {
+	int fd;
+	int events;
+	int result; /* for completions: what the operation returned, or -errno */
+	unsigned int buffer; /* for PRT_EVENT_RECEIVED: the set's buffer the data is in */
+};
+
+/* data read from one side of a tunnel that's waiting to go to the other */
+struct prt_buffer {
+	char *data; /* PRT_BUFFER_SIZE bytes */
+	unsigned int start; /* first byte not yet sent */
+	unsigned int end; /* end of the data read so far */
+	int eof; /* set when the side we read from has closed */
+
+	/* when splicing, data moves through this pipe instead of data */
+	int pipefd[2];
+	unsigned int piped; /* bytes in the pipe */
+
+	int throttled; /* set while rate limits keep us from reading more */
+
+	/* when relaying with completions (see relay.c) */
+	unsigned int sending; /* bytes from start being sent */
+	unsigned int held; /* bytes read that are still in the event set's buffers */
+};
+
+/*
+ * a histogram of latencies, in log-linear buckets like those of an
+ * HDR histogram: the first holds everything under 2^MIN_SHIFT
+ * microseconds, and each doubling after that is split into 2^SUB_SHIFT
+ * buckets of equal width, up to 2^(MIN_SHIFT + OCTAVES) microseconds
+ * (about 67 seconds). anything longer is only in count and sum.
+ */
+#define PRT_HISTOGRAM_MIN_SHIFT 7
+#define PRT_HISTOGRAM_SUB_SHIFT 2
+#define PRT_HISTOGRAM_OCTAVES   19
+#define PRT_HISTOGRAM_BUCKETS   (1 + (PRT_HISTOGRAM_OCTAVES << PRT_HISTOGRAM_SUB_SHIFT))
+
+struct prt_histogram {
+	prt_counter buckets[PRT_HISTOGRAM_BUCKETS];
+	prt_counter count;
+	prt_counter sum; /* microseconds */
+};
+
+/* where setting a tunnel up failed (see struct prt_metrics) */
+#define PRT_FAILURE_ACCEPT    0
+#define PRT_FAILURE_RESOLVE   1
+#define PRT_FAILURE_CONNECT   2
+#define PRT_FAILURE_HANDSHAKE 3
+#define PRT_FAILURES          4
+
+/* why a client was turned away */
+#define PRT_REJECT_ACL      0 /* not trusted, or denied */
+#define PRT_REJECT_LIMIT    1 /* over --max-tunnels, --conn-rate or its --acl limits */
+#define PRT_REJECT_OVERLOAD 2 /* shed by --overload shed */
+#define PRT_REJECTS         3
+
+/* the latencies measured for each tunnel */
+#define PRT_LATENCY_RESOLVE    0 /* looking up the server */
+#define PRT_LATENCY_CONNECT    1 /* connecting to it */
+#define PRT_LATENCY_HANDSHAKE  2 /* the proxy server handshake, after connecting */
+#define PRT_LATENCY_FIRST_BYTE 3 /* from accepting the client to the remote side's first byte */
+#define PRT_LATENCIES          4
+
+/*
+ * the points setting a tunnel up gets to, which are timed for --trace
+ * and --slow-setup (see trace.c)
+ */
+#define PRT_TRACE_ACCEPT      0 /* about to accept the client */
+#define PRT_TRACE_ACCEPTED    1
+#define PRT_TRACE_ADMITTED    2 /* found to be trusted and within its limits */
+#define PRT_TRACE_REQUEST     3 /* its socks request has been read, if it sent one */
+#define PRT_TRACE_RESOLVED    4 /* the server it connects to has been looked up */
+#define PRT_TRACE_CONNECTED   5 /* and connected to */
+#define PRT_TRACE_ESTABLISHED 6 /* the tunnel is set up, after any proxy handshake */
+#define PRT_TRACE_MARKS       7
+
+/*
+ * counters for one connection loop (see metrics.c). only the loop's
+ * own thread writes to them, so they need no locking, but they have to
+ * be changed with PRT_COUNTER_ADD(), since the metrics endpoint reads
+ * every loop's from its own thread.
+ */
+struct prt_metrics {
+	prt_counter tunnels; /* clients accepted */
+	prt_counter closed; /* and since let go */
+	prt_counter bytes[2]; /* [1] from clients, [0] to them */
+	prt_counter failures[PRT_FAILURES];
+	prt_counter rejected[PRT_REJECTS];
+	struct prt_histogram latency[PRT_LATENCIES];
+};
+
+/* most proxy servers that can be given with -H */
+#define PRT_UPSTREAMS_MAX 32
+
+/* returned by negotiate when the proxy server turns the tunnel down */
+#define PRT_NEGOTIATE_REFUSED -2
+
+/* a proxy server tunnels can go through (see upstream.c) */
+struct prt_upstream {
+	char *host;
+	unsigned short port;
+	unsigned int active; /* tunnels going through it */
+	unsigned long latency; /* moving average of setup time, in ms times 8 */
+	unsigned int samples; /* setups that have been timed */
+	unsigned long pipeline_retry_at; /* socks5: when to pipeline handshakes again, in seconds, after it choked on one; 0 if it hasn't */
+	unsigned int index; /* position in the list of upstreams */
+
+	/* health (see prt_upstream_failed()) */
+	unsigned int failures; /* in a row */
+	unsigned int ejections; /* times in a row it's been taken out of use */
+	unsigned long retry_at; /* when it can be tried again, in seconds */
+	int trial; /* something is trying it after it was out of use */
+};
+
+/* most proxy servers that can follow the first one with --chain */
+#define PRT_HOPS_MAX 8
+
+/* a proxy server tunnels go on through after the first (see chain.c) */
+struct prt_hop {
+	unsigned char type; /* PRT_HTTP or PRT_SOCKS5 */
+	struct prt_upstream server;
+	char *username;
+	char *password;
+};
+
+/*
+ * what a protocol module's negotiate needs to know about the proxy
+ * server it's talking to, which is the first one or one of the hops
+ * after it (see prt_chain_handshake())
+ */
+struct prt_handshake {
+	struct prt_upstream *server;
+	char *username; /* for the server, if it wants them */
+	char *password;
+	char *host; /* where the server is asked to connect to */
+	unsigned short port;
+};
+
+/*
+ * a second attempt at setting a tunnel up, through another proxy
+ * server, made when the first is slow (see proxy.c). the members are
+ * those of the context the attempt it's racing uses.
+ */
+struct prt_hedge {
+	int fd;
+	void *data;
+	struct prt_upstream *upstream;
+	int trial;
+	unsigned long started;
+	int events;
+	int handshake_events;
+	struct prt_resolve_request *resolve_request;
+	unsigned int hop;
+	int remote_connected;
+	unsigned long step_started;
+};
+
+/*
+ * connections being raced to each of a host's addresses, as in
+ * RFC 8305 (see prt_loop_start_race() in proxy.c)
+ */
+struct prt_race {
+	struct prt_address addresses[PRT_ADDRESSES_MAX];
+	unsigned int num_addresses;
+	unsigned int next; /* the next address to try */
+	int fds[PRT_ADDRESSES_MAX]; /* attempt at each address; -1 if none */
+	int events[PRT_ADDRESSES_MAX]; /* what each is watched for */
+	unsigned long next_attempt; /* when to start the next (wheel time) */
+};
+
+/* a socks5 UDP association (see udp.c) */
+struct prt_udp_association {
+	int clientfd; /* the client sends its datagrams here */
+	int remotefd; /* sends them on to IPv4 destinations; -1 if unavailable */
+	int remotefd6; /* and IPv6 ones; likewise */
+	unsigned long last_active; /* when a datagram last went through (wheel time) */
+
+	/* where the client sends from, once its first datagram has come in */
+	struct sockaddr_in client_sin;
+#ifdef IPV6
+	struct sockaddr_in6 client_sin6;
+#endif /* IPV6 */
+	int client_known;
+
+	/* the last host name datagrams went to, and its address */
+	char *name;
+	int name_family;
+	unsigned char name_address[16];
+	int name_valid;
+	unsigned long name_expires; /* when to look it up again (wheel time) */
+	struct prt_resolve_request *resolve_request; /* lookup in progress, if any */
+	char *pending; /* datagram waiting for the lookup, if any */
+	int pending_len;
+	unsigned short pending_port;
+
+	char *buf; /* room for a batch of datagrams */
+};
+
 struct prt_context {
-	/* pointers to protocol-specific functions */
-	int (*connect)(struct prt_context *context, char *hostname, unsigned short port, char *username, char *password, int server_timeout);
+	/*
+	 * pointers to protocol-specific functions. get_server returns
+	 * the host to connect to and the address family to look it up
+	 * as; once it's been resolved, connect starts a non-blocking
+	 * connection to an address of the given family and returns
+	 * the socket. without a proxy server, connect may be called
+	 * for several of the host's addresses at once, and the first
+	 * socket to connect is kept (see prt_loop_start_race()). negotiate
+	 * is then called whenever that socket is ready, and returns
+	 * the events it's waiting for, 0 once the tunnel is set up,
+	 * or -1 on error; PRT_NEGOTIATE_REFUSED means the proxy server
+	 * is working, but wouldn't or couldn't set this tunnel up.
+	 * negotiate sets remote_connected once the socket has connected.
+	 */
+	char *(*get_server)(struct prt_context *context, int *family);
+	int (*connect)(struct prt_context *context, int family, unsigned char *address);
+	int (*negotiate)(struct prt_context *context);
 	void (*disconnect)(struct prt_context *context);
 	int (*local_read)(struct prt_context *context, char *buf, int size);
 	int (*local_send)(struct prt_context *context, char *buf, int size);
@@ -71,10 +377,63 @@ struct prt_context {
 
 	int localfd; /* client socket */
 	int remotefd; /* server socket */
-	unsigned int bytes_sent;
-	unsigned int bytes_rcvd;
+	prt_counter bytes_sent;
+	prt_counter bytes_rcvd;
 	void *data; /* some protocols may require extra data, so we
 	               include this pointer for them to keep track of it */
 
-	unsigned long keepalive_seconds;
+	/* timing, in timer wheel time (see timer.c) */
+	struct prt_timer timer; /* goes off at the context's next deadline */
+	unsigned long local_active; /* when data last came from the client */
+	unsigned long remote_active; /* when data last came from the remote host */
+	unsigned long keepalive_next; /* when keep-alive data is sent next */
+
+	int state; /* PRT_STATE_* */
+	char *remotehost; /* where the tunnel goes */
+	unsigned short remoteport;
+	char *username;
+	char *password;
+	int local_socks; /* socks version the client used, if any */
+	unsigned long connect_started; /* when connecting started (wheel time) */
+	int handshake_events; /* events negotiate is waiting for */
+	struct prt_resolve_request *resolve_request; /* lookup in progress, if any */
+	struct prt_udp_association *udp; /* for a socks5 UDP ASSOCIATE, NULL otherwise */
+	struct prt_upstream *upstream; /* proxy server the tunnel goes through, if any */
+	int upstream_trial; /* whether it's trying the server after it was out of use */
+	unsigned long upstream_started; /* when connecting to it started (wheel time) */
+	unsigned long upstream_deadline; /* when to give up on it for another one; 0 for never */
+	unsigned long upstreams_tried; /* bit for each upstream (by index) that's failed */
+	unsigned int attempts; /* upstreams tried so far */
+	unsigned int hop; /* hops of the --chain the tunnel has got through */
+	struct prt_hedge *hedge; /* second attempt being raced, if any */
+	unsigned long hedge_at; /* when to start one (wheel time); 0 for never */
+	struct prt_race *race; /* addresses being raced, if any */
+
+	struct prt_limit *limit; /* the client's limits, if any (see limit.c) */
+	unsigned int worker; /* the loop it's on, whose share of the limits it reads with */
+	unsigned long throttle_wait; /* set by prt_relay() to how long until a throttled side can be read again, in ms */
+	unsigned long throttle_at; /* when to try reading again (wheel time); 0 if not throttled */
+
+	/* tunnels with more to relay than one turn allows wait their turn in a queue */
+	int backlogged;
+	struct prt_context *backlog_prev;
+	struct prt_context *backlog_next;
+
+	/*
+	 * for the latencies in struct prt_metrics and the setup trace, in
+	 * microseconds (see prt_timer_usecs())
+	 */
+	unsigned long trace[PRT_TRACE_MARKS]; /* when each PRT_TRACE_* was got to; 0 if it wasn't */
+	unsigned long step_started; /* when the step of setting the tunnel up it's on started */
+	int remote_connected; /* set by negotiate once remotefd has connected */
+	int got_first_byte; /* set once something has come from the remote side */
+
+	unsigned int list_index; /* position in the loop's context list */
+	struct prt_context *next_free; /* next unused context in the pool */
+
+	struct prt_buffer localbuf; /* from the client to the remote server */
+	struct prt_buffer remotebuf; /* from the remote server to the client */
+	int localevents; /* events being waited for on localfd */
+	int remoteevents; /* events being waited for on remotefd */
+	struct prt_event_set *completions; /* set relaying the tunnel with completions, if one is (see relay.c) */
 };
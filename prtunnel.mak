@@ -13,13 +13,24 @@ ALL : "$(OUTDIR)\prtunnel.exe"
 
 
 CLEAN :
+	-@erase "$(INTDIR)\acl.obj"
+	-@erase "$(INTDIR)\chain.obj"
 	-@erase "$(INTDIR)\connect.obj"
 	-@erase "$(INTDIR)\direct.obj"
+	-@erase "$(INTDIR)\event.obj"
 	-@erase "$(INTDIR)\getopt.obj"
 	-@erase "$(INTDIR)\http.obj"
+	-@erase "$(INTDIR)\limit.obj"
+	-@erase "$(INTDIR)\metrics.obj"
 	-@erase "$(INTDIR)\main.obj"
 	-@erase "$(INTDIR)\proxy.obj"
+	-@erase "$(INTDIR)\relay.obj"
+	-@erase "$(INTDIR)\resolve.obj"
 	-@erase "$(INTDIR)\socks5.obj"
+	-@erase "$(INTDIR)\timer.obj"
+	-@erase "$(INTDIR)\trace.obj"
+	-@erase "$(INTDIR)\udp.obj"
+	-@erase "$(INTDIR)\upstream.obj"
 	-@erase "$(OUTDIR)\prtunnel.exe"
 
 "$(OUTDIR)" :
@@ -36,13 +47,24 @@ CPP_PROJ=/nologo /MD /W3 /O2 /Ob2 /I "./" /D "WIN32" /D "NDEBUG" /D "_CONSOLE" /
 LINK32=link.exe
 LINK32_FLAGS=kernel32.lib user32.lib gdi32.lib advapi32.lib ws2_32.lib /nologo /subsystem:console /incremental:no /pdb:"$(OUTDIR)\prtunnel.pdb" /machine:I386 /out:"$(OUTDIR)\prtunnel.exe" 
 LINK32_OBJS= \
+	"$(INTDIR)\acl.obj" \
+	"$(INTDIR)\chain.obj" \
 	"$(INTDIR)\connect.obj" \
 	"$(INTDIR)\direct.obj" \
+	"$(INTDIR)\event.obj" \
 	"$(INTDIR)\getopt.obj" \
 	"$(INTDIR)\http.obj" \
+	"$(INTDIR)\limit.obj" \
+	"$(INTDIR)\metrics.obj" \
 	"$(INTDIR)\main.obj" \
 	"$(INTDIR)\proxy.obj" \
-	"$(INTDIR)\socks5.obj"
+	"$(INTDIR)\relay.obj" \
+	"$(INTDIR)\resolve.obj" \
+	"$(INTDIR)\socks5.obj" \
+	"$(INTDIR)\timer.obj" \
+	"$(INTDIR)\trace.obj" \
+	"$(INTDIR)\udp.obj" \
+	"$(INTDIR)\upstream.obj"
 
 "$(OUTDIR)\prtunnel.exe" : "$(OUTDIR)" $(DEF_FILE) $(LINK32_OBJS)
     $(LINK32) @<<
@@ -0,0 +1,799 @@
+/*
+ * Copyright (C) 2002-2006 Josh A. Beam
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * relaying of data between the client and the remote server once a
+ * tunnel is established. each direction has a bounded buffer; all
+ * socket operations are non-blocking, and a side is only read from
+ * while the buffer heading to its peer has room, so a slow reader
+ * only ever holds up its own tunnel. rate limits (see limit.c) are
+ * checked once for each read, and a side that has run out isn't read
+ * from again until prt_relay() is called after context->throttle_wait.
+ *
+ * each call to prt_relay() reads at most PRT_RELAY_QUANTUM bytes from
+ * each side, so one busy tunnel can't hold up the rest of its loop; a
+ * tunnel left with more to do is "backlogged", and the loop gives it
+ * another turn once everything else has had one (see proxy.c). this
+ * is deficit round robin with every tunnel weighed the same, and as a
+ * read can be cut short to fit what's left of the quantum, there's
+ * never a deficit to carry over to the next round.
+ *
+ * on linux, with --splice, tunnels whose data doesn't need to be
+ * looked at move it from socket to pipe to socket with splice(), so
+ * it's never copied into user space.
+ *
+ * with --event-backend io_uring, tunnels that aren't rate limited or
+ * splicing are relayed with completions instead (see prt_relay_start()):
+ * the event set receives into its own buffers and sends from ours, and
+ * tells us when it has, so relaying a tunnel takes no system calls of
+ * its own. data that doesn't fit in the buffer heading to the peer is
+ * held in the set's buffers, and the side it came from isn't received
+ * from again until it has all gone out.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include "prtunnel.h"
+
+#ifdef __linux__
+#	define HAVE_SPLICE
+#	include <fcntl.h>
+#	ifdef IO_URING
+#		define HAVE_IO_URING
+#	endif /* IO_URING */
+#endif /* __linux__ */
+
+/* the most we'll ask splice() to move at once */
+#define PRT_SPLICE_SIZE 65536
+
+/* the most read from each side of a tunnel in one turn */
+#define PRT_RELAY_QUANTUM 65536
+
+extern int flags;
+
+/* limit functions */
+extern unsigned int prt_limit_take(struct prt_limit *limit, unsigned int worker, int outgoing, unsigned int want, unsigned long *wait);
+extern void prt_limit_return(struct prt_limit *limit, unsigned int worker, int outgoing, unsigned int n);
+extern int prt_limit_bytes(struct prt_limit *limit);
+
+/* event functions */
+extern int prt_event_remove(struct prt_event_set *set, int fd);
+extern int prt_event_completions(struct prt_event_set *set);
+#ifdef HAVE_IO_URING
+extern int prt_event_recv(struct prt_event_set *set, int fd);
+extern int prt_event_send(struct prt_event_set *set, int fd, char *data, unsigned int len, void *owner);
+extern char *prt_event_buffer(struct prt_event_set *set, unsigned int buffer);
+extern void prt_event_release(struct prt_event_set *set, unsigned int buffer);
+extern void prt_event_hold(struct prt_event_set *set, int fd, unsigned int buffer, unsigned int start, unsigned int end);
+extern unsigned int prt_event_unhold(struct prt_event_set *set, int fd, char *dest, unsigned int size);
+#endif /* HAVE_IO_URING */
+
+int prt_relay_queue(struct prt_context *context, int outgoing, char *data, int len);
+void prt_relay_free(struct prt_context *context);
+
+/*
+ * returns how many of want bytes the rate limits let one direction of
+ * context's tunnel (buf's) read now. if that's none, buf is marked as
+ * throttled and context->throttle_wait says when to try again.
+ */
+static unsigned int
+allowance(struct prt_context *context, struct prt_buffer *buf,
+          int outgoing, unsigned int want)
+{
+	unsigned long wait;
+	unsigned int n;
+
+	n = prt_limit_take(context->limit, context->worker, outgoing, want, &wait);
+	buf->throttled = (n == 0);
+	if(buf->throttled && (!context->throttle_wait || wait < context->throttle_wait))
+		context->throttle_wait = wait;
+
+	return n;
+}
+
+/* returns nonzero if the last socket operation failed only because it would block */
+static int
+would_block()
+{
+	return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR);
+}
+
+/*
+ * if the PRT_VERBOSE bit is set, print s; if the PRT_COLOR bit
+ * is set, print s in color for outgoing data
+ */
+static void
+print_data(char *s, int len, unsigned char outgoing)
+{
+	int i;
+
+	if(!(flags & PRT_VERBOSE))
+		return;
+
+#ifndef _WIN32
+	/* keep output from different worker threads apart */
+	flockfile(stdout);
+#endif /* _WIN32 */
+
+	if(flags & PRT_COLOR) {
+		if(outgoing)
+			printf("\033[1;31m");
+		else
+			printf("\033[0;0m");
+
+		for(i = 0; i < len; i++)
+			putchar(s[i]);
+
+		if(outgoing)
+			printf("\033[0;0m");
+	} else {
+		for(i = 0; i < len; i++) {
+			if(i == 0) {
+				if(outgoing)
+					printf(">>> ");
+				else
+					printf("<<< ");
+			}
+			putchar(s[i]);
+			if(s[i] == '\n' && (len - 1) > i) {
+				if(outgoing)
+					printf(">>> ");
+				else
+					printf("<<< ");
+			}
+		}
+	}
+
+	fflush(stdout);
+
+#ifndef _WIN32
+	funlockfile(stdout);
+#endif /* _WIN32 */
+}
+
+/*
+ * this function checks data from the remote server
+ * and responds to IRC PINGs and such if required.
+ */
+static void
+check_incoming_data(struct prt_context *context, char *buf, int len)
+{
+	int i, j;
+
+	if((flags & PRT_IRC_AUTOPONG) == 0)
+		return;
+
+	for(i = 0; i < len; i++) {
+		if(i != 0 && buf[i - 1] != '\n')
+			continue;
+
+		if(len - i >= 6 && strncmp(buf + i, "PING :", 6) == 0) {
+			char tmp[512];
+
+			for(j = i + 6; j < len && buf[j] != '\n'; j++)
+				;
+
+			/* buf may still be waiting to be sent, so don't modify it */
+			snprintf(tmp, sizeof(tmp), "PONG :%.*s\n", j - (i + 6), buf + i + 6);
+			prt_relay_queue(context, 1, tmp, strlen(tmp));
+		}
+	}
+}
+
+/* counts (and looks at) len bytes of data read from the client if outgoing is nonzero */
+static void
+received(struct prt_context *context, char *data, int len, int outgoing)
+{
+	print_data(data, len, outgoing);
+	if(outgoing) {
+		context->bytes_sent += len;
+	} else {
+		context->bytes_rcvd += len;
+		check_incoming_data(context, data, len);
+	}
+}
+
+static void
+close_pipe(struct prt_buffer *buf)
+{
+	if(buf->pipefd[0] != -1) {
+		close(buf->pipefd[0]);
+		close(buf->pipefd[1]);
+	}
+	buf->pipefd[0] = buf->pipefd[1] = -1;
+	buf->piped = 0;
+}
+
+#ifdef HAVE_SPLICE
+/*
+ * sets context up to relay with splice(). if the pipes can't be
+ * created (we may be short on descriptors), the tunnel just keeps
+ * using the copy path.
+ */
+static void
+splice_init(struct prt_context *context)
+{
+	if(pipe(context->localbuf.pipefd) == -1) {
+		context->localbuf.pipefd[0] = context->localbuf.pipefd[1] = -1;
+		return;
+	}
+	if(pipe(context->remotebuf.pipefd) == -1) {
+		context->remotebuf.pipefd[0] = context->remotebuf.pipefd[1] = -1;
+		close_pipe(&context->localbuf);
+		return;
+	}
+
+	/*
+	 * splice() has no MSG_DONTWAIT, and SPLICE_F_NONBLOCK only covers
+	 * the pipe end, so the sockets themselves have to be non-blocking.
+	 * the remote one already is, having been connected without blocking.
+	 */
+	fcntl(context->localfd, F_SETFL, fcntl(context->localfd, F_GETFL) | O_NONBLOCK);
+}
+
+/*
+ * the splice() version of relay_direction(). anything already in the
+ * user space buffer (data read during negotiation, keep-alives) goes
+ * out first, so the stream stays in order.
+ */
+static int
+splice_direction(struct prt_context *context, int outgoing, int *backlogged)
+{
+	struct prt_buffer *buf = outgoing ? &context->localbuf : &context->remotebuf;
+	int infd = outgoing ? context->localfd : context->remotefd;
+	int outfd = outgoing ? context->remotefd : context->localfd;
+	int drained = 0;
+	int progress;
+	unsigned int allowed, quantum = PRT_RELAY_QUANTUM;
+	int n;
+
+	do {
+		progress = 0;
+
+		if(buf->start < buf->end) {
+			if(outgoing)
+				n = context->remote_send(context, buf->data + buf->start, buf->end - buf->start);
+			else
+				n = context->local_send(context, buf->data + buf->start, buf->end - buf->start);
+			if(n < 0 && !would_block())
+				return -1;
+			if(n > 0) {
+				buf->start += n;
+				if(buf->start == buf->end)
+					buf->start = buf->end = 0;
+				progress = 1;
+			}
+			if(buf->start < buf->end)
+				continue;
+		}
+
+		/* empty the pipe */
+		if(buf->piped) {
+			n = splice(buf->pipefd[0], NULL, outfd, NULL, buf->piped,
+			           SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+			if(n < 0 && !would_block())
+				return -1;
+			if(n > 0) {
+				buf->piped -= n;
+				progress = 1;
+			}
+		}
+
+		/* and refill it */
+		if(!buf->eof && !drained) {
+			if(quantum == 0) {
+				*backlogged = 1;
+				break;
+			}
+			allowed = allowance(context, buf, outgoing, (quantum < PRT_SPLICE_SIZE) ? quantum : PRT_SPLICE_SIZE);
+			if(!allowed)
+				continue;
+			n = splice(infd, NULL, buf->pipefd[1], NULL, allowed,
+			           SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+			if(n < (int)allowed)
+				prt_limit_return(context->limit, context->worker, outgoing, (n > 0) ? allowed - n : allowed);
+			if(n == 0) { /* connection closed */
+				buf->eof = 1;
+			} else if(n < 0) {
+				if(!would_block())
+					return -1;
+				/*
+				 * with data in the pipe, this may just mean the
+				 * pipe is full; the socket is only known to be
+				 * drained if the pipe was empty
+				 */
+				if(buf->piped == 0)
+					drained = 1;
+			} else {
+				if(outgoing)
+					context->bytes_sent += n;
+				else
+					context->bytes_rcvd += n;
+				buf->piped += n;
+				quantum -= n;
+				progress = 1;
+			}
+		}
+	} while(progress);
+
+	return 0;
+}
+#endif /* HAVE_SPLICE */
+
+/*
+ * allocates the relay buffers for context.
+ * returns 1 on success or 0 on error.
+ */
+int
+prt_relay_init(struct prt_context *context)
+{
+	context->localbuf.pipefd[0] = context->localbuf.pipefd[1] = -1;
+	context->remotebuf.pipefd[0] = context->remotebuf.pipefd[1] = -1;
+	context->localbuf.piped = context->remotebuf.piped = 0;
+	context->localbuf.throttled = context->remotebuf.throttled = 0;
+	context->localbuf.sending = context->remotebuf.sending = 0;
+	context->localbuf.held = context->remotebuf.held = 0;
+
+	context->localbuf.data = malloc(PRT_BUFFER_SIZE);
+	context->remotebuf.data = malloc(PRT_BUFFER_SIZE);
+	if(!context->localbuf.data || !context->remotebuf.data) {
+		fprintf(stderr, "prt_relay_init(): Memory allocation failed\n");
+		prt_relay_free(context);
+		return 0;
+	}
+
+	context->localbuf.start = context->localbuf.end = 0;
+	context->localbuf.eof = 0;
+	context->remotebuf.start = context->remotebuf.end = 0;
+	context->remotebuf.eof = 0;
+
+#ifdef HAVE_SPLICE
+	/* anything that looks at the data needs it in user space */
+	if((flags & PRT_SPLICE) && !(flags & (PRT_VERBOSE | PRT_IRC_AUTOPONG)))
+		splice_init(context);
+#endif /* HAVE_SPLICE */
+
+	return 1;
+}
+
+void
+prt_relay_free(struct prt_context *context)
+{
+	/* a buffer still being sent from belongs to the event set now */
+	if(context->localbuf.data && !context->localbuf.sending)
+		free(context->localbuf.data);
+	if(context->remotebuf.data && !context->remotebuf.sending)
+		free(context->remotebuf.data);
+	context->localbuf.data = NULL;
+	context->remotebuf.data = NULL;
+
+	close_pipe(&context->localbuf);
+	close_pipe(&context->remotebuf);
+}
+
+/*
+ * moves data through one direction of a tunnel (client to remote
+ * server if outgoing is nonzero) until neither side can make any
+ * more progress without blocking, or PRT_RELAY_QUANTUM bytes have
+ * been read, in which case *backlogged is set. returns -1 on error,
+ * 0 otherwise.
+ */
+static int
+relay_direction(struct prt_context *context, int outgoing, int *backlogged)
+{
+	struct prt_buffer *buf = outgoing ? &context->localbuf : &context->remotebuf;
+	int drained = 0;
+	int progress;
+	unsigned int allowed, want, quantum = PRT_RELAY_QUANTUM;
+	int n;
+
+#ifdef HAVE_SPLICE
+	if(buf->pipefd[0] != -1)
+		return splice_direction(context, outgoing, backlogged);
+#endif /* HAVE_SPLICE */
+
+	do {
+		progress = 0;
+
+		/* send what's buffered */
+		if(buf->start < buf->end) {
+			if(outgoing)
+				n = context->remote_send(context, buf->data + buf->start, buf->end - buf->start);
+			else
+				n = context->local_send(context, buf->data + buf->start, buf->end - buf->start);
+			if(n < 0 && !would_block())
+				return -1;
+			if(n > 0) {
+				buf->start += n;
+				if(buf->start == buf->end)
+					buf->start = buf->end = 0;
+				progress = 1;
+			}
+		}
+
+		/* read more, but only while there's room to hold it */
+		if(!buf->eof && !drained) {
+			if(buf->end == PRT_BUFFER_SIZE && buf->start > 0) {
+				memmove(buf->data, buf->data + buf->start, buf->end - buf->start);
+				buf->end -= buf->start;
+				buf->start = 0;
+			}
+			if(buf->end == PRT_BUFFER_SIZE)
+				continue; /* full; wait for the peer to catch up */
+			if(quantum == 0) {
+				*backlogged = 1;
+				break;
+			}
+
+			want = PRT_BUFFER_SIZE - buf->end;
+			if(want > quantum)
+				want = quantum;
+			allowed = allowance(context, buf, outgoing, want);
+			if(!allowed)
+				continue;
+			if(outgoing)
+				n = context->local_read(context, buf->data + buf->end, allowed);
+			else
+				n = context->remote_read(context, buf->data + buf->end, allowed);
+			if(n < (int)allowed)
+				prt_limit_return(context->limit, context->worker, outgoing, (n > 0) ? allowed - n : allowed);
+			if(n == 0) { /* connection closed */
+				buf->eof = 1;
+			} else if(n < 0) {
+				if(!would_block())
+					return -1;
+				drained = 1;
+			} else {
+				/*
+				 * a short read doesn't mean we can stop: the FIN
+				 * may already be queued behind the data, and its
+				 * edge may have come while the buffer was full
+				 */
+				received(context, buf->data + buf->end, n, outgoing);
+				buf->end += n;
+				quantum -= n;
+				progress = 1;
+			}
+		}
+	} while(progress);
+
+	return 0;
+}
+
+/* returns nonzero if buf holds data that hasn't been sent yet */
+static int
+pending(struct prt_buffer *buf)
+{
+	return (buf->start < buf->end || buf->piped || buf->held);
+}
+
+/*
+ * relays whatever data fd's events allow, up to PRT_RELAY_QUANTUM
+ * bytes each way. returns -1 if the tunnel should be closed, 1 if it
+ * stopped there with more to do, or 0 otherwise.
+ */
+int
+prt_relay(struct prt_context *context, int fd, int events)
+{
+	int backlogged = 0;
+
+	/*
+	 * readable client or writable remote server means progress
+	 * can be made for outgoing data; the reverse for incoming
+	 */
+	if((events & PRT_EVENT_ERROR) ||
+	   (fd == context->localfd && (events & PRT_EVENT_READ)) ||
+	   (fd == context->remotefd && (events & PRT_EVENT_WRITE))) {
+		if(relay_direction(context, 1, &backlogged) == -1)
+			return -1;
+	}
+	if((events & PRT_EVENT_ERROR) ||
+	   (fd == context->remotefd && (events & PRT_EVENT_READ)) ||
+	   (fd == context->localfd && (events & PRT_EVENT_WRITE))) {
+		if(relay_direction(context, 0, &backlogged) == -1)
+			return -1;
+	}
+
+	/* once either side has closed and its data is delivered, we're done */
+	if(context->localbuf.eof && !pending(&context->localbuf))
+		return -1;
+	if(context->remotebuf.eof && !pending(&context->remotebuf))
+		return -1;
+
+	return backlogged;
+}
+
+#ifdef HAVE_IO_URING
+/*
+ * has context's event set send what's waiting in the buffer heading
+ * to the remote server if outgoing is nonzero, or to the client, if
+ * there's anything and it isn't sending already. returns -1 on
+ * error, 0 otherwise.
+ */
+static int
+complete_send(struct prt_context *context, int outgoing)
+{
+	struct prt_buffer *buf = outgoing ? &context->localbuf : &context->remotebuf;
+	int fd = outgoing ? context->remotefd : context->localfd;
+
+	if(buf->sending || buf->start == buf->end)
+		return 0;
+
+	buf->sending = buf->end - buf->start;
+	if(prt_event_send(context->completions, fd, buf->data + buf->start, buf->sending, buf->data) == -1) {
+		buf->sending = 0;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* data (or the end of it) has come in from fd */
+static int
+complete_recv(struct prt_context *context, int fd, struct prt_event *event)
+{
+	int outgoing = (fd == context->localfd);
+	struct prt_buffer *buf = outgoing ? &context->localbuf : &context->remotebuf;
+	char *data;
+	unsigned int n;
+
+	if(event->result < 0)
+		return -1;
+	if(event->result == 0) { /* connection closed */
+		buf->eof = 1;
+		return 0;
+	}
+
+	data = prt_event_buffer(context->completions, event->buffer);
+	received(context, data, event->result, outgoing);
+
+	/* take what fits, unless older data is already waiting */
+	n = 0;
+	if(!buf->held) {
+		if(buf->end + event->result > PRT_BUFFER_SIZE && buf->start > 0 && !buf->sending) {
+			memmove(buf->data, buf->data + buf->start, buf->end - buf->start);
+			buf->end -= buf->start;
+			buf->start = 0;
+		}
+		n = PRT_BUFFER_SIZE - buf->end;
+		if(n > (unsigned int)event->result)
+			n = event->result;
+		memcpy(buf->data + buf->end, data, n);
+		buf->end += n;
+	}
+	if(n < (unsigned int)event->result) {
+		prt_event_hold(context->completions, fd, event->buffer, n, event->result);
+		buf->held += event->result - n;
+	} else {
+		prt_event_release(context->completions, event->buffer);
+	}
+
+	return complete_send(context, outgoing);
+}
+
+/* a send to fd has finished */
+static int
+complete_sent(struct prt_context *context, int fd, struct prt_event *event)
+{
+	int outgoing = (fd == context->remotefd);
+	struct prt_buffer *buf = outgoing ? &context->localbuf : &context->remotebuf;
+	int infd = outgoing ? context->localfd : context->remotefd;
+	unsigned int n;
+
+	buf->sending = 0;
+	if(event->result < 0)
+		return (event->result == -EAGAIN || event->result == -EINTR) ? complete_send(context, outgoing) : -1;
+
+	buf->start += event->result;
+	if(buf->start == buf->end)
+		buf->start = buf->end = 0;
+
+	/* make room for what's been held, and once it's all in, receive again */
+	if(buf->held) {
+		if(buf->start > 0) {
+			memmove(buf->data, buf->data + buf->start, buf->end - buf->start);
+			buf->end -= buf->start;
+			buf->start = 0;
+		}
+		n = prt_event_unhold(context->completions, infd, buf->data + buf->end, PRT_BUFFER_SIZE - buf->end);
+		buf->end += n;
+		buf->held -= n;
+		if(!buf->held && !buf->eof && prt_event_recv(context->completions, infd) == -1)
+			return -1;
+	}
+
+	return complete_send(context, outgoing);
+}
+#endif /* HAVE_IO_URING */
+
+/*
+ * hands the relaying of context's tunnel over to set, if set can do
+ * its I/O itself and the tunnel doesn't need anything it can't do
+ * (rate limits, splice). from then on, set's events for the tunnel
+ * go to prt_relay_complete(). returns 1 if set has taken over, 0 if
+ * the tunnel has to be relayed with prt_relay(), or -1 on error.
+ */
+int
+prt_relay_start(struct prt_context *context, struct prt_event_set *set)
+{
+	if(!prt_event_completions(set) || context->localbuf.pipefd[0] != -1 ||
+	   prt_limit_bytes(context->limit))
+		return 0;
+
+#ifdef HAVE_IO_URING
+	/* the set stops watching the sockets and starts using them */
+	prt_event_remove(set, context->localfd);
+	prt_event_remove(set, context->remotefd);
+	context->completions = set;
+
+	if(!context->localbuf.eof && prt_event_recv(set, context->localfd) == -1)
+		return -1;
+	if(!context->remotebuf.eof && prt_event_recv(set, context->remotefd) == -1)
+		return -1;
+
+	/* anything read while the tunnel was being set up */
+	if(complete_send(context, 1) == -1 || complete_send(context, 0) == -1)
+		return -1;
+#endif /* HAVE_IO_URING */
+
+	return 1;
+}
+
+/*
+ * relays data for a tunnel that prt_relay_start() handed over to
+ * its event set, after event. returns -1 if the tunnel should be
+ * closed, or 0 otherwise.
+ */
+int
+prt_relay_complete(struct prt_context *context, struct prt_event *event)
+{
+#ifdef HAVE_IO_URING
+	int n = 0;
+
+	/* readiness may have been reported before the set took over */
+	if(event->events & PRT_EVENT_RECEIVED)
+		n = complete_recv(context, event->fd, event);
+	else if(event->events & PRT_EVENT_SENT)
+		n = complete_sent(context, event->fd, event);
+	if(n == -1)
+		return -1;
+
+	/* once either side has closed and its data is delivered, we're done */
+	if(context->localbuf.eof && !pending(&context->localbuf))
+		return -1;
+	if(context->remotebuf.eof && !pending(&context->remotebuf))
+		return -1;
+#endif /* HAVE_IO_URING */
+
+	return 0;
+}
+
+/*
+ * adds data of our own (keep-alives, IRC PONGs) to the stream going
+ * to the remote server if outgoing is nonzero, or to the client
+ * otherwise, and tries to send it. data that doesn't fit, or that
+ * would have to go ahead of data still in a splice pipe, is dropped.
+ * returns -1 on error, 0 otherwise.
+ */
+int
+prt_relay_queue(struct prt_context *context, int outgoing, char *data, int len)
+{
+	struct prt_buffer *buf = outgoing ? &context->localbuf : &context->remotebuf;
+	int n;
+
+	if(buf->piped)
+		return 0;
+
+	/* the set may be sending from the buffer, so leave its data where it is */
+	if(buf->end + len > PRT_BUFFER_SIZE && buf->start > 0 && !buf->sending) {
+		memmove(buf->data, buf->data + buf->start, buf->end - buf->start);
+		buf->end -= buf->start;
+		buf->start = 0;
+	}
+	if(buf->end + len > PRT_BUFFER_SIZE)
+		return 0;
+
+	memcpy(buf->data + buf->end, data, len);
+	buf->end += len;
+
+#ifdef HAVE_IO_URING
+	if(context->completions)
+		return complete_send(context, outgoing);
+#endif /* HAVE_IO_URING */
+
+	if(outgoing)
+		n = context->remote_send(context, buf->data + buf->start, buf->end - buf->start);
+	else
+		n = context->local_send(context, buf->data + buf->start, buf->end - buf->start);
+	if(n < 0)
+		return would_block() ? 0 : -1;
+
+	buf->start += n;
+	if(buf->start == buf->end)
+		buf->start = buf->end = 0;
+
+	return 0;
+}
+
+/*
+ * adds data read from one side while the tunnel was being set up to
+ * the stream going to the other side (the remote server if outgoing
+ * is nonzero), to be relayed once it starts. returns -1 if it doesn't
+ * fit, 0 otherwise.
+ */
+int
+prt_relay_preload(struct prt_context *context, int outgoing, char *data, int len)
+{
+	struct prt_buffer *buf = outgoing ? &context->localbuf : &context->remotebuf;
+
+	if(buf->end + len > PRT_BUFFER_SIZE)
+		return -1;
+
+	/* data may already be in the buffer (see prt_loop_socks()) */
+	memmove(buf->data + buf->end, data, len);
+	received(context, buf->data + buf->end, len, outgoing);
+	buf->end += len;
+
+	return 0;
+}
+
+/*
+ * returns the events worth waiting for on fd: reading only while the
+ * buffer heading to its peer has room, writing only while data is
+ * waiting to go out on it
+ */
+int
+prt_relay_events(struct prt_context *context, int fd)
+{
+	struct prt_buffer *in, *out;
+	int events = 0;
+
+	if(fd == context->localfd) {
+		in = &context->localbuf;
+		out = &context->remotebuf;
+	} else {
+		in = &context->remotebuf;
+		out = &context->localbuf;
+	}
+
+	if(in->pipefd[0] != -1) {
+		/*
+		 * we can't tell when a pipe has room, so only read into
+		 * an empty one; if it isn't empty, its peer is blocked,
+		 * and we'll read again once that's writable
+		 */
+		if(!in->eof && !in->throttled && !pending(in))
+			events |= PRT_EVENT_READ;
+	} else if(!in->eof && !in->throttled && (in->end < PRT_BUFFER_SIZE || in->start > 0)) {
+		events |= PRT_EVENT_READ;
+	}
+	if(pending(out))
+		events |= PRT_EVENT_WRITE;
+
+	return events;
+}
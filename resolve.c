@@ -0,0 +1,597 @@
+/*
+ * Copyright (C) 2002-2006 Josh A. Beam
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * host name resolution off the connection loop. lookups are handed to
+ * a small pool of resolver threads shared by all loops; each loop has
+ * a prt_resolver through which finished lookups come back to it, and
+ * a pipe that wakes the loop up when they do. a slow DNS server then
+ * only holds up the connections that are waiting on it.
+ *
+ * without threads (win32), lookups are done on the spot, and simply
+ * come back through the same queue.
+ *
+ * results are kept in a cache shared by all loops for cache_ttl
+ * seconds (failures for less), so hot names like the proxy host only
+ * cost a lookup now and then. getaddrinfo() doesn't tell us the real
+ * TTLs, hence the fixed lifetime. entries that get used are looked up
+ * again in the background shortly before they expire, so connections
+ * to them never have to wait.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#ifndef _WIN32
+#	include <fcntl.h>
+#	include <pthread.h>
+#endif /* _WIN32 */
+#include "prtunnel.h"
+
+/* number of resolver threads */
+#define PRT_RESOLVER_THREADS 4
+
+/* cache settings */
+#define PRT_CACHE_BUCKETS 256
+#define PRT_CACHE_MAX     1024 /* most names remembered at once */
+#define PRT_CACHE_NEGATIVE_TTL 5 /* longest a failure is remembered */
+#define PRT_CACHE_POPULAR 2 /* uses that get an entry refreshed */
+
+extern int resolve_host_all(const char *hostname, int family, struct prt_address *addresses, unsigned int max);
+extern unsigned long current_seconds();
+
+struct prt_resolver {
+	struct prt_resolve_request *done; /* finished lookups, oldest first */
+	struct prt_resolve_request *last_done;
+#ifndef _WIN32
+	unsigned int outstanding; /* lookups that haven't finished yet */
+	int closing; /* set once the resolver's loop is gone */
+	pthread_mutex_t lock;
+	int pipefd[2]; /* written to when done stops being empty */
+#endif /* _WIN32 */
+};
+
+struct prt_cache_entry {
+	char *hostname;
+	int family;
+	int status; /* as in prt_resolve_request */
+	struct prt_address addresses[PRT_ADDRESSES_MAX];
+	unsigned int num_addresses;
+	unsigned long expires;
+	unsigned long refresh; /* when a popular entry is looked up again */
+	unsigned int hits; /* uses since it was last looked up */
+	int refreshing; /* set while it's being looked up again */
+	struct prt_cache_entry *next;
+};
+
+static struct prt_cache_entry *cache[PRT_CACHE_BUCKETS];
+static unsigned int cache_size = 0;
+static unsigned int cache_ttl = 60;
+#ifndef _WIN32
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif /* _WIN32 */
+
+#ifndef _WIN32
+/* the resolver threads, and the lookups waiting for one of them */
+struct prt_resolver_pool {
+	struct prt_resolve_request *pending;
+	struct prt_resolve_request *last_pending;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int num_threads;
+};
+
+/* shared by every loop, so each resolver doesn't need threads of its own */
+static struct prt_resolver_pool resolver_pool = {
+	NULL, NULL, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0
+};
+#endif /* _WIN32 */
+
+void
+set_dns_cache_ttl(unsigned int ttl)
+{
+	cache_ttl = ttl;
+}
+
+static unsigned int
+cache_hash(const char *hostname, int family)
+{
+	unsigned int hash = family;
+
+	while(*hostname)
+		hash = hash * 31 + (unsigned char)*hostname++;
+
+	return hash % PRT_CACHE_BUCKETS;
+}
+
+/* returns the cache entry for hostname, or NULL; cache_lock must be held */
+static struct prt_cache_entry *
+cache_find(const char *hostname, int family)
+{
+	struct prt_cache_entry *entry;
+
+	for(entry = cache[cache_hash(hostname, family)]; entry; entry = entry->next) {
+		if(entry->family == family && strcmp(entry->hostname, hostname) == 0)
+			return entry;
+	}
+
+	return NULL;
+}
+
+/* throws away expired entries; cache_lock must be held */
+static void
+cache_prune(unsigned long now)
+{
+	struct prt_cache_entry **entryp, *entry;
+	unsigned int i;
+
+	for(i = 0; i < PRT_CACHE_BUCKETS; i++) {
+		entryp = &cache[i];
+		while((entry = *entryp)) {
+			if(now >= entry->expires) {
+				*entryp = entry->next;
+				free(entry);
+				cache_size--;
+			} else {
+				entryp = &entry->next;
+			}
+		}
+	}
+}
+
+/*
+ * answers request from the cache if possible. returns 1 if it was,
+ * or 0 if it has to be looked up. *refresh is set if the entry should
+ * be looked up again in the background.
+ */
+static int
+cache_lookup(struct prt_resolve_request *request, int *refresh)
+{
+	struct prt_cache_entry *entry;
+	unsigned long now;
+	int found = 0;
+
+	*refresh = 0;
+	if(!cache_ttl)
+		return 0;
+
+	now = current_seconds();
+#ifndef _WIN32
+	pthread_mutex_lock(&cache_lock);
+#endif /* _WIN32 */
+	entry = cache_find(request->hostname, request->family);
+	if(entry && now < entry->expires) {
+		request->status = entry->status;
+		memcpy(request->addresses, entry->addresses, sizeof(request->addresses));
+		request->num_addresses = entry->num_addresses;
+		memcpy(request->address, entry->addresses[0].address, sizeof(request->address));
+		found = 1;
+
+		entry->hits++;
+		if(entry->status == 0 && entry->hits >= PRT_CACHE_POPULAR &&
+		   now >= entry->refresh && !entry->refreshing) {
+			entry->refreshing = 1;
+			*refresh = 1;
+		}
+	}
+#ifndef _WIN32
+	pthread_mutex_unlock(&cache_lock);
+#endif /* _WIN32 */
+
+	return found;
+}
+
+/* remembers the result of a lookup */
+static void
+cache_store(struct prt_resolve_request *request)
+{
+	struct prt_cache_entry *entry;
+	unsigned long now;
+	unsigned int ttl;
+
+	if(!cache_ttl)
+		return;
+
+	ttl = cache_ttl;
+	if(request->status == -1 && ttl > PRT_CACHE_NEGATIVE_TTL)
+		ttl = PRT_CACHE_NEGATIVE_TTL;
+
+	now = current_seconds();
+#ifndef _WIN32
+	pthread_mutex_lock(&cache_lock);
+#endif /* _WIN32 */
+	entry = cache_find(request->hostname, request->family);
+
+	/* a failed refresh leaves the old address be until it expires */
+	if(entry && entry->refreshing && request->status == -1 && entry->status == 0) {
+		entry->refreshing = 0;
+		entry->hits = 0;
+		entry = NULL;
+	} else if(!entry) {
+		unsigned int len = strlen(request->hostname);
+		unsigned int hash;
+
+		if(cache_size >= PRT_CACHE_MAX)
+			cache_prune(now);
+		if(cache_size < PRT_CACHE_MAX)
+			entry = malloc(sizeof(struct prt_cache_entry) + len + 1);
+		if(entry) {
+			entry->hostname = (char *)(entry + 1);
+			memcpy(entry->hostname, request->hostname, len + 1);
+			entry->family = request->family;
+			hash = cache_hash(entry->hostname, entry->family);
+			entry->next = cache[hash];
+			cache[hash] = entry;
+			cache_size++;
+		}
+	}
+
+	if(entry) {
+		entry->status = request->status;
+		memcpy(entry->addresses, request->addresses, sizeof(entry->addresses));
+		entry->num_addresses = request->num_addresses;
+		entry->expires = now + ttl;
+		entry->refresh = entry->expires - ttl / 4;
+		entry->hits = 0;
+		entry->refreshing = 0;
+	}
+#ifndef _WIN32
+	pthread_mutex_unlock(&cache_lock);
+#endif /* _WIN32 */
+}
+
+static struct prt_resolve_request *
+prt_resolve_request_new(struct prt_resolver *resolver, const char *hostname,
+                        int family, void *arg)
+{
+	struct prt_resolve_request *request;
+	unsigned int len = strlen(hostname);
+
+	/* the name is kept with the request, since the caller might go away */
+	request = malloc(sizeof(struct prt_resolve_request) + len + 1);
+	if(!request)
+		return NULL;
+
+	request->resolver = resolver;
+	request->hostname = (char *)(request + 1);
+	memcpy(request->hostname, hostname, len + 1);
+	request->family = family;
+	request->status = -1;
+	request->num_addresses = 0;
+	request->cancelled = 0;
+	request->arg = arg;
+	request->next = NULL;
+
+	return request;
+}
+
+/* looks request's host name up, blocking until it's done */
+static void
+resolve_request_lookup(struct prt_resolve_request *request)
+{
+	int n;
+
+	n = resolve_host_all(request->hostname, request->family,
+	                     request->addresses, PRT_ADDRESSES_MAX);
+	if(n == -1) {
+		request->status = -1;
+		request->num_addresses = 0;
+		return;
+	}
+
+	request->status = 0;
+	request->num_addresses = n;
+	memcpy(request->address, request->addresses[0].address, sizeof(request->address));
+}
+
+/* puts a finished lookup on the queue of the resolver it belongs to */
+static void
+prt_resolver_finish(struct prt_resolve_request *request)
+{
+	struct prt_resolver *resolver = request->resolver;
+	int wake;
+
+	request->next = NULL;
+
+#ifndef _WIN32
+	pthread_mutex_lock(&resolver->lock);
+	resolver->outstanding--;
+	if(resolver->closing) {
+		/* nobody's listening; the last lookup out frees the resolver */
+		wake = (resolver->outstanding == 0);
+		pthread_mutex_unlock(&resolver->lock);
+		free(request);
+		if(wake) {
+			pthread_mutex_destroy(&resolver->lock);
+			free(resolver);
+		}
+		return;
+	}
+#endif /* _WIN32 */
+	wake = (resolver->done == NULL);
+	if(resolver->last_done)
+		resolver->last_done->next = request;
+	else
+		resolver->done = request;
+	resolver->last_done = request;
+#ifndef _WIN32
+	/*
+	 * the pipe has to be written to before the lock is let go of, or
+	 * prt_resolver_free() could close it (or free resolver) first
+	 */
+	if(wake)
+		write(resolver->pipefd[1], "", 1);
+	pthread_mutex_unlock(&resolver->lock);
+#endif /* _WIN32 */
+}
+
+#ifndef _WIN32
+static void *
+prt_resolver_thread(void *arg)
+{
+	struct prt_resolver_pool *pool = arg;
+	struct prt_resolve_request *request;
+
+	for(;;) {
+		pthread_mutex_lock(&pool->lock);
+		while(!pool->pending)
+			pthread_cond_wait(&pool->cond, &pool->lock);
+		request = pool->pending;
+		pool->pending = request->next;
+		if(!pool->pending)
+			pool->last_pending = NULL;
+		pthread_mutex_unlock(&pool->lock);
+
+		resolve_request_lookup(request);
+		cache_store(request);
+
+		/* background refreshes have nobody to report to */
+		if(request->resolver)
+			prt_resolver_finish(request);
+		else
+			free(request);
+	}
+
+	return NULL;
+}
+
+/* hands request to the resolver threads */
+static void
+prt_resolver_queue(struct prt_resolve_request *request)
+{
+	pthread_mutex_lock(&resolver_pool.lock);
+	if(resolver_pool.last_pending)
+		resolver_pool.last_pending->next = request;
+	else
+		resolver_pool.pending = request;
+	resolver_pool.last_pending = request;
+	pthread_cond_signal(&resolver_pool.cond);
+	pthread_mutex_unlock(&resolver_pool.lock);
+}
+
+/* starts the resolver threads if they haven't been already */
+static int
+prt_resolver_start_threads()
+{
+	pthread_t thread;
+	int retval = 0;
+
+	pthread_mutex_lock(&resolver_pool.lock);
+	while(resolver_pool.num_threads < PRT_RESOLVER_THREADS) {
+		if(pthread_create(&thread, NULL, prt_resolver_thread, &resolver_pool) != 0) {
+			if(resolver_pool.num_threads == 0) {
+				fprintf(stderr, "Error: Couldn't start resolver thread\n");
+				retval = -1;
+			}
+			break;
+		}
+		pthread_detach(thread);
+		resolver_pool.num_threads++;
+	}
+	pthread_mutex_unlock(&resolver_pool.lock);
+
+	return retval;
+}
+#endif /* _WIN32 */
+
+struct prt_resolver *
+prt_resolver_new()
+{
+	struct prt_resolver *resolver;
+
+	resolver = malloc(sizeof(struct prt_resolver));
+	if(!resolver) {
+		fprintf(stderr, "prt_resolver_new(): Memory allocation failed\n");
+		return NULL;
+	}
+
+	resolver->done = NULL;
+	resolver->last_done = NULL;
+
+#ifndef _WIN32
+	if(prt_resolver_start_threads() == -1) {
+		free(resolver);
+		return NULL;
+	}
+
+	if(pipe(resolver->pipefd) == -1) {
+		fprintf(stderr, "Error: Unable to create resolver pipe\n");
+		free(resolver);
+		return NULL;
+	}
+	fcntl(resolver->pipefd[0], F_SETFL, fcntl(resolver->pipefd[0], F_GETFL) | O_NONBLOCK);
+	pthread_mutex_init(&resolver->lock, NULL);
+	resolver->outstanding = 0;
+	resolver->closing = 0;
+#endif /* _WIN32 */
+
+	return resolver;
+}
+
+/*
+ * frees resolver along with any finished lookups. if some lookups
+ * are still in progress, the resolver stays around until they're
+ * done, and their results are thrown away.
+ */
+void
+prt_resolver_free(struct prt_resolver *resolver)
+{
+	struct prt_resolve_request *request;
+#ifndef _WIN32
+	int last;
+
+	pthread_mutex_lock(&resolver->lock);
+#endif /* _WIN32 */
+	while((request = resolver->done)) {
+		resolver->done = request->next;
+		free(request);
+	}
+	resolver->last_done = NULL;
+#ifndef _WIN32
+	resolver->closing = 1;
+	last = (resolver->outstanding == 0);
+	pthread_mutex_unlock(&resolver->lock);
+
+	close(resolver->pipefd[0]);
+	close(resolver->pipefd[1]);
+	if(!last)
+		return;
+	pthread_mutex_destroy(&resolver->lock);
+#endif /* _WIN32 */
+	free(resolver);
+}
+
+/*
+ * returns the descriptor that becomes readable when lookups finish,
+ * or -1 if there isn't one (in which case lookups finish right away)
+ */
+int
+prt_resolver_fd(struct prt_resolver *resolver)
+{
+#ifdef _WIN32
+	return -1;
+#else
+	return resolver->pipefd[0];
+#endif /* _WIN32 */
+}
+
+/*
+ * starts looking up hostname as an address of the given family (or
+ * both, for AF_UNSPEC). once
+ * it's done, the request is returned by prt_resolver_done(). returns
+ * NULL on error.
+ */
+struct prt_resolve_request *
+prt_resolve_start(struct prt_resolver *resolver, const char *hostname,
+                  int family, void *arg)
+{
+	struct prt_resolve_request *request;
+	int refresh;
+
+	request = prt_resolve_request_new(resolver, hostname, family, arg);
+	if(!request) {
+		fprintf(stderr, "prt_resolve_start(): Memory allocation failed\n");
+		return NULL;
+	}
+
+#ifndef _WIN32
+	pthread_mutex_lock(&resolver->lock);
+	resolver->outstanding++;
+	pthread_mutex_unlock(&resolver->lock);
+#endif /* _WIN32 */
+
+	if(cache_lookup(request, &refresh)) {
+		prt_resolver_finish(request);
+
+#ifndef _WIN32
+		if(refresh) {
+			struct prt_resolve_request *update;
+
+			update = prt_resolve_request_new(NULL, hostname, family, NULL);
+			if(update)
+				prt_resolver_queue(update);
+		}
+#endif /* _WIN32 */
+
+		return request;
+	}
+
+#ifdef _WIN32
+	resolve_request_lookup(request);
+	cache_store(request);
+	prt_resolver_finish(request);
+#else
+	prt_resolver_queue(request);
+#endif /* _WIN32 */
+
+	return request;
+}
+
+/*
+ * makes a lookup's result go unreported; the request is freed once
+ * the lookup is done, so the caller must forget about it
+ */
+void
+prt_resolve_cancel(struct prt_resolve_request *request)
+{
+	request->cancelled = 1;
+}
+
+/*
+ * returns the next finished lookup, or NULL if there aren't any more
+ * for now. the caller frees the request once it's done with it.
+ */
+struct prt_resolve_request *
+prt_resolver_done(struct prt_resolver *resolver)
+{
+	struct prt_resolve_request *request;
+#ifndef _WIN32
+	char buf[64];
+
+	/* the pipe only needs to wake us up, so empty it */
+	while(read(resolver->pipefd[0], buf, sizeof(buf)) > 0)
+		;
+#endif /* _WIN32 */
+
+	for(;;) {
+#ifndef _WIN32
+		pthread_mutex_lock(&resolver->lock);
+#endif /* _WIN32 */
+		request = resolver->done;
+		if(request) {
+			resolver->done = request->next;
+			if(!resolver->done)
+				resolver->last_done = NULL;
+		}
+#ifndef _WIN32
+		pthread_mutex_unlock(&resolver->lock);
+#endif /* _WIN32 */
+
+		if(!request || !request->cancelled)
+			return request;
+		free(request);
+	}
+}
@@ -24,152 +24,361 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <sys/types.h>
 #include "prtunnel.h"
 
 extern int flags;
 
-extern char *proxyhost;
-extern unsigned short proxyport;
-
-extern int establish_connection(char[], unsigned short);
+extern int establish_connection(unsigned char[], unsigned short);
 #ifdef IPV6
-extern int establish_connection6(char[], unsigned short);
+extern int establish_connection6(unsigned char[], unsigned short);
 #endif /* IPV6 */
 
-extern int read_byte(int);
+extern int connection_status(int);
+extern int send_pending(int, char *, unsigned int, unsigned int *);
 
-static int
-socks5_negotiate(int fd, char *hostname, unsigned short port,
-                 char *username, char *password)
+extern int prt_relay_preload(struct prt_context *context, int outgoing, char *data, int len);
+
+/* chain functions */
+extern void prt_chain_handshake(struct prt_context *context, struct prt_handshake *hs);
+
+/* upstream functions */
+extern int prt_upstream_can_pipeline(struct prt_upstream *up);
+extern void prt_upstream_no_pipelining(struct prt_upstream *up);
+
+/* where socks5_negotiate() is in setting up a tunnel */
+#define SOCKS5_CONNECTING 0
+#define SOCKS5_SENDING    1 /* sending out */
+#define SOCKS5_READING    2 /* reading and parsing replies */
+
+/* replies from the server, in the order they come */
+#define SOCKS5_REPLY_METHOD  0
+#define SOCKS5_REPLY_AUTH    1
+#define SOCKS5_REPLY_CONNECT 2
+
+struct socks5_state {
+	int step;
+	int reply; /* reply being waited for */
+	int pipelined; /* set if everything was sent up front */
+	char out[1024]; /* messages to send */
+	unsigned int outlen;
+	unsigned int outpos;
+	char in[512]; /* replies received */
+	unsigned int inlen;
+};
+
+static const char *socks5_errors[] = {
+	"succeeded",
+	"general SOCKS server failure",
+	"connection not allowed by ruleset",
+	"network unreachable",
+	"host unreachable",
+	"connection refused",
+	"TTL expired",
+	"command not supported",
+	"address type not supported"
+};
+
+/* appends the method selection message to state's out buffer */
+static void
+socks5_add_greeting(struct prt_handshake *hs, struct socks5_state *state)
 {
-	int i;
-	char buf[515];
+	char *p = state->out + state->outlen;
+
+	p[0] = 0x05;
+	p[1] = 0x01;
+	p[2] = (hs->username && hs->password) ? 0x02 : 0x00;
+	state->outlen += 3;
+}
+
+/* appends the username/password authentication message */
+static void
+socks5_add_auth(struct prt_handshake *hs, struct socks5_state *state)
+{
+	char *p = state->out + state->outlen;
+	unsigned char len, tmplen;
+
+	len = (strlen(hs->username) > 255) ? 255 : strlen(hs->username);
+	tmplen = (strlen(hs->password) > 255) ? 255 : strlen(hs->password);
+
+	p[0] = 0x01;
+	p[1] = len;
+	memcpy(p + 2, hs->username, len);
+	p[2 + len] = tmplen;
+	memcpy(p + 3 + len, hs->password, tmplen);
+	state->outlen += 3 + len + tmplen;
+}
+
+/* appends the CONNECT request */
+static void
+socks5_add_request(struct prt_handshake *hs, struct socks5_state *state)
+{
+	char *p = state->out + state->outlen;
 	unsigned char len;
-	unsigned char atyp;
 
-	buf[0] = 0x05;
-	buf[1] = 0x01;
-	if(username && password)
-		buf[2] = 0x02;
-	else
-		buf[2] = 0x00;
-	send(fd, buf, 3, 0);
-	if(read_byte(fd) != 0x05 || read_byte(fd) != buf[2]) {
-		fprintf(stderr, "Error: Bad response from SOCKS5 server\n");
-		close(fd);
-		return -1;
-	}
+	len = (strlen(hs->host) > 255) ? 255 : strlen(hs->host);
 
-	if(username && password) {
-		unsigned char tmplen;
+	p[0] = 0x05;
+	p[1] = 0x01;
+	p[2] = 0x00;
+	p[3] = 0x03;
+	p[4] = len;
+	memcpy(p + 5, hs->host, len);
+	p[5 + len] = (hs->port >> 8);
+	p[6 + len] = (hs->port & 0xff);
+	state->outlen += 7 + len;
+}
 
-		buf[0] = 0x01;
-		len = (strlen(username) > 255) ? 255 : strlen(username);
-		buf[1] = len;
-		memcpy(buf + 2, username, len);
+/* starts sending whatever's been added to state's out buffer */
+static void
+socks5_send(struct socks5_state *state)
+{
+	state->step = SOCKS5_SENDING;
+	state->outpos = 0;
+}
 
-		tmplen = (strlen(password) > 255) ? 255 : strlen(password);
-		buf[2 + len] = tmplen;
-		memcpy(buf + 3 + len, password, tmplen);
+/*
+ * parses as many of the server's replies as have been read. returns 1
+ * once the CONNECT reply is in, 0 if more has to be read or sent (in
+ * which case state->step says which), -1 on error, or
+ * PRT_NEGOTIATE_REFUSED if the server couldn't connect.
+ */
+static int
+socks5_parse_replies(struct prt_context *context, struct prt_handshake *hs,
+                     struct socks5_state *state)
+{
+	unsigned char *in = (unsigned char *)state->in;
+	unsigned int len;
+	int auth = (hs->username && hs->password);
+
+	for(;;) {
+		switch(state->reply) {
+			case SOCKS5_REPLY_METHOD:
+				if(state->inlen < 2)
+					return 0;
+				if(in[0] != 0x05 || in[1] != (auth ? 0x02 : 0x00)) {
+					if(in[0] == 0x05 && in[1] == 0xff)
+						fprintf(stderr, "Error: SOCKS5 server didn't accept our authentication method\n");
+					else
+						fprintf(stderr, "Error: Bad response from SOCKS5 server\n");
+					return -1;
+				}
+				len = 2;
+
+				state->reply = auth ? SOCKS5_REPLY_AUTH : SOCKS5_REPLY_CONNECT;
+				if(!state->pipelined) {
+					state->outlen = 0;
+					if(auth)
+						socks5_add_auth(hs, state);
+					else
+						socks5_add_request(hs, state);
+					socks5_send(state);
+				}
+				break;
+			case SOCKS5_REPLY_AUTH:
+				if(state->inlen < 2)
+					return 0;
+				if(in[0] != 0x01 || in[1] != 0x00) {
+					fprintf(stderr, "Error: SOCKS5 authentication failed\n");
+					return -1;
+				}
+				len = 2;
 
-		send(fd, buf, (3 + len + tmplen), 0);
+				state->reply = SOCKS5_REPLY_CONNECT;
+				if(!state->pipelined) {
+					state->outlen = 0;
+					socks5_add_request(hs, state);
+					socks5_send(state);
+				}
+				break;
+			case SOCKS5_REPLY_CONNECT:
+				/* version, reply, reserved, address type, address, port */
+				if(state->inlen < 5)
+					return 0;
+				if(in[0] != 0x05) {
+					fprintf(stderr, "Error: Bad response from SOCKS5 server\n");
+					return -1;
+				}
+				if(in[1] != 0x00) {
+					if(in[1] < sizeof(socks5_errors) / sizeof(socks5_errors[0]))
+						fprintf(stderr, "Error: SOCKS5 server couldn't connect: %s\n", socks5_errors[in[1]]);
+					else
+						fprintf(stderr, "Error: SOCKS5 server couldn't connect (reply %u)\n", in[1]);
+					return PRT_NEGOTIATE_REFUSED;
+				}
+				switch(in[3]) {
+					case 0x01:
+						len = 4 + 4 + 2;
+						break;
+					case 0x03:
+						len = 4 + 1 + in[4] + 2;
+						break;
+					case 0x04:
+						len = 4 + 16 + 2;
+						break;
+					default:
+						fprintf(stderr, "Error: Bad response from SOCKS5 server\n");
+						return -1;
+				}
+				if(state->inlen < len)
+					return 0;
 
-		if(read_byte(fd) != 0x01 || read_byte(fd) != 0x00) {
-			fprintf(stderr, "Error: SOCKS5 authentication failed\n");
-			close(fd);
-			return -1;
+				/* anything after the reply is already tunnel data */
+				if(state->inlen > len &&
+				   prt_relay_preload(context, 0, state->in + len, state->inlen - len) == -1)
+					return -1;
+				return 1;
 		}
-	}
 
-	buf[0] = 0x05;
-	buf[1] = 0x01;
-	buf[2] = 0x00;
-	buf[3] = 0x03;
-	len = (strlen(hostname) > 255) ? 255 : strlen(hostname);
-	buf[4] = (len & 0xff);
-	memcpy(buf + 5, hostname, len);
-	buf[5 + len] = (port >> 8);
-	buf[6 + len] = (port & 0xff);
-	send(fd, buf, (7 + len), 0);
-	if(read_byte(fd) != 0x05 || read_byte(fd) != 0x00) {
-		fprintf(stderr, "Error: Bad response from SOCKS5 server\n");
-		close(fd);
-		return -1;
+		state->inlen -= len;
+		memmove(state->in, state->in + len, state->inlen);
+		if(state->step == SOCKS5_SENDING)
+			return 0;
 	}
+}
 
-	read_byte(fd);
-	atyp = read_byte(fd);
-	if(atyp == 0x01) {
-		for(i = 0; i < 4; i++)
-			read_byte(fd);
-	} else if(atyp == 0x03) {
-		len = read_byte(fd);
-		for(i = 0; i < len; i++)
-			read_byte(fd);
-	} else {
-		fprintf(stderr, "Error: Bad response from SOCKS5 server\n");
-		close(fd);
-		return -1;
-	}
-	for(i = 0; i < 2; i++)
-		read_byte(fd);
+/*
+ * moves the exchange with the socks5 server along as far as it can
+ * go without blocking; see the negotiate member of struct prt_context
+ */
+int
+socks5_negotiate(struct prt_context *context)
+{
+	struct socks5_state *state = context->data;
+	struct prt_handshake hs;
+	int fd = context->remotefd;
+	int n;
 
-	return 0;
+	prt_chain_handshake(context, &hs);
+	for(;;) {
+		switch(state->step) {
+			case SOCKS5_CONNECTING:
+				switch(connection_status(fd)) {
+					case 0:
+						return PRT_EVENT_WRITE;
+					case -1:
+						fprintf(stderr, "Error: Unable to connect to SOCKS5 server %s:%u\n", hs.server->host, hs.server->port);
+						return -1;
+				}
+				fprintf(stderr, "Connected to SOCKS5 server %s:%u\n", hs.server->host, hs.server->port);
+				context->remote_connected = 1;
+
+				/*
+				 * we only offer one method, so we know what the server
+				 * will pick if it lets us in at all, and the rest of
+				 * the handshake can go out in the same write, unless
+				 * the server has choked on that before
+				 */
+				state->outlen = 0;
+				socks5_add_greeting(&hs, state);
+				state->pipelined = prt_upstream_can_pipeline(hs.server);
+				if(state->pipelined) {
+					if(hs.username && hs.password)
+						socks5_add_auth(&hs, state);
+					socks5_add_request(&hs, state);
+				}
+				state->reply = SOCKS5_REPLY_METHOD;
+				state->inlen = 0;
+				socks5_send(state);
+				break;
+			case SOCKS5_SENDING:
+				switch(send_pending(fd, state->out, state->outlen, &state->outpos)) {
+					case 0:
+						return PRT_EVENT_WRITE;
+					case -1:
+						fprintf(stderr, "Error: Couldn't send to SOCKS5 server\n");
+						return -1;
+				}
+				state->step = SOCKS5_READING;
+				break;
+			case SOCKS5_READING:
+				n = recv(fd, state->in + state->inlen, sizeof(state->in) - state->inlen, MSG_DONTWAIT);
+				if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+					return PRT_EVENT_READ;
+				if(n <= 0) {
+					fprintf(stderr, "Error: Bad response from SOCKS5 server\n");
+					/* it got as far as answering the greeting, and no further */
+					if(state->pipelined && state->reply != SOCKS5_REPLY_METHOD)
+						prt_upstream_no_pipelining(hs.server);
+					return -1;
+				}
+				state->inlen += n;
+
+				switch(socks5_parse_replies(context, &hs, state)) {
+					case 1:
+						return 0;
+					case -1:
+						return -1;
+					case PRT_NEGOTIATE_REFUSED:
+						return PRT_NEGOTIATE_REFUSED;
+				}
+				break;
+		}
+	}
 }
 
-/* connect to hostname:port via a socks5 proxy; returns file descriptor */
-static int
-socks5_connect_to(struct prt_context *context,
-                  char *hostname, unsigned short port,
-                  char *username, char *password, int server_timeout)
+/* connections go to the socks5 proxy */
+static char *
+socks5_get_server(struct prt_context *context, int *family)
 {
-	int fd;
-	struct hostent *host;
-
-	if(!proxyhost)
-		return -1;
+	if(!context->upstream)
+		return NULL;
 
 #ifdef IPV6
-	if(flags & PRT_IPV6)
-		host = gethostbyname2(proxyhost, AF_INET6);
-	else
-		host = gethostbyname2(proxyhost, AF_INET);
+	*family = (flags & PRT_IPV6) ? AF_INET6 : AF_INET;
 #else
-	host = gethostbyname(proxyhost);
+	*family = AF_INET;
 #endif /* IPV6 */
-	if(!host) {
-		fprintf(stderr, "Error: Unable to resolve hostname %s\n", proxyhost);
+	return context->upstream->host;
+}
+
+/*
+ * gets ready to set up a tunnel through a socks5 proxy over context's
+ * remote socket, which may be a tunnel through other proxies already
+ * (see chain.c). returns 0 on success or -1 on error.
+ */
+int
+socks5_start_hop(struct prt_context *context)
+{
+	struct socks5_state *state;
+
+	state = malloc(sizeof(struct socks5_state));
+	if(!state) {
+		fprintf(stderr, "socks5_start_hop(): Memory allocation failed\n");
 		return -1;
 	}
 
+	state->step = SOCKS5_CONNECTING;
+	context->data = state;
+
+	return 0;
+}
+
+/* start connecting to the socks5 proxy at address; returns file descriptor */
+static int
+socks5_connect_to(struct prt_context *context, int family, unsigned char *address)
+{
+	int fd;
+
 #ifdef IPV6
-	if(flags & PRT_IPV6)
-		fd = establish_connection6(host->h_addr, proxyport);
+	if(family == AF_INET6)
+		fd = establish_connection6(address, context->upstream->port);
 	else
-		fd = establish_connection(host->h_addr, proxyport);
+		fd = establish_connection(address, context->upstream->port);
 #else
-	fd = establish_connection(host->h_addr, proxyport);
+	fd = establish_connection(address, context->upstream->port);
 #endif /* IPV6 */
 	if(fd == -1) {
-		fprintf(stderr, "Error: Unable to connect to SOCKS5 server %s:%u\n", proxyhost, proxyport);
+		fprintf(stderr, "Error: Unable to connect to SOCKS5 server %s:%u\n", context->upstream->host, context->upstream->port);
 		return -1;
 	}
-
-	/* set remote server socket timeout if necessary */
-	if(server_timeout) {
-		struct timeval timeout_val;
-
-		timeout_val.tv_sec = server_timeout;
-		timeout_val.tv_usec = 0;
-		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, (void *)&timeout_val, sizeof(timeout_val));
-	}
-
-	fprintf(stderr, "Connected to SOCKS5 server %s:%u\n", proxyhost, proxyport);
-
-	if(socks5_negotiate(fd, hostname, port, username, password) == -1)
+	if(socks5_start_hop(context) == -1) {
+		close(fd);
 		return -1;
+	}
 
 	return fd;
 }
@@ -181,36 +390,42 @@ socks5_disconnect(struct prt_context *context)
 	shutdown(context->remotefd, SHUT_RDWR);
 	close(context->localfd);
 	close(context->remotefd);
+
+	if(context->data)
+		free(context->data);
+	context->data = NULL;
 }
 
 static int
 socks5_local_read(struct prt_context *context, char *buf, int size)
 {
-	return recv(context->localfd, buf, size, 0);
+	return recv(context->localfd, buf, size, MSG_DONTWAIT);
 }
 
 static int
 socks5_remote_read(struct prt_context *context, char *buf, int size)
 {
-	return recv(context->remotefd, buf, size, 0);
+	return recv(context->remotefd, buf, size, MSG_DONTWAIT);
 }
 
 static int
 socks5_local_send(struct prt_context *context, char *buf, int size)
 {
-	return send(context->localfd, buf, size, 0);
+	return send(context->localfd, buf, size, MSG_DONTWAIT);
 }
 
 static int
 socks5_remote_send(struct prt_context *context, char *buf, int size)
 {
-	return send(context->remotefd, buf, size, 0);
+	return send(context->remotefd, buf, size, MSG_DONTWAIT);
 }
 
 void
 socks5_set_context(struct prt_context *context)
 {
+	context->get_server = socks5_get_server;
 	context->connect = socks5_connect_to;
+	context->negotiate = socks5_negotiate;
 	context->disconnect = socks5_disconnect;
 	context->local_read = socks5_local_read;
 	context->local_send = socks5_local_send;
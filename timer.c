@@ -0,0 +1,479 @@
+/*
+ * Copyright (C) 2002-2006 Josh A. Beam
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * timers for a connection loop, kept on a timing wheel: a timer due
+ * within a revolution lives in the slot for the tick it's due on, so
+ * setting and cancelling one takes constant time, and each tick only
+ * looks at one slot, all of whose timers are due. a bitmap of which
+ * slots hold timers lets the loop find how long it can sleep without
+ * looking at the slots themselves.
+ *
+ * timers due further off (idle timeouts, mostly) wait in an overflow
+ * heap (a pairing heap, linked through the timers themselves) ordered
+ * by when they're due, and move onto the wheel once the wheel has
+ * turned far enough to hold them. the earliest is always at the top,
+ * so nothing has to be looked at before it's due, and the loop sleeps
+ * right up to it.
+ *
+ * deadlines are rounded up to the next tick, so a timer goes off up
+ * to PRT_TIMER_TICK milliseconds late (a 250 ms timer goes off at
+ * 250 ms, a 255 ms one at 260 ms), but never early.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <sys/types.h>
+#ifndef _WIN32
+#	include <time.h>
+#endif /* _WIN32 */
+#include "prtunnel.h"
+
+#define PRT_TIMER_TICK  10 /* milliseconds per slot */
+#define PRT_TIMER_SLOTS 1024 /* must be a power of two */
+
+/* the slot bitmap is kept in 32-bit words */
+#define PRT_TIMER_WORDS (PRT_TIMER_SLOTS / 32)
+
+/* values of prt_timer's pending */
+#define TIMER_IDLE    0
+#define TIMER_WAITING 1 /* in one of the wheel's slots */
+#define TIMER_EXPIRED 2 /* gone off, waiting to be handed out */
+#define TIMER_OVERFLOW 3 /* in the overflow heap */
+
+struct prt_timer_wheel {
+	struct prt_timer *slots[PRT_TIMER_SLOTS];
+	unsigned int occupied[PRT_TIMER_WORDS]; /* bit set for each non-empty slot */
+	struct prt_timer *overflow; /* top of the heap of timers due a revolution or more away */
+	struct prt_timer *expired;
+	unsigned long tick; /* first tick that hasn't been processed */
+	unsigned long start; /* clock reading that wheel time counts from */
+	unsigned int count; /* timers in slots */
+};
+
+/* returns a millisecond clock reading */
+static unsigned long
+clock_msecs()
+{
+#ifdef _WIN32
+	return GetTickCount();
+#else
+#ifdef CLOCK_MONOTONIC
+	struct timespec ts;
+
+	if(clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+		return (unsigned long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif /* CLOCK_MONOTONIC */
+	{
+		struct timeval tv;
+
+		gettimeofday(&tv, NULL);
+		return (unsigned long)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+	}
+#endif /* _WIN32 */
+}
+
+struct prt_timer_wheel *
+prt_timer_wheel_new()
+{
+	struct prt_timer_wheel *wheel;
+	unsigned int i;
+
+	wheel = malloc(sizeof(struct prt_timer_wheel));
+	if(!wheel) {
+		fprintf(stderr, "prt_timer_wheel_new(): Memory allocation failed\n");
+		return NULL;
+	}
+
+	for(i = 0; i < PRT_TIMER_SLOTS; i++)
+		wheel->slots[i] = NULL;
+	for(i = 0; i < PRT_TIMER_WORDS; i++)
+		wheel->occupied[i] = 0;
+	wheel->overflow = NULL;
+	wheel->expired = NULL;
+	wheel->tick = 0;
+	wheel->start = clock_msecs();
+	wheel->count = 0;
+
+	return wheel;
+}
+
+void
+prt_timer_wheel_free(struct prt_timer_wheel *wheel)
+{
+	free(wheel);
+}
+
+/*
+ * returns a millisecond clock reading that's the same for every wheel,
+ * for things shared between loops
+ */
+unsigned long
+prt_timer_clock()
+{
+	return clock_msecs();
+}
+
+/* returns a microsecond clock reading, for timing things that are quick */
+unsigned long
+prt_timer_usecs()
+{
+#ifdef _WIN32
+	return GetTickCount() * 1000;
+#else
+#ifdef CLOCK_MONOTONIC
+	struct timespec ts;
+
+	if(clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+		return (unsigned long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif /* CLOCK_MONOTONIC */
+	{
+		struct timeval tv;
+
+		gettimeofday(&tv, NULL);
+		return (unsigned long)tv.tv_sec * 1000000 + tv.tv_usec;
+	}
+#endif /* _WIN32 */
+}
+
+/* returns the wheel's time: milliseconds since it was created */
+unsigned long
+prt_timer_now(struct prt_timer_wheel *wheel)
+{
+	return clock_msecs() - wheel->start;
+}
+
+static void
+timer_link(struct prt_timer **list, struct prt_timer *timer)
+{
+	timer->next = *list;
+	if(timer->next)
+		timer->next->prevp = &timer->next;
+	timer->prevp = list;
+	*list = timer;
+}
+
+static void
+timer_unlink(struct prt_timer *timer)
+{
+	*timer->prevp = timer->next;
+	if(timer->next)
+		timer->next->prevp = timer->prevp;
+	timer->next = NULL;
+	timer->prevp = NULL;
+}
+
+/* puts timer in the slot for its tick */
+static void
+slot_add(struct prt_timer_wheel *wheel, struct prt_timer *timer)
+{
+	unsigned int slot = timer->expires & (PRT_TIMER_SLOTS - 1);
+
+	timer_link(&wheel->slots[slot], timer);
+	wheel->occupied[slot / 32] |= 1U << (slot % 32);
+	wheel->count++;
+}
+
+/* takes timer out of its slot */
+static void
+slot_remove(struct prt_timer_wheel *wheel, struct prt_timer *timer)
+{
+	unsigned int slot = timer->expires & (PRT_TIMER_SLOTS - 1);
+
+	timer_unlink(timer);
+	if(!wheel->slots[slot])
+		wheel->occupied[slot / 32] &= ~(1U << (slot % 32));
+	wheel->count--;
+}
+
+/*
+ * makes the heaps topped by a and b (either of which can be NULL) one,
+ * and returns its top; the later of the two becomes the first child of
+ * the other
+ */
+static struct prt_timer *
+heap_meld(struct prt_timer *a, struct prt_timer *b)
+{
+	struct prt_timer *tmp;
+
+	if(!a)
+		return b;
+	if(!b)
+		return a;
+	if(b->expires < a->expires) {
+		tmp = a;
+		a = b;
+		b = tmp;
+	}
+
+	timer_link(&a->child, b);
+	return a;
+}
+
+/*
+ * makes a list of sibling heaps, starting at first, one heap and
+ * returns its top: they're melded in pairs from the left, and the
+ * pairs melded together from the right, which keeps the heap shallow
+ */
+static struct prt_timer *
+heap_meld_siblings(struct prt_timer *first)
+{
+	struct prt_timer *a, *b, *pairs = NULL, *top = NULL;
+
+	while(first) {
+		a = first;
+		b = a->next;
+		first = b ? b->next : NULL;
+		a->next = NULL;
+		if(b)
+			b->next = NULL;
+		a = heap_meld(a, b);
+		a->next = pairs;
+		pairs = a;
+	}
+
+	while(pairs) {
+		a = pairs;
+		pairs = a->next;
+		a->next = NULL;
+		top = heap_meld(top, a);
+	}
+
+	return top;
+}
+
+/* makes top the top of the overflow heap */
+static void
+heap_set_top(struct prt_timer_wheel *wheel, struct prt_timer *top)
+{
+	wheel->overflow = top;
+	if(top) {
+		top->next = NULL;
+		top->prevp = &wheel->overflow;
+	}
+}
+
+/* puts timer in the overflow heap */
+static void
+heap_add(struct prt_timer_wheel *wheel, struct prt_timer *timer)
+{
+	timer->next = NULL;
+	timer->child = NULL;
+	heap_set_top(wheel, heap_meld(wheel->overflow, timer));
+}
+
+/* takes timer out of the overflow heap, wherever it is in it */
+static void
+heap_remove(struct prt_timer_wheel *wheel, struct prt_timer *timer)
+{
+	struct prt_timer *children;
+
+	children = heap_meld_siblings(timer->child);
+	timer->child = NULL;
+	if(timer == wheel->overflow) {
+		heap_set_top(wheel, children);
+	} else {
+		timer_unlink(timer);
+		heap_set_top(wheel, heap_meld(wheel->overflow, children));
+	}
+	timer->next = NULL;
+	timer->prevp = NULL;
+}
+
+/* returns the index of the lowest bit set in word, which isn't 0 */
+static unsigned int
+lowest_bit(unsigned int word)
+{
+	static const unsigned char debruijn[32] = {
+		0, 1, 28, 2, 29, 14, 24, 3, 30, 22, 20, 15, 25, 17, 4, 8,
+		31, 27, 13, 23, 21, 19, 16, 7, 26, 12, 18, 6, 11, 5, 10, 9
+	};
+
+	return debruijn[(((word & -word) * 0x077CB531U) & 0xffffffffU) >> 27];
+}
+
+/*
+ * returns how many slots after the current tick's the first one
+ * holding timers is, looking at no more than a bitmap word at a time;
+ * there has to be at least one timer
+ */
+static unsigned int
+first_occupied(struct prt_timer_wheel *wheel)
+{
+	unsigned int start, i, w, word;
+
+	start = wheel->tick & (PRT_TIMER_SLOTS - 1);
+	w = start / 32;
+
+	/* the current word, from the current slot on */
+	word = wheel->occupied[w] & (0xffffffffU << (start % 32));
+	if(word)
+		return w * 32 + lowest_bit(word) - start;
+
+	/* then the words after it, wrapping around to the current one */
+	for(i = 1; i <= PRT_TIMER_WORDS; i++) {
+		w = (start / 32 + i) % PRT_TIMER_WORDS;
+		word = wheel->occupied[w];
+		if(word)
+			return ((w * 32 + lowest_bit(word)) - start) & (PRT_TIMER_SLOTS - 1);
+	}
+
+	return 0;
+}
+
+void
+prt_timer_init(struct prt_timer *timer, void *arg)
+{
+	timer->next = NULL;
+	timer->prevp = NULL;
+	timer->child = NULL;
+	timer->pending = TIMER_IDLE;
+	timer->arg = arg;
+}
+
+void
+prt_timer_cancel(struct prt_timer_wheel *wheel, struct prt_timer *timer)
+{
+	if(timer->pending == TIMER_IDLE)
+		return;
+	if(timer->pending == TIMER_WAITING)
+		slot_remove(wheel, timer);
+	else if(timer->pending == TIMER_OVERFLOW)
+		heap_remove(wheel, timer);
+	else
+		timer_unlink(timer);
+	timer->pending = TIMER_IDLE;
+}
+
+/* (re)schedules timer to go off at when, in wheel time */
+void
+prt_timer_set(struct prt_timer_wheel *wheel, struct prt_timer *timer,
+              unsigned long when)
+{
+	unsigned long tick;
+
+	prt_timer_cancel(wheel, timer);
+
+	/* round up, so the timer never goes off early */
+	tick = (when + PRT_TIMER_TICK - 1) / PRT_TIMER_TICK;
+	if(tick < wheel->tick)
+		tick = wheel->tick;
+
+	timer->expires = tick;
+	if(tick - wheel->tick < PRT_TIMER_SLOTS) {
+		timer->pending = TIMER_WAITING;
+		slot_add(wheel, timer);
+	} else {
+		timer->pending = TIMER_OVERFLOW;
+		heap_add(wheel, timer);
+	}
+}
+
+/*
+ * returns how many milliseconds there are until the next timer goes
+ * off, or -1 if there aren't any timers. everything in the overflow
+ * heap is due after everything on the wheel, so it's the first
+ * non-empty slot (found from the bitmap) if there is one, and
+ * otherwise the top of the heap.
+ */
+int
+prt_timer_next(struct prt_timer_wheel *wheel)
+{
+	unsigned long next, now;
+
+	if(wheel->expired)
+		return 0;
+	if(wheel->count)
+		next = wheel->tick + first_occupied(wheel);
+	else if(wheel->overflow)
+		next = wheel->overflow->expires;
+	else
+		return -1;
+
+	next *= PRT_TIMER_TICK;
+	now = prt_timer_now(wheel);
+	if(next <= now)
+		return 0;
+	if(next - now > INT_MAX)
+		return INT_MAX;
+	return next - now;
+}
+
+/*
+ * returns the next timer that has gone off, or NULL if there are no
+ * more for now. the returned timer is idle again.
+ */
+struct prt_timer *
+prt_timer_expired(struct prt_timer_wheel *wheel)
+{
+	struct prt_timer *timer;
+	unsigned long end, n;
+
+	if(!wheel->expired) {
+		end = prt_timer_now(wheel) / PRT_TIMER_TICK;
+		if(end < wheel->tick)
+			return NULL;
+
+		/* after a long sleep, each slot only has to be looked at once */
+		n = end - wheel->tick + 1;
+		if(n > PRT_TIMER_SLOTS)
+			n = PRT_TIMER_SLOTS;
+
+		for(; n > 0; n--, wheel->tick++) {
+			while((timer = wheel->slots[wheel->tick & (PRT_TIMER_SLOTS - 1)])) {
+				slot_remove(wheel, timer);
+				timer->pending = TIMER_EXPIRED;
+				timer_link(&wheel->expired, timer);
+			}
+		}
+		wheel->tick = end + 1;
+
+		/*
+		 * the wheel now reaches further, so overflow timers it can
+		 * hold go onto it; any that are due already (after a long
+		 * sleep) go off now
+		 */
+		while((timer = wheel->overflow) && timer->expires < wheel->tick + PRT_TIMER_SLOTS) {
+			heap_remove(wheel, timer);
+			if(timer->expires <= end) {
+				timer->pending = TIMER_EXPIRED;
+				timer_link(&wheel->expired, timer);
+			} else {
+				timer->pending = TIMER_WAITING;
+				slot_add(wheel, timer);
+			}
+		}
+
+		if(!wheel->expired)
+			return NULL;
+	}
+
+	timer = wheel->expired;
+	timer_unlink(timer);
+	timer->pending = TIMER_IDLE;
+
+	return timer;
+}
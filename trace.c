@@ -0,0 +1,152 @@
+/*
+ * Copyright (C) 2002-2006 Josh A. Beam
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * setup traces: how long each step of setting a tunnel up took, from
+ * accepting the client to relaying. with --trace, every tunnel gets a
+ * record, one line of name=value pairs, written to a file; with
+ * --slow-setup, tunnels that took longer than that to set up get the
+ * same record in the log, whether or not they're traced otherwise.
+ *
+ * a record looks like this:
+ *
+ *   setup client=127.0.0.1:40312 remote=example.com:443 proxy=10.0.0.1:8080
+ *   result=ok attempts=1 accept=0.021 trust=0.004 socks=- resolve=0.187
+ *   connect=1.240 handshake=2.118 total=3.570
+ *
+ * (on one line), with times in milliseconds. each step's time runs from
+ * the end of the step before it; socks is the wait for the client's
+ * socks request, and is - without one. a tunnel that couldn't be set
+ * up has result=failed, and - for the steps it didn't finish; its total
+ * is how long it took to fail.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include "prtunnel.h"
+
+extern unsigned long prt_timer_usecs();
+
+/* where records go; NULL if nowhere */
+static FILE *trace_fp = NULL;
+
+/* setups that take longer than this, in milliseconds, are logged; 0 for none */
+static unsigned long slow_setup = 0;
+
+static const char *step_names[PRT_TRACE_MARKS] = {
+	NULL, "accept", "trust", "socks", "resolve", "connect", "handshake"
+};
+
+/*
+ * sets the file that every tunnel's record is appended to; - means
+ * standard error. returns 0 on success or -1 if it can't be opened.
+ */
+int
+set_trace_file(char *filename)
+{
+	if(strcmp(filename, "-") == 0) {
+		trace_fp = stderr;
+		return 0;
+	}
+
+	trace_fp = fopen(filename, "a");
+	if(!trace_fp) {
+		fprintf(stderr, "Error: Unable to open trace file %s: %s\n", filename, strerror(errno));
+		return -1;
+	}
+
+	/* each record goes out in one write, so loops' records don't mix */
+	setvbuf(trace_fp, NULL, _IOLBF, 0);
+	return 0;
+}
+
+void
+set_slow_setup(unsigned int msecs)
+{
+	slow_setup = msecs;
+}
+
+/* returns nonzero if setups are being traced at all */
+int
+prt_trace_wanted()
+{
+	return trace_fp || slow_setup;
+}
+
+/* appends usecs to s (of size bytes) as milliseconds, or - if reached is 0 */
+static void
+trace_time(char *s, size_t size, const char *name, unsigned long usecs, int reached)
+{
+	size_t len = strlen(s);
+
+	if(reached)
+		snprintf(s + len, size - len, " %s=%lu.%03lu", name, usecs / 1000, usecs % 1000);
+	else
+		snprintf(s + len, size - len, " %s=-", name);
+}
+
+/*
+ * writes out context's setup record, if it's wanted; client and port
+ * are where the client is, and ok is nonzero if the tunnel was set up
+ */
+void
+prt_trace_setup(struct prt_context *context, const char *client,
+                unsigned short port, int ok)
+{
+	char record[1024];
+	unsigned long *trace = context->trace;
+	unsigned long total;
+	int i, prev, slow;
+
+	total = (ok ? trace[PRT_TRACE_ESTABLISHED] : prt_timer_usecs()) - trace[PRT_TRACE_ACCEPT];
+	slow = slow_setup && total > slow_setup * 1000;
+	if(!trace_fp && !slow)
+		return;
+
+	snprintf(record, sizeof(record), "setup client=%s:%u remote=%s:%u", client, port,
+	         context->remotehost ? context->remotehost : "-", context->remoteport);
+	if(context->upstream) {
+		i = strlen(record);
+		snprintf(record + i, sizeof(record) - i, " proxy=%s:%u", context->upstream->host, context->upstream->port);
+	}
+	i = strlen(record);
+	snprintf(record + i, sizeof(record) - i, " result=%s attempts=%u", ok ? "ok" : "failed", context->attempts + 1);
+
+	/* each step runs from the last one that was got to before it */
+	prev = PRT_TRACE_ACCEPT;
+	for(i = PRT_TRACE_ACCEPTED; i < PRT_TRACE_MARKS; i++) {
+		trace_time(record, sizeof(record), step_names[i], trace[i] - trace[prev], trace[i] != 0);
+		if(trace[i])
+			prev = i;
+	}
+	trace_time(record, sizeof(record), "total", total, 1);
+
+	/* a slow one that would be logged anyway is only logged once */
+	if(trace_fp && !(slow && trace_fp == stderr))
+		fprintf(trace_fp, "%s\n", record);
+	if(slow)
+		fprintf(stderr, "Slow tunnel setup: %s\n", record);
+}
@@ -0,0 +1,619 @@
+/*
+ * Copyright (C) 2002-2006 Josh A. Beam
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * datagram relaying for socks5 UDP ASSOCIATE. each association has a
+ * socket the client sends its datagrams to, each with a socks5 header
+ * saying where it's going, and sockets that send the payloads on to
+ * their destinations and take the replies. the datagrams go straight
+ * to their destinations, whatever the tunneling mode; replies get a
+ * header saying where they came from and go back to the client. they
+ * count against the client's rate limits like tunnel data, and those
+ * over the limits are dropped.
+ *
+ * on linux, datagrams are moved in batches with recvmmsg() and
+ * sendmmsg(), so a busy association makes a couple of system calls
+ * per batch instead of a couple per datagram.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include "prtunnel.h"
+
+#ifdef __linux__
+#	define HAVE_RECVMMSG
+#	include <sys/uio.h>
+#endif /* __linux__ */
+
+#define PRT_UDP_BATCH 16 /* most datagrams moved per system call */
+#define PRT_UDP_DATAGRAM_MAX 4096 /* longer payloads are dropped */
+#define PRT_UDP_HEADER_MAX 262 /* longest socks5 UDP header (with a host name) */
+#define PRT_UDP_SLOT_SIZE (PRT_UDP_HEADER_MAX + PRT_UDP_DATAGRAM_MAX)
+#define PRT_UDP_NAME_TTL 10 /* seconds a looked up destination is used for */
+
+extern int flags;
+
+extern int set_nonblocking(int fd);
+
+/* limit functions */
+extern unsigned int prt_limit_take(struct prt_limit *limit, unsigned int worker, int outgoing, unsigned int want, unsigned long *wait);
+extern void prt_limit_return(struct prt_limit *limit, unsigned int worker, int outgoing, unsigned int n);
+
+/* resolver functions */
+extern struct prt_resolve_request *prt_resolve_start(struct prt_resolver *resolver, const char *hostname, int family, void *arg);
+extern void prt_resolve_cancel(struct prt_resolve_request *request);
+
+union prt_udp_address {
+	struct sockaddr sa;
+	struct sockaddr_in sin;
+#ifdef IPV6
+	struct sockaddr_in6 sin6;
+#endif /* IPV6 */
+};
+
+/* a datagram being moved through an association */
+struct prt_udp_datagram {
+	char *data;
+	int len; /* -1 if it's to be dropped */
+	union prt_udp_address addr; /* where it came from or is going */
+	unsigned int addrlen;
+};
+
+/*
+ * sets up an association for a client that sends its datagrams
+ * to clientfd. returns NULL on error; clientfd is then
+ * left for the caller to close.
+ */
+struct prt_udp_association *
+prt_udp_new(int clientfd)
+{
+	struct prt_udp_association *udp;
+
+	udp = malloc(sizeof(struct prt_udp_association));
+	if(!udp) {
+		fprintf(stderr, "prt_udp_new(): Memory allocation failed\n");
+		return NULL;
+	}
+	udp->buf = malloc(PRT_UDP_BATCH * PRT_UDP_SLOT_SIZE);
+	if(!udp->buf) {
+		fprintf(stderr, "prt_udp_new(): Memory allocation failed\n");
+		free(udp);
+		return NULL;
+	}
+
+	/* without one of them, only that family's destinations are out of reach */
+	udp->remotefd = socket(AF_INET, SOCK_DGRAM, 0);
+	if(udp->remotefd != -1 && set_nonblocking(udp->remotefd) == -1) {
+		close(udp->remotefd);
+		udp->remotefd = -1;
+	}
+	udp->remotefd6 = -1;
+#ifdef IPV6
+	udp->remotefd6 = socket(AF_INET6, SOCK_DGRAM, 0);
+	if(udp->remotefd6 != -1 && set_nonblocking(udp->remotefd6) == -1) {
+		close(udp->remotefd6);
+		udp->remotefd6 = -1;
+	}
+#endif /* IPV6 */
+	if((udp->remotefd == -1 && udp->remotefd6 == -1) || set_nonblocking(clientfd) == -1) {
+		fprintf(stderr, "prt_udp_new(): Unable to create socket\n");
+		if(udp->remotefd != -1)
+			close(udp->remotefd);
+		if(udp->remotefd6 != -1)
+			close(udp->remotefd6);
+		free(udp->buf);
+		free(udp);
+		return NULL;
+	}
+
+	udp->clientfd = clientfd;
+	udp->last_active = 0;
+	udp->client_known = 0;
+	udp->name = NULL;
+	udp->name_valid = 0;
+	udp->name_expires = 0;
+	udp->resolve_request = NULL;
+	udp->pending = NULL;
+	udp->pending_len = 0;
+	udp->pending_port = 0;
+
+	return udp;
+}
+
+void
+prt_udp_free(struct prt_udp_association *udp)
+{
+	close(udp->clientfd);
+	if(udp->remotefd != -1)
+		close(udp->remotefd);
+	if(udp->remotefd6 != -1)
+		close(udp->remotefd6);
+	if(udp->resolve_request)
+		prt_resolve_cancel(udp->resolve_request);
+	if(udp->name)
+		free(udp->name);
+	if(udp->pending)
+		free(udp->pending);
+	free(udp->buf);
+	free(udp);
+}
+
+/*
+ * reads up to n datagrams from fd, each into the size bytes at its
+ * data. returns the number read, which is less than n once there's
+ * nothing more waiting.
+ */
+static int
+udp_recv_batch(int fd, struct prt_udp_datagram *d, int n, int size)
+{
+#ifdef HAVE_RECVMMSG
+	struct mmsghdr msgs[PRT_UDP_BATCH];
+	struct iovec iov[PRT_UDP_BATCH];
+	int i;
+
+	memset(msgs, 0, sizeof(struct mmsghdr) * n);
+	for(i = 0; i < n; i++) {
+		iov[i].iov_base = d[i].data;
+		iov[i].iov_len = size;
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+		msgs[i].msg_hdr.msg_name = &d[i].addr;
+		msgs[i].msg_hdr.msg_namelen = sizeof(d[i].addr);
+	}
+
+	n = recvmmsg(fd, msgs, n, MSG_DONTWAIT, NULL);
+	if(n < 0)
+		return 0;
+	for(i = 0; i < n; i++) {
+		d[i].len = (msgs[i].msg_hdr.msg_flags & MSG_TRUNC) ? -1 : (int)msgs[i].msg_len;
+		d[i].addrlen = msgs[i].msg_hdr.msg_namelen;
+	}
+
+	return n;
+#else
+	int i, len;
+
+	for(i = 0; i < n; i++) {
+		d[i].addrlen = sizeof(d[i].addr);
+		len = recvfrom(fd, d[i].data, size, MSG_DONTWAIT, &d[i].addr.sa, &d[i].addrlen);
+		if(len < 0)
+			break;
+		d[i].len = len;
+	}
+
+	return i;
+#endif /* HAVE_RECVMMSG */
+}
+
+/*
+ * sends the datagrams in d that aren't to be dropped through fd.
+ * as with any datagram, those that can't be sent are lost.
+ */
+static void
+udp_send_batch(int fd, struct prt_udp_datagram *d, int n)
+{
+#ifdef HAVE_RECVMMSG
+	struct mmsghdr msgs[PRT_UDP_BATCH];
+	struct iovec iov[PRT_UDP_BATCH];
+	int i, count = 0, sent;
+
+	memset(msgs, 0, sizeof(struct mmsghdr) * n);
+	for(i = 0; i < n; i++) {
+		if(d[i].len < 0)
+			continue;
+		iov[count].iov_base = d[i].data;
+		iov[count].iov_len = d[i].len;
+		msgs[count].msg_hdr.msg_iov = &iov[count];
+		msgs[count].msg_hdr.msg_iovlen = 1;
+		msgs[count].msg_hdr.msg_name = &d[i].addr;
+		msgs[count].msg_hdr.msg_namelen = d[i].addrlen;
+		count++;
+	}
+
+	/* sendmmsg() stops at the first datagram it can't send; skip it */
+	for(i = 0; i < count; i += (sent > 0) ? sent : 1) {
+		sent = sendmmsg(fd, msgs + i, count - i, MSG_DONTWAIT);
+		if(sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+	}
+#else
+	int i;
+
+	for(i = 0; i < n; i++) {
+		if(d[i].len >= 0)
+			sendto(fd, d[i].data, d[i].len, MSG_DONTWAIT, &d[i].addr.sa, d[i].addrlen);
+	}
+#endif /* HAVE_RECVMMSG */
+}
+
+/* returns nonzero if addr has the same IP address as context's client */
+static int
+udp_from_client(struct prt_context *context, union prt_udp_address *addr)
+{
+#ifdef IPV6
+	if(flags & PRT_IPV6)
+		return (addr->sa.sa_family == AF_INET6 &&
+		        memcmp(&addr->sin6.sin6_addr, &context->sin6.sin6_addr, 16) == 0);
+#endif /* IPV6 */
+	return (addr->sa.sa_family == AF_INET &&
+	        memcmp(&addr->sin.sin_addr, &context->sin.sin_addr, 4) == 0);
+}
+
+/*
+ * returns nonzero if the rate limits let a datagram of len bytes go
+ * from the client (if outgoing is nonzero) or to it. waiting for the
+ * buckets to refill is no use to a datagram, so one they don't let
+ * through is dropped.
+ */
+static int
+udp_allowed(struct prt_context *context, int outgoing, int len)
+{
+	unsigned long wait;
+	unsigned int n;
+
+	if(len == 0)
+		return 1;
+	n = prt_limit_take(context->limit, context->worker, outgoing, len, &wait);
+	if(n < (unsigned int)len) {
+		if(n)
+			prt_limit_return(context->limit, context->worker, outgoing, n);
+		return 0;
+	}
+
+	return 1;
+}
+
+/* returns the socket that sends datagrams to addresses of family; -1 if there isn't one */
+static int
+udp_remote_socket(struct prt_udp_association *udp, int family)
+{
+	return (family == AF_INET) ? udp->remotefd : udp->remotefd6;
+}
+
+/* fills in addr with an address of the given family and a port */
+static void
+udp_set_address(union prt_udp_address *addr, unsigned int *addrlen,
+                int family, const unsigned char *address, unsigned short port)
+{
+	memset(addr, 0, sizeof(union prt_udp_address));
+#ifdef IPV6
+	if(family == AF_INET6) {
+		addr->sin6.sin6_family = AF_INET6;
+		addr->sin6.sin6_port = htons(port);
+		memcpy(&addr->sin6.sin6_addr, address, 16);
+		*addrlen = sizeof(struct sockaddr_in6);
+		return;
+	}
+#endif /* IPV6 */
+	addr->sin.sin_family = AF_INET;
+	addr->sin.sin_port = htons(port);
+	memcpy(&addr->sin.sin_addr, address, 4);
+	*addrlen = sizeof(struct sockaddr_in);
+}
+
+/*
+ * starts looking up the host name a datagram is going to, keeping
+ * the datagram until it's done. a datagram for the same name that
+ * comes along while another is waiting is dropped; one for a
+ * different name replaces it.
+ */
+static void
+udp_resolve(struct prt_context *context, struct prt_resolver *resolver,
+            const char *name, char *data, int len, unsigned short port)
+{
+	struct prt_udp_association *udp = context->udp;
+
+	if(!udp->name || strcmp(udp->name, name) != 0) {
+		if(udp->resolve_request) {
+			prt_resolve_cancel(udp->resolve_request);
+			udp->resolve_request = NULL;
+		}
+		if(udp->name)
+			free(udp->name);
+		/* the waiting datagram was for the old name */
+		if(udp->pending) {
+			free(udp->pending);
+			udp->pending = NULL;
+		}
+		udp->name = malloc(strlen(name) + 1);
+		if(!udp->name)
+			return;
+		strcpy(udp->name, name);
+		udp->name_valid = 0;
+	}
+
+	if(data && !udp->pending) {
+		udp->pending = malloc(len ? len : 1);
+		if(udp->pending) {
+			memcpy(udp->pending, data, len);
+			udp->pending_len = len;
+			udp->pending_port = port;
+		}
+	}
+
+	if(!udp->resolve_request) {
+#ifdef IPV6
+		udp->resolve_request = prt_resolve_start(resolver, name, AF_UNSPEC, context);
+#else
+		udp->resolve_request = prt_resolve_start(resolver, name, AF_INET, context);
+#endif /* IPV6 */
+	}
+}
+
+/*
+ * works out where a datagram from the client is going from its
+ * socks5 header, and points d at its payload. d's length is set to
+ * -1 if it can't be sent on right away.
+ */
+static void
+udp_parse_header(struct prt_context *context, struct prt_resolver *resolver,
+                 struct prt_udp_datagram *d, unsigned long now)
+{
+	struct prt_udp_association *udp = context->udp;
+	unsigned char *p = (unsigned char *)d->data;
+	char name[256];
+	unsigned int hlen;
+	unsigned short port;
+
+	/* reserved, fragment number, address type; fragments aren't supported */
+	if(d->len < 4 || p[0] != 0 || p[1] != 0 || p[2] != 0) {
+		d->len = -1;
+		return;
+	}
+
+	switch(p[3]) {
+		case 1: /* ipv4 */
+			hlen = 4 + 4 + 2;
+			break;
+		case 3: /* name */
+			hlen = (d->len > 4) ? 4 + 1 + p[4] + 2 : 5;
+			break;
+		case 4: /* ipv6 */
+			hlen = 4 + 16 + 2;
+			break;
+		default:
+			d->len = -1;
+			return;
+	}
+	if((unsigned int)d->len < hlen) {
+		d->len = -1;
+		return;
+	}
+	port = (p[hlen - 2] << 8) | p[hlen - 1];
+
+	switch(p[3]) {
+		case 1:
+			udp_set_address(&d->addr, &d->addrlen, AF_INET, p + 4, port);
+			break;
+		case 3:
+			memcpy(name, p + 5, p[4]);
+			name[p[4]] = '\0';
+
+			/* addresses we have are used while they're looked up again */
+			if(udp->name && strcmp(udp->name, name) == 0 && udp->name_valid) {
+				udp_set_address(&d->addr, &d->addrlen, udp->name_family, udp->name_address, port);
+				if(now >= udp->name_expires)
+					udp_resolve(context, resolver, name, NULL, 0, port);
+			} else {
+				udp_resolve(context, resolver, name, d->data + hlen, d->len - hlen, port);
+				d->len = -1;
+				return;
+			}
+			break;
+		case 4:
+#ifdef IPV6
+			udp_set_address(&d->addr, &d->addrlen, AF_INET6, p + 4, port);
+			break;
+#else
+			d->len = -1;
+			return;
+#endif /* IPV6 */
+	}
+
+	d->data += hlen;
+	d->len -= hlen;
+	if(udp_remote_socket(udp, d->addr.sa.sa_family) == -1 || !udp_allowed(context, 1, d->len)) {
+		d->len = -1;
+		return;
+	}
+	context->bytes_sent += d->len;
+}
+
+/* sends on the datagrams the client has sent */
+static void
+udp_from_client_relay(struct prt_context *context, struct prt_resolver *resolver,
+                      unsigned long now)
+{
+	struct prt_udp_association *udp = context->udp;
+	struct prt_udp_datagram in[PRT_UDP_BATCH], out4[PRT_UDP_BATCH], out6[PRT_UDP_BATCH];
+	int i, n, n4, n6;
+
+	do {
+		for(i = 0; i < PRT_UDP_BATCH; i++)
+			in[i].data = udp->buf + i * PRT_UDP_SLOT_SIZE;
+		n = udp_recv_batch(udp->clientfd, in, PRT_UDP_BATCH, PRT_UDP_SLOT_SIZE);
+
+		n4 = n6 = 0;
+		for(i = 0; i < n; i++) {
+			/* only the client that set up the association gets to use it */
+			if(in[i].len < 0 || !udp_from_client(context, &in[i].addr))
+				continue;
+#ifdef IPV6
+			if(flags & PRT_IPV6)
+				memcpy(&udp->client_sin6, &in[i].addr.sin6, sizeof(struct sockaddr_in6));
+			else
+#endif /* IPV6 */
+				memcpy(&udp->client_sin, &in[i].addr.sin, sizeof(struct sockaddr_in));
+			udp->client_known = 1;
+			udp->last_active = now;
+
+			udp_parse_header(context, resolver, &in[i], now);
+			if(in[i].len < 0)
+				continue;
+			if(in[i].addr.sa.sa_family == AF_INET)
+				out4[n4++] = in[i];
+			else
+				out6[n6++] = in[i];
+		}
+
+		if(n4)
+			udp_send_batch(udp->remotefd, out4, n4);
+		if(n6)
+			udp_send_batch(udp->remotefd6, out6, n6);
+	} while(n == PRT_UDP_BATCH);
+}
+
+/*
+ * puts a socks5 UDP header saying where d came from in front of it,
+ * and addresses it to the client
+ */
+static void
+udp_add_header(struct prt_udp_association *udp, struct prt_udp_datagram *d)
+{
+	unsigned char *p;
+
+	if(d->addr.sa.sa_family == AF_INET) {
+		d->data -= 4 + 4 + 2;
+		d->len += 4 + 4 + 2;
+		p = (unsigned char *)d->data;
+		p[3] = 1;
+		memcpy(p + 4, &d->addr.sin.sin_addr, 4);
+		memcpy(p + 8, &d->addr.sin.sin_port, 2);
+	}
+#ifdef IPV6
+	else {
+		d->data -= 4 + 16 + 2;
+		d->len += 4 + 16 + 2;
+		p = (unsigned char *)d->data;
+		p[3] = 4;
+		memcpy(p + 4, &d->addr.sin6.sin6_addr, 16);
+		memcpy(p + 20, &d->addr.sin6.sin6_port, 2);
+	}
+#endif /* IPV6 */
+	p[0] = p[1] = p[2] = 0;
+
+#ifdef IPV6
+	if(flags & PRT_IPV6) {
+		memcpy(&d->addr.sin6, &udp->client_sin6, sizeof(struct sockaddr_in6));
+		d->addrlen = sizeof(struct sockaddr_in6);
+	} else
+#endif /* IPV6 */
+	{
+		memcpy(&d->addr.sin, &udp->client_sin, sizeof(struct sockaddr_in));
+		d->addrlen = sizeof(struct sockaddr_in);
+	}
+}
+
+/* passes the replies that have come in on fd back to the client */
+static void
+udp_to_client_relay(struct prt_context *context, int fd, unsigned long now)
+{
+	struct prt_udp_association *udp = context->udp;
+	struct prt_udp_datagram d[PRT_UDP_BATCH];
+	int i, n;
+
+	do {
+		/* leave room for the header in front of each one */
+		for(i = 0; i < PRT_UDP_BATCH; i++)
+			d[i].data = udp->buf + i * PRT_UDP_SLOT_SIZE + PRT_UDP_HEADER_MAX;
+		n = udp_recv_batch(fd, d, PRT_UDP_BATCH, PRT_UDP_DATAGRAM_MAX);
+		if(n == 0 || !udp->client_known)
+			continue;
+
+		for(i = 0; i < n; i++) {
+			if(d[i].len < 0)
+				continue;
+			if(!udp_allowed(context, 0, d[i].len)) {
+				d[i].len = -1;
+				continue;
+			}
+			context->bytes_rcvd += d[i].len;
+			udp_add_header(udp, &d[i]);
+		}
+		udp->last_active = now;
+
+		udp_send_batch(udp->clientfd, d, n);
+	} while(n == PRT_UDP_BATCH);
+}
+
+/*
+ * moves the datagrams waiting on fd, one of the sockets of context's
+ * association, on to where they're going
+ */
+void
+prt_udp_relay(struct prt_context *context, struct prt_resolver *resolver,
+              int fd, unsigned long now)
+{
+	if(fd == context->udp->clientfd)
+		udp_from_client_relay(context, resolver, now);
+	else
+		udp_to_client_relay(context, fd, now);
+}
+
+/*
+ * called when the lookup of a host name a datagram was going to is
+ * done; sends that datagram on if it's still waiting
+ */
+void
+prt_udp_resolved(struct prt_context *context, struct prt_resolve_request *request,
+                 unsigned long now)
+{
+	struct prt_udp_association *udp = context->udp;
+	struct prt_udp_datagram d;
+	unsigned int i;
+
+	udp->resolve_request = NULL;
+	udp->name_valid = 0;
+	if(request->status == -1) {
+		fprintf(stderr, "Error: Unable to resolve hostname %s\n", request->hostname);
+	} else {
+		/* the first address of a family we have a socket for */
+		for(i = 0; i < request->num_addresses && !udp->name_valid; i++) {
+			if(udp_remote_socket(udp, request->addresses[i].family) == -1)
+				continue;
+			udp->name_family = request->addresses[i].family;
+			memcpy(udp->name_address, request->addresses[i].address, 16);
+			udp->name_valid = 1;
+			udp->name_expires = now + PRT_UDP_NAME_TTL * 1000;
+		}
+		if(!udp->name_valid)
+			fprintf(stderr, "Error: No address of %s can be sent to\n", request->hostname);
+	}
+
+	if(!udp->pending)
+		return;
+	if(udp->name_valid && udp_allowed(context, 1, udp->pending_len)) {
+		d.data = udp->pending;
+		d.len = udp->pending_len;
+		udp_set_address(&d.addr, &d.addrlen, udp->name_family, udp->name_address, udp->pending_port);
+		context->bytes_sent += d.len;
+		udp_send_batch(udp_remote_socket(udp, udp->name_family), &d, 1);
+	}
+	free(udp->pending);
+	udp->pending = NULL;
+}
@@ -0,0 +1,591 @@
+/*
+ * Copyright (C) 2002-2006 Josh A. Beam
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * the proxy servers tunnels can go through. each new tunnel takes the
+ * upstream that looks best at the time: with least-conn balancing,
+ * the one with the fewest tunnels in use (the quickest one on a tie),
+ * and with ewma balancing, the one with the lowest moving average of
+ * connect and handshake time, scaled by the tunnels it already has,
+ * so a fast proxy gets more of the load without getting all of it.
+ *
+ * every failed attempt to set a tunnel up through an upstream counts
+ * against it, as do failed health checks if they're turned on. after
+ * a few failures in a row it's taken out of use for a while, twice as
+ * long each time it fails again; once that's over, one tunnel (or
+ * health check) gets to try it, and it's back in use if that works.
+ *
+ * the last few hundred setup times, whichever upstream they were
+ * through, are also kept, so hedged tunnels know how long is unusually
+ * long to wait.
+ *
+ * the upstreams are shared by all connection loops.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#ifndef _WIN32
+#	include <sys/time.h>
+#	include <unistd.h>
+#	include <pthread.h>
+#endif /* _WIN32 */
+#include "prtunnel.h"
+
+/* connect functions */
+extern int resolve_host(const char *hostname, int family, unsigned char *address);
+extern int establish_connection(unsigned char address[4], unsigned short port);
+#ifdef IPV6
+extern int establish_connection6(unsigned char address[16], unsigned short port);
+#endif /* IPV6 */
+extern int connection_status(int fd);
+
+extern unsigned long current_seconds();
+
+extern int flags;
+
+/* ways of picking an upstream */
+#define PRT_BALANCE_LEAST_CONN 0
+#define PRT_BALANCE_EWMA       1
+
+/* failures in a row before an upstream is taken out of use */
+#define PRT_UPSTREAM_FAILURES 3
+
+/* how long it's taken out for the first time, and at most, in seconds */
+#define PRT_UPSTREAM_BACKOFF     2
+#define PRT_UPSTREAM_BACKOFF_MAX 64
+
+/* longest a health check waits for a connection, in seconds */
+#define PRT_UPSTREAM_CHECK_TIMEOUT 5
+
+/* how long a socks5 server that chokes on pipelined handshakes isn't sent them, in seconds */
+#define PRT_UPSTREAM_PIPELINE_RETRY 600
+
+/*
+ * setup times kept for working out percentiles, how many there have
+ * to be before there's anything to work out, and how many new ones
+ * there have to be before it's worked out again
+ */
+#define PRT_SETUP_TIMES         256
+#define PRT_SETUP_TIMES_MIN     16
+#define PRT_SETUP_TIMES_REFRESH 16
+
+static struct prt_upstream upstreams[PRT_UPSTREAMS_MAX];
+static unsigned int num_upstreams = 0;
+static unsigned int next_upstream = 0; /* where ties are broken from */
+static int balance = PRT_BALANCE_EWMA;
+static unsigned int check_interval = 0; /* seconds between health checks; 0 for none */
+
+/* recent setup times, in ms, as a ring */
+static unsigned long setup_times[PRT_SETUP_TIMES];
+static unsigned int num_setup_times = 0;
+static unsigned int next_setup_time = 0;
+static unsigned int new_setup_times = 0; /* since hedge_delay was worked out */
+static unsigned int hedge_percentile = 0; /* 0 for no hedging */
+static unsigned long hedge_delay = 0;
+#ifndef _WIN32
+static pthread_mutex_t upstream_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif /* _WIN32 */
+
+/*
+ * sets how upstreams are picked; name is least-conn or ewma.
+ * returns 0 on success or -1 if name isn't known.
+ */
+int
+set_balance_method(const char *name)
+{
+	if(strcmp(name, "least-conn") == 0)
+		balance = PRT_BALANCE_LEAST_CONN;
+	else if(strcmp(name, "ewma") == 0)
+		balance = PRT_BALANCE_EWMA;
+	else
+		return -1;
+
+	return 0;
+}
+
+/* sets the number of seconds between health checks; 0 turns them off */
+void
+set_health_check_interval(unsigned int seconds)
+{
+	check_interval = seconds;
+}
+
+/*
+ * sets the percentile of recent setup times a tunnel can take before
+ * a hedge is started; 0 turns hedging off
+ */
+void
+set_hedge_percentile(unsigned int percentile)
+{
+	hedge_percentile = percentile;
+}
+
+/*
+ * sets up a proxy server given as host, host:port or [address]:port;
+ * port is used if there's no port in it. returns 0 on success or -1
+ * on error.
+ */
+int
+prt_upstream_init(struct prt_upstream *up, const char *spec, unsigned short port)
+{
+	const char *colon;
+	char *host;
+	unsigned int len;
+
+	/* an IPv6 address only has a port after it in brackets */
+	colon = strrchr(spec, ':');
+	if(spec[0] == '[') {
+		spec++;
+		len = strcspn(spec, "]");
+		colon = (spec[len] == ']' && spec[len + 1] == ':') ? spec + len + 1 : NULL;
+	} else if(colon && strchr(spec, ':') != colon) {
+		colon = NULL;
+		len = strlen(spec);
+	} else {
+		len = colon ? (unsigned int)(colon - spec) : strlen(spec);
+	}
+	if(colon) {
+		port = atoi(colon + 1);
+		if(port == 0) {
+			fprintf(stderr, "Error: Invalid proxy server port in `%s'\n", spec);
+			return -1;
+		}
+	}
+
+	host = malloc(len + 1);
+	if(!host) {
+		fprintf(stderr, "prt_upstream_init(): Memory allocation failed\n");
+		return -1;
+	}
+	memcpy(host, spec, len);
+	host[len] = '\0';
+
+	up->host = host;
+	up->port = port;
+	up->active = 0;
+	up->latency = 0;
+	up->samples = 0;
+	up->pipeline_retry_at = 0;
+	up->index = 0;
+	up->failures = 0;
+	up->ejections = 0;
+	up->retry_at = 0;
+	up->trial = 0;
+
+	return 0;
+}
+
+/*
+ * adds an upstream given as for prt_upstream_init(). returns 0 on
+ * success or -1 on error.
+ */
+int
+prt_upstream_add(const char *spec, unsigned short port)
+{
+	if(num_upstreams == PRT_UPSTREAMS_MAX) {
+		fprintf(stderr, "Error: Too many proxy servers (at most %u)\n", PRT_UPSTREAMS_MAX);
+		return -1;
+	}
+	if(prt_upstream_init(&upstreams[num_upstreams], spec, port) == -1)
+		return -1;
+	upstreams[num_upstreams].index = num_upstreams;
+	num_upstreams++;
+
+	return 0;
+}
+
+/* returns the number of upstreams that have been added */
+unsigned int
+prt_upstream_count()
+{
+	return num_upstreams;
+}
+
+/*
+ * returns how good a pick up is; lower is better. upstreams that
+ * haven't been timed yet score best, so each of them gets tried. the
+ * average counts as at least a millisecond, so load still matters
+ * between proxies that answer right away.
+ */
+static unsigned long
+upstream_score(struct prt_upstream *up)
+{
+	if(balance == PRT_BALANCE_LEAST_CONN)
+		return up->active;
+
+	return (up->latency + 8) * (up->active + 1);
+}
+
+/*
+ * returns nonzero if a new tunnel can go through up at time now: it
+ * isn't taken out of use, and if it's just coming back, nothing else
+ * is trying it yet
+ */
+static int
+upstream_usable(struct prt_upstream *up, unsigned long now)
+{
+	if(!up->ejections)
+		return 1;
+	return (now >= up->retry_at && !up->trial);
+}
+
+/*
+ * picks the upstream a new tunnel should go through and counts the
+ * tunnel against it; prt_upstream_release() has to be called once the
+ * tunnel is done with it. upstreams with their bit set in exclude (by
+ * index) aren't considered. if every other upstream is out of use, a
+ * new tunnel (one with nothing excluded) gets the one that's due back
+ * soonest rather than nothing. *trial is set if the tunnel is the one
+ * trying an upstream that's coming back. returns NULL if there's
+ * nothing to pick.
+ */
+struct prt_upstream *
+prt_upstream_pick(unsigned long exclude, int *trial)
+{
+	struct prt_upstream *best = NULL, *up;
+	unsigned long score, best_score = 0, now;
+	unsigned int i;
+
+	if(!num_upstreams)
+		return NULL;
+
+	now = current_seconds();
+#ifndef _WIN32
+	pthread_mutex_lock(&upstream_lock);
+#endif /* _WIN32 */
+	/* ties go round robin */
+	for(i = 0; i < num_upstreams; i++) {
+		up = &upstreams[(next_upstream + i) % num_upstreams];
+		if((exclude & (1UL << up->index)) || !upstream_usable(up, now))
+			continue;
+		score = upstream_score(up);
+		if(!best || score < best_score ||
+		   (score == best_score && up->latency < best->latency)) {
+			best = up;
+			best_score = score;
+		}
+	}
+	if(!best && !exclude) {
+		for(i = 0; i < num_upstreams; i++) {
+			up = &upstreams[i];
+			if(!best || up->retry_at < best->retry_at)
+				best = up;
+		}
+	}
+	next_upstream = (next_upstream + 1) % num_upstreams;
+	*trial = 0;
+	if(best) {
+		if(best->ejections)
+			best->trial = *trial = 1;
+		best->active++;
+	}
+#ifndef _WIN32
+	pthread_mutex_unlock(&upstream_lock);
+#endif /* _WIN32 */
+
+	return best;
+}
+
+/*
+ * a tunnel is done with up; trial is nonzero if it was still trying
+ * up (see prt_upstream_pick()), in which case something else can now
+ */
+void
+prt_upstream_release(struct prt_upstream *up, int trial)
+{
+#ifndef _WIN32
+	pthread_mutex_lock(&upstream_lock);
+#endif /* _WIN32 */
+	up->active--;
+	if(trial)
+		up->trial = 0;
+#ifndef _WIN32
+	pthread_mutex_unlock(&upstream_lock);
+#endif /* _WIN32 */
+}
+
+/* something worked through up; call with upstream_lock held */
+static void
+upstream_succeeded(struct prt_upstream *up)
+{
+	if(up->ejections) {
+		fprintf(stderr, "Proxy server %s:%u is working again\n", up->host, up->port);
+		up->pipeline_retry_at = 0; /* it may well have been fixed */
+	}
+	up->failures = 0;
+	up->ejections = 0;
+	up->trial = 0;
+}
+
+/*
+ * adds the time it took to connect to and set a tunnel up through up,
+ * in milliseconds, to its moving average. as with TCP's smoothed RTT,
+ * each sample counts for an eighth, and the average is kept scaled by
+ * eight so small differences aren't lost.
+ */
+void
+prt_upstream_sample(struct prt_upstream *up, unsigned long msecs)
+{
+#ifndef _WIN32
+	pthread_mutex_lock(&upstream_lock);
+#endif /* _WIN32 */
+	if(up->samples++ == 0)
+		up->latency = msecs << 3;
+	else
+		up->latency += msecs - (up->latency >> 3);
+	upstream_succeeded(up);
+
+	setup_times[next_setup_time] = msecs;
+	next_setup_time = (next_setup_time + 1) % PRT_SETUP_TIMES;
+	if(num_setup_times < PRT_SETUP_TIMES)
+		num_setup_times++;
+	new_setup_times++;
+#ifndef _WIN32
+	pthread_mutex_unlock(&upstream_lock);
+#endif /* _WIN32 */
+}
+
+static int
+compare_times(const void *a, const void *b)
+{
+	unsigned long x = *(const unsigned long *)a, y = *(const unsigned long *)b;
+
+	return (x < y) ? -1 : (x > y);
+}
+
+/*
+ * returns how long, in ms, a tunnel can take to be set up before it's
+ * worth also trying another upstream: the hedge percentile of recent
+ * setup times. returns 0 if tunnels shouldn't be hedged, because
+ * hedging is off, there's nothing else to try, or there aren't enough
+ * setup times yet to tell.
+ */
+unsigned long
+prt_upstream_hedge_delay()
+{
+	unsigned long sorted[PRT_SETUP_TIMES];
+	unsigned long delay;
+	unsigned int i;
+
+	if(!hedge_percentile || num_upstreams < 2)
+		return 0;
+
+#ifndef _WIN32
+	pthread_mutex_lock(&upstream_lock);
+#endif /* _WIN32 */
+	if(num_setup_times >= PRT_SETUP_TIMES_MIN &&
+	   (!hedge_delay || new_setup_times >= PRT_SETUP_TIMES_REFRESH)) {
+		memcpy(sorted, setup_times, num_setup_times * sizeof(unsigned long));
+		qsort(sorted, num_setup_times, sizeof(unsigned long), compare_times);
+		i = num_setup_times * hedge_percentile / 100;
+		if(i >= num_setup_times)
+			i = num_setup_times - 1;
+		hedge_delay = sorted[i] ? sorted[i] : 1;
+		new_setup_times = 0;
+	}
+	delay = hedge_delay;
+#ifndef _WIN32
+	pthread_mutex_unlock(&upstream_lock);
+#endif /* _WIN32 */
+
+	return delay;
+}
+
+/*
+ * a tunnel (or health check) couldn't be set up through up. while up
+ * is out of use, only the failure of whatever is trying it (trial is
+ * nonzero) counts, and that alone takes it out again; tunnels that
+ * were already going through it when it was taken out don't.
+ */
+void
+prt_upstream_failed(struct prt_upstream *up, int trial)
+{
+	unsigned long backoff;
+
+#ifndef _WIN32
+	pthread_mutex_lock(&upstream_lock);
+#endif /* _WIN32 */
+	up->failures++;
+	if(up->ejections ? trial : up->failures >= PRT_UPSTREAM_FAILURES) {
+		backoff = PRT_UPSTREAM_BACKOFF;
+		if(up->ejections < 16)
+			backoff <<= up->ejections;
+		if(backoff > PRT_UPSTREAM_BACKOFF_MAX || up->ejections >= 16)
+			backoff = PRT_UPSTREAM_BACKOFF_MAX;
+		fprintf(stderr, "Proxy server %s:%u is failing; not using it for %lu seconds\n", up->host, up->port, backoff);
+		up->retry_at = current_seconds() + backoff;
+		up->ejections++;
+		up->failures = 0;
+		up->trial = 0;
+	}
+#ifndef _WIN32
+	pthread_mutex_unlock(&upstream_lock);
+#endif /* _WIN32 */
+}
+
+/* returns nonzero if a socks5 handshake with up can be sent all at once */
+int
+prt_upstream_can_pipeline(struct prt_upstream *up)
+{
+	int ok;
+
+#ifndef _WIN32
+	pthread_mutex_lock(&upstream_lock);
+#endif /* _WIN32 */
+	ok = (!up->pipeline_retry_at || current_seconds() >= up->pipeline_retry_at);
+	if(ok)
+		up->pipeline_retry_at = 0;
+#ifndef _WIN32
+	pthread_mutex_unlock(&upstream_lock);
+#endif /* _WIN32 */
+
+	return ok;
+}
+
+/*
+ * up answered the greeting of a pipelined socks5 handshake, then gave
+ * up on the rest; handshakes with it go one step at a time for a while
+ */
+void
+prt_upstream_no_pipelining(struct prt_upstream *up)
+{
+#ifndef _WIN32
+	pthread_mutex_lock(&upstream_lock);
+#endif /* _WIN32 */
+	if(!up->pipeline_retry_at)
+		fprintf(stderr, "Note: SOCKS5 server %s:%u doesn't seem to handle pipelined requests; no longer pipelining\n", up->host, up->port);
+	up->pipeline_retry_at = current_seconds() + PRT_UPSTREAM_PIPELINE_RETRY;
+#ifndef _WIN32
+	pthread_mutex_unlock(&upstream_lock);
+#endif /* _WIN32 */
+}
+
+#ifndef _WIN32
+/*
+ * tries connecting to up, waiting at most timeout seconds. returns 1
+ * if that works or 0 if it doesn't.
+ */
+static int
+upstream_check(struct prt_upstream *up, unsigned int timeout)
+{
+	unsigned char address[16];
+	struct timeval tv;
+	fd_set wfds;
+	int family, fd, ok;
+
+#ifdef IPV6
+	family = (flags & PRT_IPV6) ? AF_INET6 : AF_INET;
+#else
+	family = AF_INET;
+#endif /* IPV6 */
+	if(resolve_host(up->host, family, address) == -1)
+		return 0;
+#ifdef IPV6
+	if(family == AF_INET6)
+		fd = establish_connection6(address, up->port);
+	else
+#endif /* IPV6 */
+		fd = establish_connection(address, up->port);
+	if(fd == -1)
+		return 0;
+	if(fd >= FD_SETSIZE) {
+		close(fd);
+		return 1; /* no way to wait for it; don't hold it against up */
+	}
+
+	FD_ZERO(&wfds);
+	FD_SET(fd, &wfds);
+	tv.tv_sec = timeout;
+	tv.tv_usec = 0;
+	ok = (select(fd + 1, NULL, &wfds, NULL, &tv) > 0 && connection_status(fd) == 1);
+	close(fd);
+
+	return ok;
+}
+
+/*
+ * checks each upstream every check_interval seconds, except those that
+ * are out of use and not due back yet
+ */
+static void *
+upstream_check_thread(void *arg)
+{
+	struct prt_upstream *up;
+	unsigned int i, timeout;
+	int due, trial;
+
+	timeout = check_interval < PRT_UPSTREAM_CHECK_TIMEOUT ? check_interval : PRT_UPSTREAM_CHECK_TIMEOUT;
+	for(;;) {
+		sleep(check_interval);
+		for(i = 0; i < num_upstreams; i++) {
+			up = &upstreams[i];
+
+			pthread_mutex_lock(&upstream_lock);
+			due = upstream_usable(up, current_seconds());
+			trial = (due && up->ejections);
+			if(trial)
+				up->trial = 1;
+			pthread_mutex_unlock(&upstream_lock);
+			if(!due)
+				continue;
+
+			if(upstream_check(up, timeout)) {
+				pthread_mutex_lock(&upstream_lock);
+				upstream_succeeded(up);
+				pthread_mutex_unlock(&upstream_lock);
+			} else {
+				fprintf(stderr, "Health check of proxy server %s:%u failed\n", up->host, up->port);
+				prt_upstream_failed(up, trial);
+			}
+		}
+	}
+
+	return arg;
+}
+#endif /* _WIN32 */
+
+/*
+ * starts checking on the upstreams in the background, if health checks
+ * are turned on. returns 0 on success or -1 on error.
+ */
+int
+prt_upstream_start_checks()
+{
+#ifndef _WIN32
+	pthread_t thread;
+
+	if(!check_interval || !num_upstreams)
+		return 0;
+	if(pthread_create(&thread, NULL, upstream_check_thread, NULL) != 0) {
+		fprintf(stderr, "Error: Couldn't start health check thread\n");
+		return -1;
+	}
+	pthread_detach(thread);
+#endif /* _WIN32 */
+
+	return 0;
+}